@@ -0,0 +1,51 @@
+#!/bin/bash
+# Measures how the parallel batch mode scales with the number of worker threads.
+#
+# Usage: bench/batch_scaling.sh [records] [max_jobs]
+# Generates `records` random expressions (one per line), then runs `./expr -j N` for
+# N = 1, 2, 4, ... up to `max_jobs` (default: the number of CPUs) and prints one line
+# per run: jobs, seconds, MB/s and speedup over one job. Outputs are checked to be
+# identical for every N.
+
+RECORDS=${1:-200000}
+MAX_JOBS=${2:-$(nproc)}
+CORPUS=$(mktemp /tmp/expr_batch.XXXXXX)
+trap 'rm -f "$CORPUS" "$CORPUS.out"' EXIT
+
+cd "$(dirname "$0")/.." || exit 1
+make -s expr || exit 1
+
+awk -v n="$RECORDS" 'BEGIN{
+    srand(42);
+    split("add sub mul div mod pow", ops, " ");
+    for(i = 0; i < n; i++){ print gen(6); }
+}
+function gen(d,    r){
+    if(d == 0 || rand() < 0.2){ return int(rand() * 1000); }
+    r = rand();
+    if(r < 0.1){ return "tern(" gen(d - 1) ", " gen(d - 1) ", " gen(d - 1) ")"; }
+    return ops[int(rand() * 6) + 1] "(" gen(d - 1) ", " gen(d - 1) ")";
+}' > "$CORPUS"
+
+BYTES=$(wc -c < "$CORPUS")
+echo "records=$RECORDS bytes=$BYTES cpus=$(nproc)"
+printf "%6s %10s %10s %8s\n" jobs seconds MB/s speedup
+
+BASE=
+REF=
+JOBS=1
+while [ "$JOBS" -le "$MAX_JOBS" ]; do
+    START=$(date +%s.%N)
+    ./expr -j "$JOBS" "$CORPUS" > "$CORPUS.out"
+    END=$(date +%s.%N)
+
+    SUM=$(md5sum < "$CORPUS.out")
+    if [ -z "$REF" ]; then REF=$SUM; elif [ "$SUM" != "$REF" ]; then echo "output differs with $JOBS jobs"; exit 1; fi
+
+    SECS=$(awk -v a="$START" -v b="$END" 'BEGIN{ print b - a }')
+    [ -z "$BASE" ] && BASE=$SECS
+    awk -v j="$JOBS" -v s="$SECS" -v n="$BYTES" -v b="$BASE" \
+        'BEGIN{ printf "%6d %10.3f %10.1f %8.2f\n", j, s, n / 1048576 / s, b / s }'
+
+    JOBS=$((JOBS * 2))
+done
@@ -0,0 +1,131 @@
+/**
+ * Micro-benchmark of column evaluation
+ *
+ * Evaluates a few formulas over random columns with every kernel variant available on
+ * this machine, and with the scalar bytecode interpreter row by row for comparison, and
+ * prints the throughput in rows per second
+ *
+ * Build and run: make bench/bench_columns && ./bench/bench_columns [millions of rows]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/parser.h"
+#include "../src/eval.h"
+#include "../src/column.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define ROUNDS 5
+
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * Evaluates `prog` over the columns ROUNDS times and returns the best time of a round,
+ * with the column kernels or, if `variant` is null, with `program_run` on every row
+ */
+static double run(const Program *prog, const char *variant, const double *const *cols, size_t rows, double *out){
+    double best = 1e30;
+    double row[3];
+
+    for(int r = 0; r < ROUNDS; r++){
+        double t0 = now();
+
+        if(variant){
+            column_eval(prog, cols, rows, out);
+        }
+        else{
+            for(size_t i = 0; i < rows; i++){
+                for(size_t v = 0; v < prog->nvars; v++){
+                    row[v] = cols[v][i];
+                }
+
+                program_run(prog, row, &out[i]);
+            }
+        }
+
+        double t = now() - t0;
+
+        if(t < best){
+            best = t;
+        }
+    }
+
+    return best;
+}
+
+
+int main(int argc, char **argv){
+    size_t rows = (argc > 1 ? (size_t)atol(argv[1]) : 4) * 1000000;
+    const char *formulas[] = {
+        "add(mul(x, 2), sub(y, z))",
+        "tern(sub(x, 0.5), div(add(x, y), z), mul(sub(y, z), x))",
+        "add(mul(add(mul(x, 3), y), z), add(mul(x, x), div(y, add(z, 1))))",
+    };
+    const char *variants[] = {"scalar", "avx2", "avx512"};
+    double *cols[3];
+    double *out = malloc(rows * sizeof(double));
+    Program lazy, straight;
+
+    for(int c = 0; c < 3; c++){
+        cols[c] = malloc(rows * sizeof(double));
+
+        if(!cols[c]){
+            return 1;
+        }
+
+        for(size_t i = 0; i < rows; i++){
+            cols[c][i] = rand() / (double)RAND_MAX;
+        }
+    }
+
+    if(!out){
+        return 1;
+    }
+
+    program_init(&lazy);
+    program_init(&straight);
+    printf("%-8s %-10s %12s\n", "formula", "engine", "Mrows/s");
+
+    for(int f = 0; f < 3; f++){
+        Parser *parser = parser_create(formulas[f], strlen(formulas[f]));
+        AST *ast = parser_parse(parser);
+
+        if(!ast || program_compile(&lazy, ast) != 0 || program_compile_select(&straight, ast) != 0){
+            fprintf(stderr, "Error: cannot compile %s\n", formulas[f]);
+            return 1;
+        }
+
+        //Variables appear in the order x, y, z in every formula
+        printf("%-8d %-10s %12.1f\n", f + 1, "bytecode", rows / run(&lazy, NULL, (const double *const *)cols, rows, out) / 1e6);
+
+        for(int v = 0; v < 3; v++){
+            if(column_select(variants[v]) == 0){
+                double t = run(&straight, variants[v], (const double *const *)cols, rows, out);
+                printf("%-8d %-10s %12.1f\n", f + 1, variants[v], rows / t / 1e6);
+            }
+        }
+
+        parser_destroy(parser);
+    }
+
+    program_free(&lazy);
+    program_free(&straight);
+
+    for(int c = 0; c < 3; c++){
+        free(cols[c]);
+    }
+
+    free(out);
+
+    return 0;
+}
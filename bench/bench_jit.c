@@ -0,0 +1,238 @@
+/**
+ * Benchmark of the evaluation engines on a deep and on a wide expression
+ *
+ * - tree walk: a recursive evaluation of the AST for every row
+ * - bytecode: `program_run` for every row
+ * - columns: `column_eval`, block by block with the widest SIMD kernels
+ * - jit: the native code of `jit_compile`
+ *
+ * Build and run: make bench/bench_jit && ./bench/bench_jit [millions of rows]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/parser.h"
+#include "../src/eval.h"
+#include "../src/column.h"
+#include "../src/jit.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define ROUNDS 3
+
+enum{ENGINE_TREE, ENGINE_BYTECODE, ENGINE_COLUMNS, ENGINE_JIT};
+
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * Reference tree walk; the variables are named x, y and z
+ */
+static double walk(const AST *a, const double *row){
+    switch (a->type){
+        case NODE_NUMBER:
+            return a->num_value;
+        case NODE_VAR:
+            return row[a->num_text[0] - 'x'];
+        case NODE_CHAIN:{
+            //Folded in the order of the binary links it stands for (see ast.h)
+            double v = walk(a->args[a->right_nested ? a->count - 1 : 0], row);
+
+            for(size_t i = 1; i < a->count; i++){
+                double x = walk(a->args[a->right_nested ? a->count - 1 - i : i], row);
+                v = a->op == OP_ADD ? x + v : x * v;
+            }
+
+            return v;
+        }
+        case NODE_OP:
+            break;
+    }
+
+    double l = walk(a->left, row);
+
+    switch (a->op){
+        case OP_ADD:
+            return l + walk(a->right, row);
+        case OP_SUB:
+            return l - walk(a->right, row);
+        case OP_MUL:
+            return l * walk(a->right, row);
+        case OP_DIV:
+            return l / walk(a->right, row);
+        case OP_MOD:
+            return fmod(l, walk(a->right, row));
+        case OP_POW:
+            return pow(l, walk(a->right, row));
+        case OP_TERN:
+            return l != 0.0 ? walk(a->middle, row) : walk(a->right, row);
+    }
+
+    return 0.0;
+}
+
+
+/**
+ * Deep: a right-leaning chain of `n` operations, so the operand stack is about `n` deep
+ * Every other level halves the inner value, which keeps the result bounded
+ */
+static char *make_deep(int n){
+    char *s = malloc(n * 16 + 16);
+    size_t len = 0;
+
+    for(int i = 0; i < n; i += 2){
+        len += sprintf(s + len, "%s(%c, mul(0.5, ", i % 4 ? "sub" : "add", "xyz"[i % 3]);
+    }
+
+    len += sprintf(s + len, "1.5");
+    memset(s + len, ')', n);
+    s[len + n] = '\0';
+
+    return s;
+}
+
+
+/**
+ * Wide: a balanced tree with 2^`levels` leaves
+ */
+static size_t make_wide(char *s, int levels, int seed){
+    const char *ops[] = {"add", "mul", "sub", "add"};
+
+    if(levels == 0){
+        return sprintf(s, seed % 4 == 3 ? "0.5" : "%c", "xyz"[seed % 3]);
+    }
+
+    size_t len = sprintf(s, "%s(", ops[seed % 4]);
+    len += make_wide(s + len, levels - 1, seed * 3 + 1);
+    len += sprintf(s + len, ", ");
+    len += make_wide(s + len, levels - 1, seed * 5 + 2);
+    len += sprintf(s + len, ")");
+
+    return len;
+}
+
+
+/**
+ * Runs one engine ROUNDS times and returns the best time of a round
+ * `cols` are in x, y, z order and `vars` in the order of the variables of the programs
+ */
+static double run(int engine, const AST *ast, const Program *lazy, const Program *straight, const JitFunction *fn,
+                  const double *const *cols, const double *const *vars, size_t rows, double *out){
+    double best = 1e30;
+
+    for(int r = 0; r < ROUNDS; r++){
+        double t0 = now();
+        double row[3];
+        double slots[3];
+
+        if(engine == ENGINE_COLUMNS){
+            column_eval(straight, vars, rows, out);
+        }
+        else if(engine == ENGINE_JIT){
+            jit_run(fn, vars, rows, out);
+        }
+        else{
+            for(size_t i = 0; i < rows; i++){
+                if(engine == ENGINE_TREE){
+                    row[0] = cols[0][i];
+                    row[1] = cols[1][i];
+                    row[2] = cols[2][i];
+                    out[i] = walk(ast, row);
+                }
+                else{
+                    for(size_t v = 0; v < lazy->nvars; v++){
+                        slots[v] = vars[v][i];
+                    }
+
+                    program_run(lazy, slots, &out[i]);
+                }
+            }
+        }
+
+        double t = now() - t0;
+
+        if(t < best){
+            best = t;
+        }
+    }
+
+    return best;
+}
+
+
+int main(int argc, char **argv){
+    size_t rows = (argc > 1 ? (size_t)atol(argv[1]) : 2) * 1000000;
+    const char *engines[] = {"tree walk", "bytecode", "columns", "jit"};
+    char *exprs[2];
+    double *cols[3];
+    double *out = malloc(rows * sizeof(double));
+
+    exprs[0] = make_deep(64);
+    exprs[1] = malloc(1 << 16);
+    make_wide(exprs[1], 8, 1);
+
+    for(int c = 0; c < 3; c++){
+        cols[c] = malloc(rows * sizeof(double));
+
+        for(size_t i = 0; i < rows; i++){
+            cols[c][i] = 1.0 + rand() / (double)RAND_MAX;
+        }
+    }
+
+    printf("%-6s %-10s %12s\n", "shape", "engine", "Mrows/s");
+
+    for(int e = 0; e < 2; e++){
+        Parser *parser = parser_create(exprs[e], strlen(exprs[e]));
+        AST *ast = parser_parse(parser);
+        Program lazy, straight;
+        const double *vars[3];
+
+        program_init(&lazy);
+        program_init(&straight);
+
+        if(!ast || program_compile(&lazy, ast) != 0 || program_compile_select(&straight, ast) != 0){
+            fprintf(stderr, "Error: cannot compile the expression\n");
+            return 1;
+        }
+
+        //Binds the variables by name (both forms number them in the same order)
+        for(size_t v = 0; v < straight.nvars; v++){
+            vars[v] = cols[straight.vars[v].name[0] - 'x'];
+        }
+
+        JitFunction *fn = jit_compile(&straight);
+
+        for(int g = 0; g < 4; g++){
+            if(g == ENGINE_JIT && !fn){
+                continue;
+            }
+
+            double t = run(g, ast, &lazy, &straight, fn, (const double *const *)cols, vars, rows, out);
+            printf("%-6s %-10s %12.1f\n", e == 0 ? "deep" : "wide", engines[g], rows / t / 1e6);
+        }
+
+        jit_free(fn);
+        program_free(&lazy);
+        program_free(&straight);
+        parser_destroy(parser);
+    }
+
+    for(int c = 0; c < 3; c++){
+        free(cols[c]);
+    }
+
+    free(exprs[0]);
+    free(exprs[1]);
+    free(out);
+
+    return 0;
+}
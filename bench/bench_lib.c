@@ -0,0 +1,205 @@
+/**
+ * Benchmark of the library API against running the executable once per expression
+ *
+ * Every line of FILE is one expression. The program reports, as one JSON object:
+ * - transform: `expr_transform` on each line, one at a time
+ * - batch: `expr_transform_batch` on groups of BATCH lines
+ * - exec: when EXPR (the path of the executable) is given, a fork/exec of it per line,
+ *   with the expression on a pipe to its stdin (only the first EXEC_LINES lines)
+ * with the average time per expression in microseconds. It also checks that the two
+ * library calls produce the same text
+ *
+ * Build and run: make bench/bench_lib && ./bench/bench_lib FILE [./expr]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/expr.h"
+#include "../src/input.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+
+#define BATCH 256
+#define EXEC_LINES 200
+
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * Runs `prog` with `text` on its stdin and its output discarded
+ * @return 0 on success, -1 if the process cannot be started
+ */
+static int run_exec(const char *prog, const char *text, size_t len){
+    int fds[2];
+
+    if(pipe(fds) != 0){
+        return -1;
+    }
+
+    pid_t pid = fork();
+
+    if(pid == 0){
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+
+        if(!freopen("/dev/null", "w", stdout)){
+            _exit(127);
+        }
+
+        execl(prog, prog, (char *)NULL);
+        _exit(127);
+    }
+
+    close(fds[0]);
+
+    if(pid < 0 || write(fds[1], text, len) != (ssize_t)len){
+        close(fds[1]);
+        return -1;
+    }
+
+    close(fds[1]);
+
+    int status;
+
+    return waitpid(pid, &status, 0) == pid ? 0 : -1;
+}
+
+
+int main(int argc, char **argv){
+    Input in;
+
+    if(argc < 2 || input_open(&in, argv[1]) != 0){
+        fprintf(stderr, "Usage: %s FILE [EXPR]\n", argv[0]);
+        return 1;
+    }
+
+    //Splits the input into lines
+    size_t n = 0, cap = 1024;
+    ExprInput *lines = malloc(cap * sizeof(ExprInput));
+
+    for(const char *p = in.data, *end = in.data + in.len; lines && p < end;){
+        const char *nl = memchr(p, '\n', end - p);
+        const char *eol = nl ? nl : end;
+
+        if(n == cap){
+            ExprInput *grown = realloc(lines, 2 * cap * sizeof(ExprInput));
+
+            if(!grown){
+                free(lines);
+                lines = NULL;
+                break;
+            }
+
+            lines = grown;
+            cap *= 2;
+        }
+
+        lines[n].text = p;
+        lines[n++].len = (size_t)(eol - p);
+        p = nl ? nl + 1 : end;
+    }
+
+    //Room for any result: the infix form is never twice as long as the input
+    size_t out_cap = 2 * in.len + 64;
+    ExprContext *ctx = expr_context_create();
+    ExprResult *results = malloc(BATCH * sizeof(ExprResult));
+    char *out = malloc(out_cap);
+    char *out2 = malloc(out_cap);
+
+    if(!lines || !ctx || !results || !out || !out2 || n == 0){
+        fprintf(stderr, "Error: out of memory or empty input\n");
+        return 1;
+    }
+
+    //One call per expression
+    double t0 = now();
+    size_t bytes = 0;
+
+    for(size_t i = 0; i < n; i++){
+        size_t len;
+
+        if(expr_transform(ctx, lines[i].text, lines[i].len, 0, out, out_cap, &len, NULL) == EXPR_OK){
+            bytes += len;
+        }
+    }
+
+    double t_one = now() - t0;
+
+    //Batches, checked against single calls
+    size_t mismatches = 0;
+
+    t0 = now();
+
+    for(size_t i = 0; i < n;){
+        size_t m = n - i < BATCH ? n - i : BATCH;
+        size_t done = expr_transform_batch(ctx, lines + i, m, 0, out, out_cap, results);
+
+        if(done == 0){
+            fprintf(stderr, "Error: a result does not fit in %zu bytes\n", out_cap);
+            return 1;
+        }
+
+        i += done;
+    }
+
+    double t_batch = now() - t0;
+
+    for(size_t i = 0; i < n; i += BATCH){
+        size_t m = n - i < BATCH ? n - i : BATCH;
+        size_t done = expr_transform_batch(ctx, lines + i, m, 0, out, out_cap, results);
+
+        for(size_t k = 0; k < done; k++){
+            size_t len;
+            ExprStatus s = expr_transform(ctx, lines[i + k].text, lines[i + k].len, 0, out2, out_cap, &len, NULL);
+
+            if(s != results[k].error.status || (s == EXPR_OK && strcmp(out2, out + results[k].offset) != 0)){
+                mismatches++;
+            }
+        }
+    }
+
+    //Process per expression
+    double t_exec = 0;
+    size_t n_exec = argc > 2 ? (n < EXEC_LINES ? n : EXEC_LINES) : 0;
+
+    t0 = now();
+
+    for(size_t i = 0; i < n_exec; i++){
+        if(run_exec(argv[2], lines[i].text, lines[i].len) != 0){
+            fprintf(stderr, "Error: cannot run %s\n", argv[2]);
+            return 1;
+        }
+    }
+
+    t_exec = now() - t0;
+
+    printf("{\"corpus\": \"%s\", \"expressions\": %zu, \"output_bytes\": %zu, \"mismatches\": %zu, "
+           "\"transform_us\": %.3f, \"batch_us\": %.3f", argv[1], n, bytes, mismatches,
+           t_one / n * 1e6, t_batch / n * 1e6);
+
+    if(n_exec > 0){
+        printf(", \"exec_us\": %.1f", t_exec / n_exec * 1e6);
+    }
+
+    printf("}\n");
+
+    expr_context_destroy(ctx);
+    free(results);
+    free(out);
+    free(out2);
+    free(lines);
+    input_close(&in);
+
+    return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,277 @@
+/**
+ * Benchmark of the phases of the transformation, one corpus file at a time
+ *
+ * For every file, each phase runs ROUNDS times and the best round is reported:
+ * - lex: all the tokens of the input
+ * - parse, print, free: the pointer AST (`parser_parse`, `ast_print`, `parser_destroy`)
+ * - parse_flat, print_flat, free_flat: the same with the compact tree of flat.h
+ * The text is printed to an in-memory buffer that is reused by every round, so printing
+ * is measured without the cost of a write
+ *
+ * One JSON object per file is written to stdout (JSON Lines), with, for every phase:
+ * seconds, MB/s of input, nodes/s, the peak resident memory of the process during the
+ * phase (it includes the memory that the allocator kept from earlier phases), and the
+ * calls to malloc/calloc/realloc/free made by the library. The counts come
+ * from linking with -Wl,--wrap for those four functions (see the Makefile); allocations
+ * made inside libc (e.g. by strdup) are not seen
+ *
+ * Build and run: make bench (generates the corpora with bench/exprgen first), or
+ *                make bench/bench_phases && ./bench/bench_phases FILE...
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/lexer.h"
+#include "../src/parser.h"
+#include "../src/printer.h"
+#include "../src/flat.h"
+#include "../src/input.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+
+#define ROUNDS 3
+
+
+/**
+ * Allocation counters, updated by the wrappers below
+ */
+static size_t n_malloc, n_calloc, n_realloc, n_free, n_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void __real_free(void *p);
+
+void *__wrap_malloc(size_t size){
+    n_malloc++;
+    n_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size){
+    n_calloc++;
+    n_bytes += n * size;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size){
+    n_realloc++;
+    n_bytes += size;
+    return __real_realloc(p, size);
+}
+
+void __wrap_free(void *p){
+    n_free += p != NULL;
+    __real_free(p);
+}
+
+
+/**
+ * Measurements of one phase
+ */
+typedef struct{
+    const char *name;
+    double seconds;
+    long peak_kb;
+    size_t allocs;      //malloc + calloc + realloc
+    size_t frees;
+    size_t bytes;       //Requested by those calls
+} Phase;
+
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * Resets the peak resident memory of the process to its current value (Linux), so that
+ * the peak of each phase can be read separately
+ * @return 0 on success, -1 if the kernel does not support it
+ */
+static int reset_peak(void){
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+
+    if(!f){
+        return -1;
+    }
+
+    int rc = fputs("5", f) >= 0 ? 0 : -1;
+
+    return fclose(f) == 0 ? rc : -1;
+}
+
+
+/**
+ * Peak resident memory in KB: VmHWM since the last `reset_peak`, or the peak of the
+ * whole run where it cannot be reset
+ */
+static long peak_kb(void){
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = -1;
+
+    while(f && fgets(line, sizeof(line), f)){
+        if(strncmp(line, "VmHWM:", 6) == 0){
+            kb = strtol(line + 6, NULL, 10);
+        }
+    }
+
+    if(f){
+        fclose(f);
+    }
+
+    if(kb < 0){
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        kb = ru.ru_maxrss;
+    }
+
+    return kb;
+}
+
+
+/**
+ * Starts measuring one round of a phase
+ */
+static double phase_begin(void){
+    reset_peak();
+    n_malloc = n_calloc = n_realloc = n_free = n_bytes = 0;
+
+    return now();
+}
+
+
+/**
+ * Ends one round; the best round is kept, with its counters
+ */
+static void phase_end(Phase *ph, double t0){
+    double t = now() - t0;
+
+    if(ph->seconds == 0.0 || t < ph->seconds){
+        ph->seconds = t;
+        ph->peak_kb = peak_kb();
+        ph->allocs = n_malloc + n_calloc + n_realloc;
+        ph->frees = n_free;
+        ph->bytes = n_bytes;
+    }
+}
+
+
+/**
+ * Runs every phase on one input and writes its JSON line
+ * @return 0 on success, -1 if the input does not parse
+ */
+static int bench_file(const char *path, const char *data, size_t len){
+    enum{LEX, PARSE, PRINT, FREE, PARSE_FLAT, PRINT_FLAT, FREE_FLAT, NPHASES};
+    Phase ph[NPHASES] = {
+        {"lex", 0, 0, 0, 0, 0}, {"parse", 0, 0, 0, 0, 0}, {"print", 0, 0, 0, 0, 0},
+        {"free", 0, 0, 0, 0, 0}, {"parse_flat", 0, 0, 0, 0, 0}, {"print_flat", 0, 0, 0, 0, 0},
+        {"free_flat", 0, 0, 0, 0, 0}
+    };
+    size_t nodes = 0;
+    Buffer out;
+
+    buffer_init(&out);
+
+    for(int r = 0; r < ROUNDS; r++){
+        double t0 = phase_begin();
+        Lexer *lexer = lexer_create(data, len);
+        Token tok;
+
+        do{
+            tok = lexer_next(lexer);
+        } while(tok.type != TOK_EOF && tok.type != TOK_ERROR);
+
+        lexer_destroy(lexer);
+        phase_end(&ph[LEX], t0);
+
+        t0 = phase_begin();
+        Parser *parser = parser_create(data, len);
+        AST *ast = parser_parse(parser);
+        phase_end(&ph[PARSE], t0);
+
+        if(!ast){
+            fprintf(stderr, "%s: %s\n", path, parser_error(parser));
+            parser_destroy(parser);
+            buffer_free(&out);
+            return -1;
+        }
+
+        buffer_clear(&out);
+        t0 = phase_begin();
+        ast_print(ast, &out);
+        phase_end(&ph[PRINT], t0);
+
+        t0 = phase_begin();
+        parser_destroy(parser);
+        phase_end(&ph[FREE], t0);
+
+        FlatTree flat;
+
+        flat_init(&flat);
+        t0 = phase_begin();
+        parser = parser_create(data, len);
+        parser_parse_flat(parser, &flat);
+        parser_destroy(parser);
+        phase_end(&ph[PARSE_FLAT], t0);
+        nodes = flat.len;
+
+        buffer_clear(&out);
+        t0 = phase_begin();
+        flat_print(&flat, &out);
+        phase_end(&ph[PRINT_FLAT], t0);
+
+        t0 = phase_begin();
+        flat_free(&flat);
+        phase_end(&ph[FREE_FLAT], t0);
+    }
+
+    buffer_free(&out);
+
+    printf("{\"corpus\": \"%s\", \"bytes\": %zu, \"nodes\": %zu, \"phases\": {", path, len, nodes);
+
+    for(int i = 0; i < NPHASES; i++){
+        double s = ph[i].seconds > 0 ? ph[i].seconds : 1e-9;
+
+        printf("%s\"%s\": {\"seconds\": %.6f, \"mb_per_s\": %.1f, \"nodes_per_s\": %.0f, "
+               "\"peak_rss_kb\": %ld, \"allocs\": %zu, \"frees\": %zu, \"alloc_bytes\": %zu}",
+               i ? ", " : "", ph[i].name, ph[i].seconds, len / s / 1e6, nodes / s,
+               ph[i].peak_kb, ph[i].allocs, ph[i].frees, ph[i].bytes);
+    }
+
+    printf("}}\n");
+
+    return 0;
+}
+
+
+int main(int argc, char **argv){
+    int rc = 0;
+
+    if(argc < 2){
+        fprintf(stderr, "Usage: %s FILE...\n", argv[0]);
+        return 1;
+    }
+
+    for(int i = 1; i < argc; i++){
+        Input in;
+
+        if(input_open(&in, argv[i]) != 0){
+            perror(argv[i]);
+            rc = 1;
+            continue;
+        }
+
+        rc |= bench_file(argv[i], in.data, in.len) != 0;
+        input_close(&in);
+    }
+
+    return rc;
+}
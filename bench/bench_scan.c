@@ -0,0 +1,127 @@
+/**
+ * Micro-benchmark of the whitespace and comment scans of the lexer
+ *
+ * Builds a whitespace-heavy and a comment-heavy input in memory, tokenizes each of them
+ * with every scan variant available on this machine and prints the throughput
+ *
+ * Build and run: make bench/bench_scan && ./bench/bench_scan [MiB]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/lexer.h"
+#include "../src/scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define ROUNDS 5
+
+
+/**
+ * Fills `buf` with "add(1, 2)" calls separated by runs of whitespace, or by comments
+ * when `comments` is set
+ * @return the number of bytes written
+ */
+static size_t build(char *buf, size_t size, int comments){
+    size_t len = 0;
+    unsigned seed = 42;
+
+    while(len + 256 < size){
+        size_t gap = 8 + (seed = seed * 1103515245 + 12345) % 96;
+
+        if(comments){
+            memcpy(buf + len, "/* ", 3);
+            len += 3;
+
+            for(size_t i = 0; i < gap; i++){
+                buf[len++] = "lorem ipsum * dolor / sit"[i % 25];
+            }
+
+            memcpy(buf + len, " */", 3);
+            len += 3;
+        }
+        else{
+            for(size_t i = 0; i < gap; i++){
+                buf[len++] = " \t \n  "[i % 6];
+            }
+        }
+
+        memcpy(buf + len, "add(1, 2)", 9);
+        len += 9;
+    }
+
+    return len;
+}
+
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * Tokenizes the whole input ROUNDS times and returns the best time of a round
+ */
+static double run(const char *data, size_t len, size_t *tokens){
+    double best = 1e30;
+
+    for(int r = 0; r < ROUNDS; r++){
+        Lexer *l = lexer_create(data, len);
+        size_t count = 0;
+        double t0 = now();
+
+        for(Token t = lexer_next(l); t.type != TOK_EOF && t.type != TOK_ERROR; t = lexer_next(l)){
+            count++;
+        }
+
+        double t = now() - t0;
+        lexer_destroy(l);
+
+        if(t < best){
+            best = t;
+        }
+
+        *tokens = count;
+    }
+
+    return best;
+}
+
+
+int main(int argc, char **argv){
+    size_t size = (argc > 1 ? (size_t)atol(argv[1]) : 64) << 20;
+    char *buf = malloc(size);
+    const char *variants[] = {"scalar", "sse2", "avx2"};
+    const char *inputs[] = {"whitespace", "comments"};
+
+    if(!buf){
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    printf("%-12s %-8s %10s %12s\n", "input", "scan", "MB/s", "tokens");
+
+    for(int in = 0; in < 2; in++){
+        size_t len = build(buf, size, in);
+
+        for(int v = 0; v < 3; v++){
+            if(scan_select(variants[v]) != 0){
+                continue;
+            }
+
+            size_t tokens;
+            double t = run(buf, len, &tokens);
+
+            printf("%-12s %-8s %10.1f %12zu\n", inputs[in], variants[v], len / t / 1e6, tokens);
+        }
+    }
+
+    free(buf);
+
+    return 0;
+}
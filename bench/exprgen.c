@@ -0,0 +1,197 @@
+/**
+ * Generator of synthetic expressions for the benchmarks
+ *
+ * Writes one expression of about `bytes` bytes with the given shape to stdout:
+ * - deep-left, deep-right: a chain of binary operations nested on the left (right), so
+ *   the nesting depth grows with the size
+ * - balanced: a complete binary tree of random operations over short literals
+ * - tern: a complete tree of `tern` calls, three operands per node
+ * - comments: a balanced tree with block comments, newlines and runs of spaces between
+ *   the tokens (about half of the bytes are not tokens)
+ * - literals: a balanced tree whose literals are 20 to 60 characters long
+ *
+ * The output is a pure function of the shape, the size and the seed
+ *
+ * Build and run: make bench/exprgen && ./bench/exprgen SHAPE BYTES [SEED]
+ */
+#include "../src/buffer.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+typedef enum{SHAPE_DEEP_LEFT, SHAPE_DEEP_RIGHT, SHAPE_BALANCED, SHAPE_TERN, SHAPE_COMMENTS, SHAPE_LITERALS} Shape;
+
+static const char *shapes[] = {"deep-left", "deep-right", "balanced", "tern", "comments", "literals"};
+static const char *ops[] = {"add", "sub", "mul", "div", "mod", "pow"};
+
+static uint64_t state;
+
+
+/**
+ * xorshift64*: the same sequence on every platform, unlike `rand`
+ */
+static uint32_t next_random(void){
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+
+    return (uint32_t)((state * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+
+/**
+ * Appends the space between two tokens: nothing for most shapes, a mix of spaces,
+ * newlines and comments for SHAPE_COMMENTS
+ */
+static void gap(Buffer *b, Shape shape){
+    if(shape != SHAPE_COMMENTS){
+        return;
+    }
+
+    switch (next_random() % 4){
+        case 0:
+            buffer_puts(b, "   ");
+            break;
+        case 1:
+            buffer_puts(b, "\n\t");
+            break;
+        case 2:
+            buffer_puts(b, " /* operand */ ");
+            break;
+        default:
+            buffer_puts(b, "/* a longer comment, with * and / inside it */\n");
+            break;
+    }
+}
+
+
+/**
+ * Appends a literal: a short number or, for SHAPE_LITERALS, a long one
+ */
+static void literal(Buffer *b, Shape shape){
+    char tmp[96];
+    int n;
+
+    if(shape == SHAPE_LITERALS){
+        int digits = 20 + next_random() % 41;
+
+        n = 0;
+
+        for(int i = 0; i < digits; i++){
+            tmp[n++] = (char)('0' + (i == 0 ? 1 + next_random() % 9 : next_random() % 10));
+
+            if(i == digits / 2){
+                tmp[n++] = '.';
+            }
+        }
+
+        n += snprintf(tmp + n, sizeof(tmp) - n, "e-%u", next_random() % 20);
+    }
+    else{
+        n = snprintf(tmp, sizeof(tmp), next_random() % 4 ? "%u" : "%u.5", next_random() % 1000);
+    }
+
+    buffer_append(b, tmp, (size_t)n);
+}
+
+
+/**
+ * Appends a complete tree of `levels` levels: binary operations, or `tern` for SHAPE_TERN
+ */
+static void tree(Buffer *b, Shape shape, int levels){
+    if(levels == 0){
+        literal(b, shape);
+        return;
+    }
+
+    int arity = shape == SHAPE_TERN ? 3 : 2;
+
+    buffer_puts(b, shape == SHAPE_TERN ? "tern" : ops[next_random() % 6]);
+    gap(b, shape);
+    buffer_putc(b, '(');
+
+    for(int i = 0; i < arity; i++){
+        gap(b, shape);
+        tree(b, shape, levels - 1);
+        gap(b, shape);
+        buffer_putc(b, i + 1 < arity ? ',' : ')');
+    }
+}
+
+
+/**
+ * Appends a chain of `n` operations nested on the left or on the right
+ */
+static void chain(Buffer *b, Shape shape, size_t n){
+    for(size_t i = 0; i < n; i++){
+        buffer_puts(b, ops[next_random() % 3]);
+
+        if(shape == SHAPE_DEEP_LEFT){
+            buffer_putc(b, '(');
+        }
+        else{
+            buffer_putc(b, '(');
+            literal(b, shape);
+            buffer_puts(b, ", ");
+        }
+    }
+
+    literal(b, shape);
+
+    for(size_t i = 0; i < n; i++){
+        if(shape == SHAPE_DEEP_LEFT){
+            buffer_puts(b, ", ");
+            literal(b, shape);
+        }
+
+        buffer_putc(b, ')');
+    }
+}
+
+
+int main(int argc, char **argv){
+    Shape shape = (Shape)-1;
+    Buffer b;
+
+    for(size_t i = 0; argc >= 3 && i < sizeof(shapes) / sizeof(shapes[0]); i++){
+        if(strcmp(argv[1], shapes[i]) == 0){
+            shape = (Shape)i;
+        }
+    }
+
+    if(shape == (Shape)-1){
+        fprintf(stderr, "Usage: %s deep-left|deep-right|balanced|tern|comments|literals BYTES [SEED]\n", argv[0]);
+        return 1;
+    }
+
+    size_t bytes = (size_t)strtoull(argv[2], NULL, 10);
+    state = argc > 3 ? strtoull(argv[3], NULL, 10) * 2 + 1 : 42;
+    buffer_init(&b);
+
+    if(shape == SHAPE_DEEP_LEFT || shape == SHAPE_DEEP_RIGHT){
+        chain(&b, shape, bytes / 10 + 1);     //About 10 bytes per level
+    }
+    else{
+        //Measures a small tree, then picks the number of levels that is closest to `bytes`
+        int arity = shape == SHAPE_TERN ? 3 : 2;
+        int levels = 6;
+
+        tree(&b, shape, levels);
+
+        for(double size = (double)b.len; size * arity * 0.75 < (double)bytes; size *= arity){
+            levels++;
+        }
+
+        buffer_clear(&b);
+        tree(&b, shape, levels);
+    }
+
+    buffer_putc(&b, '\n');
+
+    int rc = fwrite(b.data, 1, b.len, stdout) == b.len ? 0 : 1;
+    buffer_free(&b);
+
+    return rc;
+}
@@ -0,0 +1,139 @@
+#include "arena.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+#define ARENA_DEFAULT_BLOCK (64 * 1024)
+#define ARENA_ALIGN 16
+
+
+/**
+ * Initializes an empty arena
+ * No memory is allocated until the first call to `arena_alloc`
+ *
+ * @param a: the arena
+ * @param block_size: size of the blocks requested to the system, 0 for the default
+ */
+void arena_init(Arena *a, size_t block_size){
+    a->head = NULL;
+    a->cur = NULL;
+    a->block_size = block_size ? block_size : ARENA_DEFAULT_BLOCK;
+}
+
+
+/**
+ * Allocates a new block able to hold at least `size` bytes
+ */
+static ArenaBlock *block_new(size_t size){
+    stats_note_alloc(sizeof(ArenaBlock) + size);
+    ArenaBlock *b = malloc(sizeof(ArenaBlock) + size);
+
+    if(b){
+        b->next = NULL;
+        b->size = size;
+        b->used = 0;
+    }
+
+    return b;
+}
+
+
+/**
+ * Returns `size` bytes of uninitialized memory from the arena
+ *
+ * The fast path only bumps a pointer inside the current block
+ * When the block is full the next one is reused if it is big enough (blocks that
+ * survive an `arena_reset` are recycled in order); otherwise a new block is linked in
+ *
+ * @param a: the arena
+ * @param size: number of bytes
+ * @return a pointer aligned to 16 bytes, or null if memory allocation fails
+ */
+void *arena_alloc(Arena *a, size_t size){
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    ArenaBlock *b = a->cur;
+
+    if(b && b->size - b->used >= size){
+        void *p = b->data + b->used;
+        b->used += size;
+
+        return p;
+    }
+
+    //Recycles the block that follows the current one when it fits the request
+    if(b && b->next && b->next->size >= size){
+        b = b->next;
+        b->used = 0;
+    }
+    else{
+        ArenaBlock *nb = block_new(size > a->block_size ? size : a->block_size);
+
+        if(!nb){
+            return NULL;
+        }
+
+        if(b){
+            nb->next = b->next;
+            b->next = nb;
+        }
+        else{
+            nb->next = a->head;
+            a->head = nb;
+        }
+
+        b = nb;
+    }
+
+    a->cur = b;
+    b->used = size;
+
+    return b->data;
+}
+
+
+/**
+ * Copies `n` bytes of `s` into the arena and adds a terminating NUL
+ */
+char *arena_strndup(Arena *a, const char *s, size_t n){
+    char *d = arena_alloc(a, n + 1);
+
+    if(d){
+        memcpy(d, s, n);
+        d[n] = '\0';
+    }
+
+    return d;
+}
+
+
+/**
+ * Drops every allocation made from the arena
+ * Only the first block is rewound here; the following ones are rewound lazily when
+ * `arena_alloc` reaches them, so the cost does not depend on what was allocated
+ */
+void arena_reset(Arena *a){
+    a->cur = a->head;
+
+    if(a->head){
+        a->head->used = 0;
+    }
+}
+
+
+/**
+ * Returns all the blocks of the arena to the system
+ */
+void arena_free(Arena *a){
+    ArenaBlock *b = a->head;
+
+    while(b){
+        ArenaBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+
+    a->head = NULL;
+    a->cur = NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+
+/**
+ * @file arena.h
+ * @brief Bump-pointer allocator that hands out memory from large blocks
+ *
+ * Everything allocated from an arena is released at once with `arena_reset` (the blocks
+ * are kept for reuse) or `arena_free` (the blocks are returned to the system)
+ * There is no way to free a single allocation
+ */
+
+
+/**
+ * @struct ArenaBlock
+ * @brief One block of memory owned by an arena
+ */
+typedef struct ArenaBlock{
+    struct ArenaBlock *next;
+    size_t size;    //Usable bytes in `data`
+    size_t used;
+    _Alignas(16) char data[];
+} ArenaBlock;
+
+
+/**
+ * @struct Arena
+ * @brief The arena: a list of blocks and the one currently being filled
+ */
+typedef struct{
+    ArenaBlock *head;
+    ArenaBlock *cur;
+    size_t block_size;  //Default size of a new block
+} Arena;
+
+void arena_init(Arena *a, size_t block_size);  //0 selects the default block size
+void *arena_alloc(Arena *a, size_t size);       //16-byte aligned, NULL if memory allocation fails
+char *arena_strndup(Arena *a, const char *s, size_t n);
+void arena_reset(Arena *a);    //Drops every allocation in O(1), keeps the blocks
+void arena_free(Arena *a);
+
+#endif
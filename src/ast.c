@@ -1,21 +1,152 @@
 #include "ast.h"
+#include "stats.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
+
+
+/**
+ * Allocates an uninitialized node from the arena, or from the heap if `arena` is null
+ */
+static AST *node_alloc(Arena *arena){
+    return arena ? arena_alloc(arena, sizeof(AST)) : malloc(sizeof(AST));
+}
+
+
+/**
+ * Significant digits kept from a long literal: correctly rounding a double never needs
+ * more than 768 of them, provided the digits dropped after them are noted (see `long_value`)
+ */
+#define NUM_DIGITS 800
+
+
+/**
+ * Converts a literal too long for a stack copy without copying it whole: its significant
+ * digits go to a bounded buffer, the first NUM_DIGITS of them followed by a '1' if any
+ * digit dropped after them is not zero, and the exponent is moved so that the value keeps
+ * its scale. `strtod` rounds the result exactly as it would round the whole literal
+ * The literal has the form accepted by the lexer: [+-]? digits* ('.' digits*)? ([eE] [+-]? digits+)?
+ */
+static double long_value(const char *text, size_t len){
+    char buf[NUM_DIGITS + 32];
+    size_t n = 0;           //Bytes written to `buf`
+    size_t digits = 0;      //Significant digits written
+    int sticky = 0;         //A non-zero digit was dropped
+    long long point = 0;    //Significant digits before the decimal point, less the zeros after it before the first one
+    long long exp = 0;
+    size_t i = 0;
+
+    if(text[i] == '+' || text[i] == '-'){
+        buf[n++] = text[i++];
+    }
+
+    for(int frac = 0; i < len && text[i] != 'e' && text[i] != 'E'; i++){
+        if(text[i] == '.'){
+            frac = 1;
+        }
+        else if(digits == 0 && text[i] == '0'){   //Leading zero
+            point -= frac;
+        }
+        else{
+            point += !frac;
+
+            if(digits < NUM_DIGITS){
+                buf[n++] = text[i];
+                digits++;
+            }
+            else{
+                sticky |= text[i] != '0';
+            }
+        }
+    }
+
+    if(digits == 0){
+        buf[n++] = '0';
+    }
+
+    if(sticky){
+        buf[n++] = '1';
+        digits++;
+    }
+
+    //The exponent saturates far beyond the range of a double
+    if(i < len){
+        int neg = text[++i] == '-';
+        i += text[i] == '+' || text[i] == '-';
+
+        for(; i < len; i++){
+            exp = exp < 1000000000 ? exp * 10 + (text[i] - '0') : exp;
+        }
+
+        exp = neg ? -exp : exp;
+    }
+
+    snprintf(buf + n, sizeof(buf) - n, "e%lld", point + exp - (long long)digits);
+
+    return strtod(buf, NULL);
+}
+
+
+/**
+ * Converts the first `len` bytes of `text` with `strtod`, as the number constructors do
+ * The literal is not NUL-terminated and the bytes after it may still look like a number
+ * to `strtod` (e.g. "0x1"), so short literals are converted from a bounded stack copy
+ * and long ones through `long_value`; nothing is allocated
+ */
+double ast_number_value(const char *text, size_t len){
+    char tmp[64];
+
+    if(len < sizeof(tmp)){
+        memcpy(tmp, text, len);
+        tmp[len] = '\0';
+
+        return strtod(tmp, NULL);
+    }
+
+    return long_value(text, len);
+}
 
 
 /**
  * Create an AST node (Abstract Syntax Tree) of type int
- * @param text: original text of the number
+ * @param arena: arena that owns the node, null to use the heap
+ * @param text: original text of the number (it is referenced, not copied)
+ * @param len: length of the literal
  * @return a pointer to the new AST node or null in case the memory allocation fails
  */
-AST *ast_make_number(const char *text){
-    AST *a = malloc(sizeof(AST));
+AST *ast_make_number(Arena *arena, const char *text, size_t len){
+    AST *a = node_alloc(arena);
 
     if(a){
         a->type = NODE_NUMBER;
-        a->num_text = strdup(text); //Copy of the literal number text
-        a->num_value = strtod(text, NULL);  //Converts the text to a numerical value
+        a->num_text = text;
+        a->num_len = len;
+        a->num_value = ast_number_value(text, len);  //Converts the text to a numerical value
+        a->shared = 0;
+    }
+
+    return a;
+}
+
+
+/**
+ * Creates a variable node
+ * @param arena: arena that owns the node, null to use the heap
+ * @param name: name of the variable in the original text (it is referenced, not copied)
+ * @param len: length of the name
+ * @return a pointer to the new AST node or null in case the memory allocation fails
+ */
+AST *ast_make_var(Arena *arena, const char *name, size_t len){
+    AST *a = node_alloc(arena);
+
+    if(a){
+        a->type = NODE_VAR;
+        a->num_text = name;
+        a->num_len = len;
+        a->num_value = 0.0;
+        a->shared = 0;
     }
 
     return a;
@@ -24,13 +155,14 @@ AST *ast_make_number(const char *text){
 
 /**
  * Creates a binary node for the AST
+ * @param arena: arena that owns the node, null to use the heap
  * @param op: type of operation
  * @param left: left subtree
  * @param right: right subtree
  * @return a pointer to the new AST node or null in case the memory allocation fails
  */
-AST *ast_make_binary(OpType op, AST *left, AST *right){
-    AST *a = malloc(sizeof(AST));
+AST *ast_make_binary(Arena *arena, OpType op, AST *left, AST *right){
+    AST *a = node_alloc(arena);
 
     if(a){
         a->type = NODE_OP;
@@ -38,6 +170,7 @@ AST *ast_make_binary(OpType op, AST *left, AST *right){
         a->left = left;
         a->middle = NULL;   //Not used in binary operations
         a->right = right;
+        a->shared = 0;
     }
 
     return a;
@@ -46,13 +179,14 @@ AST *ast_make_binary(OpType op, AST *left, AST *right){
 
 /**
  * Creates a ternary node for the AST
+ * @param arena: arena that owns the node, null to use the heap
  * @param left: conditional expression
  * @param middle: expression if true
  * @param right: expression if false
  * @return a pointer to the new AST node or null in case the memory allocation fails
  */
-AST *ast_make_ternary(AST *left, AST *middle, AST *right){
-    AST *a = malloc(sizeof(AST));
+AST *ast_make_ternary(Arena *arena, AST *left, AST *middle, AST *right){
+    AST *a = node_alloc(arena);
 
     if(a){
         a->type = NODE_OP;
@@ -60,14 +194,113 @@ AST *ast_make_ternary(AST *left, AST *middle, AST *right){
         a->left = left;
         a->middle = middle;
         a->right = right;
+        a->shared = 0;
+    }
+
+    return a;
+}
+
+
+/**
+ * Whether `a` can become or grow into a chain of `op` nested on the given side
+ * Shared nodes are never modified
+ */
+static int chain_link(const AST *a, OpType op, uint32_t right_nested){
+    if(a->shared || (a->type != NODE_OP && a->type != NODE_CHAIN) || a->op != op){
+        return 0;
+    }
+
+    return a->type == NODE_OP || a->right_nested == right_nested;
+}
+
+
+/**
+ * Adds `operand` after the last operand of a left-nested chain or before the first one of
+ * a right-nested chain, turning the binary node `a` into a chain first if it is one
+ * When the array is full it is moved to one twice as large, with the free slots on the
+ * side that grows; the old array stays in the arena
+ * @return `a`, or null if memory allocation fails
+ */
+static AST *chain_add(Arena *arena, AST *a, AST *operand, uint32_t right_nested){
+    if(a->type == NODE_OP){
+        AST *l = a->left;
+        AST *r = a->right;
+        AST **args = arena_alloc(arena, 4 * sizeof(AST *));
+
+        if(!args){
+            return NULL;
+        }
+
+        a->type = NODE_CHAIN;
+        a->args = right_nested ? args + 2 : args;
+        a->args[0] = l;
+        a->args[1] = r;
+        a->count = 2;
+        a->room = 2;
+        a->right_nested = right_nested;
+    }
+
+    if(a->room == 0){
+        size_t room = a->count < UINT32_MAX ? a->count : UINT32_MAX;
+        AST **args = arena_alloc(arena, (a->count + room) * sizeof(AST *));
+
+        if(!args){
+            return NULL;
+        }
+
+        args += right_nested ? room : 0;
+        memcpy(args, a->args, a->count * sizeof(AST *));
+        a->args = args;
+        a->room = (uint32_t)room;
+    }
+
+    if(right_nested){
+        *--a->args = operand;
+    }
+    else{
+        a->args[a->count] = operand;
     }
 
+    a->count++;
+    a->room--;
+
     return a;
 }
 
 
 /**
- * Recursively frees the memory used by the AST
+ * Builds `op(left, right)` like `ast_make_binary`, except that a chain of `add` or of
+ * `mul` becomes one NODE_CHAIN node (see ast.h): when `left` is a node of the same
+ * operator, `right` is appended to it as the next operand of a left-nested chain; else,
+ * when `right` is one, `left` is prepended to it as the first operand of a right-nested
+ * chain. The node it joins is modified and returned
+ *
+ * Each node depends only on its operands, so a tree built bottom up in any order is the
+ * same. With a null arena the nodes stay binary, so that `ast_free` can release them
+ *
+ * @return the node, or null if memory allocation fails
+ */
+AST *ast_chain(Arena *arena, OpType op, AST *left, AST *right){
+    if(arena && (op == OP_ADD || op == OP_MUL)){
+        if(chain_link(left, op, 0)){
+            return chain_add(arena, left, right, 0);
+        }
+
+        if(chain_link(right, op, 1)){
+            return chain_add(arena, right, left, 1);
+        }
+    }
+
+    return ast_make_binary(arena, op, left, right);
+}
+
+
+/**
+ * Frees the memory used by the AST
+ * Only valid for trees built with a null arena; arena trees are released with the arena
+ *
+ * The nodes still to be freed are kept on a heap stack instead of the machine stack, so
+ * any depth can be released
  * @param a: the tree's root
  */
 void ast_free(AST *a){
@@ -75,16 +308,336 @@ void ast_free(AST *a){
         return;
     }
 
-    if(a->type == NODE_NUMBER){
-        free(a->num_text);
+    AST **stack = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+
+    while(a){
+        if(a->type == NODE_OP){
+            AST *kids[3] = {a->left, a->middle, a->right};
+
+            for(int i = 0; i < 3; i++){
+                if(!kids[i]){
+                    continue;
+                }
+
+                if(len == cap){
+                    size_t ncap = cap ? cap * 2 : 64;
+                    stats_note_alloc(ncap * sizeof(AST *));
+                    AST **grown = realloc(stack, ncap * sizeof(AST *));
+
+                    if(!grown){ //Leaks the rest of the tree rather than crashing
+                        free(stack);
+                        free(a);
+                        return;
+                    }
+
+                    stack = grown;
+                    cap = ncap;
+                }
+
+                stack[len++] = kids[i];
+            }
+        }
+
+        free(a);
+        a = len > 0 ? stack[--len] : NULL;
+    }
+
+    free(stack);
+}
+
+
+/**
+ * Mixes a word into a hash (multiplicative hashing; the high bits are the best mixed,
+ * so the index of a slot is taken from them)
+ */
+static uint64_t hash_mix(uint64_t h, uint64_t v){
+    return (h ^ v) * 0x9E3779B97F4A7C15ull;
+}
+
+
+/**
+ * Hash of the structure of a node: the text of a leaf, the operator and the addresses of
+ * the operands of an operation (the operands are shared already, so equal subtrees have
+ * equal addresses)
+ */
+static uint64_t node_hash(const AST *a){
+    uint64_t h = hash_mix(0, a->type);
+
+    if(a->type != NODE_OP){
+        for(size_t i = 0; i < a->num_len; i++){
+            h = (h ^ (unsigned char)a->num_text[i]) * 0x100000001B3ull;     //FNV-1a
+        }
+
+        return hash_mix(h, a->num_len);
+    }
+
+    h = hash_mix(h, a->op);
+    h = hash_mix(h, (uintptr_t)a->left);
+    h = hash_mix(h, (uintptr_t)a->middle);
+
+    return hash_mix(h, (uintptr_t)a->right);
+}
+
+
+static int node_equal(const AST *a, const AST *b){
+    if(a->type != b->type){
+        return 0;
+    }
+
+    if(a->type != NODE_OP){
+        return a->num_len == b->num_len && memcmp(a->num_text, b->num_text, a->num_len) == 0;
+    }
+
+    return a->op == b->op && a->left == b->left && a->middle == b->middle && a->right == b->right;
+}
+
+
+/**
+ * Index of the first slot to probe in a table of `cap` (a power of two) slots
+ */
+static size_t slot_index(uint64_t h, size_t cap){
+    return (size_t)(h >> 32) & (cap - 1);
+}
+
+
+/**
+ * Initializes an empty hash-consing table
+ * No memory is allocated until the first node
+ */
+void ast_cons_init(AstCons *c){
+    c->slots = NULL;
+    c->cap = 0;
+    c->len = 0;
+}
+
+
+/**
+ * Doubles the table and reinserts the nodes
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int cons_grow(AstCons *c){
+    size_t cap = c->cap ? c->cap * 2 : 256;
+    stats_note_alloc(cap * sizeof(AST *));
+    AST **slots = calloc(cap, sizeof(AST *));
+
+    if(!slots){
+        return -1;
+    }
+
+    for(size_t i = 0; i < c->cap; i++){
+        if(c->slots[i]){
+            size_t j = slot_index(node_hash(c->slots[i]), cap);
+
+            while(slots[j]){
+                j = (j + 1) & (cap - 1);
+            }
+
+            slots[j] = c->slots[i];
+        }
+    }
+
+    free(c->slots);
+    c->slots = slots;
+    c->cap = cap;
+
+    return 0;
+}
+
+
+/**
+ * Returns the node equal to `key`, creating it from `key` the first time
+ * A number is only converted with `strtod` when its node is created
+ * @return the node, or null if memory allocation fails
+ */
+static AST *cons(AstCons *c, Arena *arena, const AST *key){
+    if(c->len * 2 >= c->cap && cons_grow(c) != 0){
+        return NULL;
+    }
+
+    size_t i = slot_index(node_hash(key), c->cap);
+
+    //Linear probing; the table is never more than half full
+    while(c->slots[i]){
+        if(node_equal(c->slots[i], key)){
+            c->slots[i]->shared = 1;
+            return c->slots[i];
+        }
+
+        i = (i + 1) & (c->cap - 1);
+    }
+
+    AST *a = node_alloc(arena);
+
+    if(a){
+        *a = *key;
+
+        if(a->type == NODE_NUMBER){
+            a->num_value = ast_number_value(a->num_text, a->num_len);
+        }
+
+        c->slots[i] = a;
+        c->len++;
+    }
+
+    return a;
+}
+
+
+/**
+ * Hash-consing counterpart of `ast_make_number`: two literals with the same text are
+ * the same node (the text, not the value, is compared, so both still print the same)
+ * @param c: the table of the tree being built
+ * @param arena: arena that owns new nodes; it must not be null, since a DAG cannot be
+ *               released with `ast_free`
+ * @return the node, or null if memory allocation fails
+ */
+AST *ast_cons_number(AstCons *c, Arena *arena, const char *text, size_t len){
+    AST key = {.type = NODE_NUMBER, .num_text = text, .num_len = len};
+
+    return cons(c, arena, &key);
+}
+
+
+/**
+ * Hash-consing counterpart of `ast_make_var`
+ */
+AST *ast_cons_var(AstCons *c, Arena *arena, const char *name, size_t len){
+    AST key = {.type = NODE_VAR, .num_text = name, .num_len = len};
+
+    return cons(c, arena, &key);
+}
+
+
+/**
+ * Hash-consing counterpart of `ast_make_binary`; the operands must come from the same table
+ */
+AST *ast_cons_binary(AstCons *c, Arena *arena, OpType op, AST *left, AST *right){
+    AST key = {.type = NODE_OP, .op = op, .left = left, .right = right};
+
+    return cons(c, arena, &key);
+}
+
+
+/**
+ * Hash-consing counterpart of `ast_make_ternary`; the operands must come from the same table
+ */
+AST *ast_cons_ternary(AstCons *c, Arena *arena, AST *left, AST *middle, AST *right){
+    AST key = {.type = NODE_OP, .op = OP_TERN, .left = left, .middle = middle, .right = right};
+
+    return cons(c, arena, &key);
+}
+
+
+/**
+ * Forgets every node, so that the table can be used for a new tree after the arena of
+ * the previous one is reset; the slots are kept
+ */
+void ast_cons_clear(AstCons *c){
+    if(c->len > 0){
+        memset(c->slots, 0, c->cap * sizeof(AST *));
+        c->len = 0;
+    }
+}
+
+
+void ast_cons_free(AstCons *c){
+    free(c->slots);
+    ast_cons_init(c);
+}
+
+
+/**
+ * Initializes an empty map
+ * No memory is allocated until the first insertion
+ */
+void ast_map_init(AstMap *m){
+    m->keys = NULL;
+    m->values = NULL;
+    m->cap = 0;
+    m->len = 0;
+}
+
+
+/**
+ * Returns the value stored for `key`, or null
+ */
+void *ast_map_get(const AstMap *m, const AST *key){
+    if(m->len == 0){
+        return NULL;
+    }
+
+    size_t i = slot_index(hash_mix(0, (uintptr_t)key), m->cap);
+
+    while(m->keys[i]){
+        if(m->keys[i] == key){
+            return m->values[i];
+        }
+
+        i = (i + 1) & (m->cap - 1);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Stores `value` for `key`, replacing the previous value
+ * @return 0 on success, -1 if memory allocation fails
+ */
+int ast_map_put(AstMap *m, const AST *key, void *value){
+    if(m->len * 2 >= m->cap){
+        size_t cap = m->cap ? m->cap * 2 : 64;
+        stats_note_alloc(cap * sizeof(AST *));
+        stats_note_alloc(cap * sizeof(void *));
+        const AST **keys = calloc(cap, sizeof(AST *));
+        void **values = malloc(cap * sizeof(void *));
+
+        if(!keys || !values){
+            free(keys);
+            free(values);
+            return -1;
+        }
+
+        for(size_t i = 0; i < m->cap; i++){
+            if(m->keys[i]){
+                size_t j = slot_index(hash_mix(0, (uintptr_t)m->keys[i]), cap);
+
+                while(keys[j]){
+                    j = (j + 1) & (cap - 1);
+                }
+
+                keys[j] = m->keys[i];
+                values[j] = m->values[i];
+            }
+        }
+
+        free(m->keys);
+        free(m->values);
+        m->keys = keys;
+        m->values = values;
+        m->cap = cap;
     }
-    else if(a->type == NODE_OP){
-        ast_free(a->left);
-        ast_free(a->middle);
-        ast_free(a->right);
+
+    size_t i = slot_index(hash_mix(0, (uintptr_t)key), m->cap);
+
+    while(m->keys[i] && m->keys[i] != key){
+        i = (i + 1) & (m->cap - 1);
     }
 
-    free(a);
+    m->len += !m->keys[i];
+    m->keys[i] = key;
+    m->values[i] = value;
+
+    return 0;
+}
+
+
+void ast_map_free(AstMap *m){
+    free(m->keys);
+    free(m->values);
+    ast_map_init(m);
 }
 
 
@@ -95,11 +648,21 @@ void ast_free(AST *a){
  * @return the precedence level
  */
 int ast_prec(const AST *a){
-    if(a->type != NODE_OP){
-        return 5;   //Numbers have a higher precedence than any operator
+    if(a->type != NODE_OP && a->type != NODE_CHAIN){
+        return 5;   //Numbers and variables have a higher precedence than any operator
     }
 
-    switch (a->op){
+    return ast_op_prec(a->op);
+}
+
+
+/**
+ * Returns the precedence of an operator, from 1 (ternary) to 4 (power)
+ * @param op: operator
+ * @return the precedence level
+ */
+int ast_op_prec(OpType op){
+    switch (op){
         case OP_TERN:
             return 1;
         case OP_ADD:
@@ -124,4 +687,4 @@ int ast_prec(const AST *a){
  */
 int ast_is_right_assoc(OpType op){
     return op == OP_POW || op == OP_TERN;
-}
\ No newline at end of file
+}
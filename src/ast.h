@@ -7,9 +7,33 @@
  *        construct, free and manage expressions
  * 
  * The AST represents a hierarchical structure of a mathematical expression
- * Every node can be a number (leaf) or an operation (internal node)
+ * Every node can be a number or a variable (leaves) or an operation (internal node)
+ *
+ * Nodes are normally allocated from an `Arena` (see arena.h), so a whole tree is released
+ * by resetting the arena. Passing a null arena to the constructors allocates the node with
+ * `malloc` instead; only such trees may be released with `ast_free`
+ *
+ * Leaves do not copy their text: `num_text` points to the original literal or variable
+ * name, which must stay valid as long as the tree is used
+ *
+ * Chains of `add` or of `mul`, which generated inputs nest thousands of levels deep, are
+ * flattened by `ast_chain` into one NODE_CHAIN node holding its operands in an array, in
+ * the order they are written. A chain remembers whether it stands for left-nested links,
+ * `add(add(a, b), c)`, or right-nested ones, `add(a, add(b, c))`, which are not printed
+ * the same (`a + b + c` and `a + (b + c)`) nor evaluated in the same order, so it prints
+ * and evaluates exactly as the binary nodes it replaces. Other operators mixed into a
+ * chain (`sub` of `add`, `div` of `mul`) stay binary nodes among its operands
+ *
+ * The `ast_cons_*` constructors hash-cons: they return the existing node when one with the
+ * same structure was already built through the same `AstCons`, so repeated subtrees are
+ * stored once and the tree becomes a DAG. Such nodes are marked `shared`, which lets the
+ * printer and the compiler handle them once (see `AstMap`)
  */
 
+#include "arena.h"
+#include <stddef.h>
+#include <stdint.h>
+
 
 /**
  * @enum NodeType
@@ -17,7 +41,9 @@
  */
 typedef enum{
     NODE_NUMBER,
-    NODE_OP
+    NODE_VAR,
+    NODE_OP,
+    NODE_CHAIN  //`add` or `mul` over two or more operands (see `ast_chain`)
 } NodeType;
 
 
@@ -45,23 +71,83 @@ typedef enum{
 typedef struct AST{
     NodeType type;
 
-    // If type is NODE_NUMBER
-    char *num_text;
-    double num_value;   //Parsed with strtod
+    union{
+        // If type is NODE_NUMBER (or NODE_VAR: `num_text` is then the name of the variable)
+        struct{
+            const char *num_text;   //Points into the parsed input, not NUL-terminated
+            size_t num_len;
+            double num_value;   //Parsed with strtod
+        };
+
+        //If type is NODE_CHAIN (with `op`)
+        struct{
+            struct AST **args;  //The operands, left to right
+            size_t count;
+            uint32_t room;      //Free slots after the last operand, or before the first one if right-nested
+            uint32_t right_nested;  //`a + (b + (c + d))` rather than `a + b + c + d`
+        };
+    };
 
-    //If type is NODE_OP
+    //If type is NODE_OP (`op` also for NODE_CHAIN)
     OpType op;
     struct AST *left;
     struct AST *middle; //Null for binary operations
     struct AST *right;
+
+    unsigned shared;    //Non-zero if the hash-consing factory returned the node more than once
 } AST;
 
-AST *ast_make_number(const char *text);
-AST *ast_make_binary(OpType op, AST *left, AST *right);
-AST *ast_make_ternary(AST *left, AST *middle, AST *right);
-void ast_free(AST *a);
+
+/**
+ * @struct AstCons
+ * @brief Hash table of the nodes built by the hash-consing constructors
+ *
+ * Leaves are equal when they have the same type and text, operations when they have the
+ * same operator and the same (already shared) operands. The table does not own the nodes;
+ * it must be cleared when their arena is reset, and it no longer describes a tree that
+ * was rewritten in place (see passes.h)
+ */
+typedef struct{
+    AST **slots;    //Open addressing, null for an empty slot
+    size_t cap;     //Power of two, 0 before the first node
+    size_t len;
+} AstCons;
+
+
+/**
+ * @struct AstMap
+ * @brief Hash map from nodes to pointers, used to memoize work on shared nodes
+ */
+typedef struct{
+    const AST **keys;
+    void **values;
+    size_t cap;     //Power of two, 0 before the first insertion
+    size_t len;
+} AstMap;
+
+double ast_number_value(const char *text, size_t len);  //Value of a numeric literal
+AST *ast_make_number(Arena *arena, const char *text, size_t len);
+AST *ast_make_var(Arena *arena, const char *name, size_t len);
+AST *ast_make_binary(Arena *arena, OpType op, AST *left, AST *right);
+AST *ast_make_ternary(Arena *arena, AST *left, AST *middle, AST *right);
+AST *ast_chain(Arena *arena, OpType op, AST *left, AST *right);   //Like `ast_make_binary`, flattening chains of `add`/`mul`
+void ast_free(AST *a);  //Only for trees built with a null arena
+
+void ast_cons_init(AstCons *c);
+AST *ast_cons_number(AstCons *c, Arena *arena, const char *text, size_t len);
+AST *ast_cons_var(AstCons *c, Arena *arena, const char *name, size_t len);
+AST *ast_cons_binary(AstCons *c, Arena *arena, OpType op, AST *left, AST *right);
+AST *ast_cons_ternary(AstCons *c, Arena *arena, AST *left, AST *middle, AST *right);
+void ast_cons_clear(AstCons *c);    //Forgets every node, keeps the table
+void ast_cons_free(AstCons *c);
+
+void ast_map_init(AstMap *m);
+void *ast_map_get(const AstMap *m, const AST *key);    //Null if `key` is not in the map
+int ast_map_put(AstMap *m, const AST *key, void *value); //0 on success, -1 if memory allocation fails
+void ast_map_free(AstMap *m);
 
 int ast_prec(const AST *a);
+int ast_op_prec(OpType op);
 int ast_is_right_assoc(OpType op);
 
 #endif
\ No newline at end of file
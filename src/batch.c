@@ -0,0 +1,510 @@
+#include "batch.h"
+#include "parser.h"
+#include "printer.h"
+#include "buffer.h"
+#include "eval.h"
+#include "passes.h"
+#include "flat.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * Size of the output buffer of the sequential mode; it is written whenever it fills up
+ */
+#define BATCH_OUTPUT_CHUNK (64 * 1024)
+
+/**
+ * Approximate amount of input handed to a worker at a time; chunks end at a newline
+ */
+#define BATCH_INPUT_CHUNK (256 * 1024)
+
+/**
+ * Chunks that may be in flight (being processed or waiting to be written) per worker
+ * This bounds the memory used by finished output that is waiting for an earlier chunk
+ */
+#define BATCH_SLOTS_PER_JOB 4
+
+
+/**
+ * State that a thread reuses for all the records it transforms
+ */
+typedef struct{
+    Parser *parser;
+    Program prog;   //Only used when evaluating
+    FlatTree flat;  //Used instead of an AST when the records are not rewritten (see flat.h)
+    const BatchOptions *opts;
+
+    //Measurements, only when `opts->stats` is set
+    Stats stats;        //Totals of this thread, merged into `opts->stats` at the end
+    Lexer *lexer;       //Separate lexing pass of each record
+    StatsMark mark;     //Start of the current phase
+    StatsPhase phase;
+} BatchContext;
+
+
+/**
+ * Prepares the per-thread state
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int context_init(BatchContext *ctx, const BatchOptions *opts){
+    ctx->parser = parser_create("", 0);
+    ctx->opts = opts;
+    ctx->lexer = opts->stats ? lexer_create("", 0) : NULL;
+    program_init(&ctx->prog);
+    flat_init(&ctx->flat);
+    stats_init(&ctx->stats);
+
+    if(!ctx->parser || (opts->stats && !ctx->lexer)){
+        return -1;
+    }
+
+    parser_set_dag(ctx->parser, opts->dag);
+
+    return 0;
+}
+
+
+static void context_free(BatchContext *ctx){
+    if(ctx->parser){
+        parser_destroy(ctx->parser);
+    }
+
+    if(ctx->lexer){
+        lexer_destroy(ctx->lexer);
+    }
+
+    program_free(&ctx->prog);
+    flat_free(&ctx->flat);
+}
+
+
+/**
+ * Ends the current phase of the record being measured and starts `next`
+ * Does nothing when the run is not measured
+ */
+static void checkpoint(BatchContext *ctx, StatsPhase next){
+    if(ctx->lexer){
+        stats_phase(&ctx->stats, ctx->phase, &ctx->mark);
+        stats_mark(&ctx->mark);
+        ctx->phase = next;
+    }
+}
+
+
+/**
+ * Appends an "Error: ..." record
+ * @return always 1, the status of a failed record
+ */
+static int batch_error(Buffer *out, const char *err){
+    buffer_puts(out, "Error: ");
+    buffer_puts(out, err ? err : "Unknown error");
+    buffer_putc(out, '\n');
+
+    return 1;
+}
+
+
+/**
+ * Replaces the output of a record whose printing failed by an error record, so that the
+ * record still produces its one line
+ * The partial text is dropped, unless a streaming buffer has already flushed part of it
+ * @param start: `out->flushed + out->len` before the record's text was written
+ * @return always 1, the status of a failed record
+ */
+static int print_error(Buffer *out, size_t start){
+    if(start >= out->flushed){
+        out->len = start - out->flushed;
+    }
+
+    return batch_error(out, "Out of memory");
+}
+
+
+/**
+ * `batch_record` for the records that are not rewritten: they are analyzed into the
+ * compact flat tree of the context, which is printed or evaluated in place
+ * @return 0 if the record was transformed, 1 if it produced an error record
+ */
+static int batch_flat_record(BatchContext *ctx, Buffer *out){
+    if(parser_parse_flat(ctx->parser, &ctx->flat) != 0){
+        return batch_error(out, parser_error(ctx->parser));
+    }
+
+    checkpoint(ctx, STATS_OUTPUT);
+
+    size_t start = out->flushed + out->len;
+
+    if(ctx->opts->eval){
+        double value;
+        EvalError err = flat_eval(&ctx->flat, &value);
+
+        if(err != EVAL_OK){
+            return batch_error(out, program_strerror(err));
+        }
+
+        buffer_put_double(out, value);
+    }
+    else if(flat_print(&ctx->flat, out) != 0){
+        return print_error(out, start);
+    }
+
+    buffer_putc(out, '\n');
+
+    return 0;
+}
+
+
+/**
+ * Transforms (or evaluates) one record and appends the result, or an error record, to `out`
+ *
+ * @param ctx: parser and program reused across records
+ * @param line: the expression, without the trailing newline
+ * @param len: length of the line
+ * @param out: output buffer shared by the records of a chunk
+ * @return 0 if the record was transformed, 1 if it produced an error record
+ */
+static int transform_record(BatchContext *ctx, const char *line, size_t len, Buffer *out){
+    parser_reset(ctx->parser, line, len);   //Releases the previous tree
+    checkpoint(ctx, STATS_PARSE);
+
+    if(!ctx->opts->passes && !ctx->opts->dag){
+        return batch_flat_record(ctx, out);
+    }
+
+    AST *ast = parser_parse(ctx->parser);
+
+    if(!ast){
+        return batch_error(out, parser_error(ctx->parser));
+    }
+
+    checkpoint(ctx, STATS_PASSES);
+
+    if(!(ast = passes_run(ast, ctx->opts->passes, parser_arena(ctx->parser)))){
+        return batch_error(out, "Out of memory");
+    }
+
+    checkpoint(ctx, STATS_OUTPUT);
+
+    size_t start = out->flushed + out->len;
+
+    if(ctx->opts->eval){
+        double value;
+        EvalError err;
+
+        if(program_compile(&ctx->prog, ast) != 0){
+            return batch_error(out, program_strerror(EVAL_NO_MEMORY));
+        }
+
+        if((err = program_run(&ctx->prog, NULL, &value)) != EVAL_OK){
+            return batch_error(out, program_strerror(err));
+        }
+
+        buffer_put_double(out, value);
+    }
+    else if(ast_print(ast, out) != 0){
+        return print_error(out, start);
+    }
+
+    buffer_putc(out, '\n');
+
+    return 0;
+}
+
+
+/**
+ * `transform_record`, measured when the run collects stats: the record is lexed once on
+ * its own first, and its total time goes to the latency histogram
+ * The release of a tree happens when the next record resets the parser, so it is counted
+ * in the "free" phase of that record
+ */
+static int batch_record(BatchContext *ctx, const char *line, size_t len, Buffer *out){
+    if(!ctx->lexer){
+        return transform_record(ctx, line, len, out);
+    }
+
+    StatsMark start;
+    size_t written = out->flushed + out->len;
+
+    stats_mark(&start);
+    ctx->mark = start;
+    lexer_reset(ctx->lexer, line, len);
+    stats_scan(&ctx->stats, ctx->lexer);
+    ctx->phase = STATS_LEX;
+    checkpoint(ctx, STATS_FREE);
+
+    int failed = transform_record(ctx, line, len, out);
+
+    checkpoint(ctx, STATS_OUTPUT);
+    stats_latency(&ctx->stats, ctx->mark.t - start.t);
+    ctx->stats.records++;
+    ctx->stats.failed += failed;
+    ctx->stats.input_bytes += len;
+    ctx->stats.output_bytes += out->flushed + out->len - written;
+
+    return failed;
+}
+
+
+/**
+ * Transforms every line of `data[0..len)`, which must be made of whole lines
+ * @return 0 if every record was transformed, 1 if at least one of them failed
+ */
+static int batch_lines(BatchContext *ctx, const char *data, size_t len, Buffer *out){
+    const char *p = data;
+    const char *end = data + len;
+    int failed = 0;
+
+    while(p < end){
+        const char *nl = memchr(p, '\n', end - p);
+        const char *eol = nl ? nl : end;
+
+        failed |= batch_record(ctx, p, eol - p, out);
+        p = nl ? nl + 1 : end;
+    }
+
+    return failed;
+}
+
+
+/**
+ * A chunk of the input owned by a worker until its output has been written
+ */
+typedef struct{
+    Buffer out;
+    int failed;
+    int full;       //The output is complete and waits for the writer
+} BatchSlot;
+
+
+/**
+ * State shared by the workers and the writer of a parallel run
+ */
+typedef struct{
+    const char *data;
+    size_t len;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;   //A slot became full
+    pthread_cond_t space;   //A slot was written and can be reused
+
+    size_t cursor;          //Start of the next chunk to hand out
+    size_t next;            //Sequence number of the next chunk to hand out
+    size_t written;         //Number of chunks already written
+    int oom;
+    const BatchOptions *opts;
+
+    BatchSlot *slots;
+    size_t nslots;
+} BatchShared;
+
+
+/**
+ * Worker thread: takes chunks in input order and transforms them with its own parser
+ * into the chunk's slot. Chunk `n` always uses slot `n % nslots`, so the writer knows
+ * where to find each one
+ */
+static void *batch_worker(void *arg){
+    BatchShared *sh = arg;
+    BatchContext ctx;
+
+    if(context_init(&ctx, sh->opts) != 0){
+        context_free(&ctx);
+        pthread_mutex_lock(&sh->lock);
+        sh->oom = 1;
+        pthread_cond_broadcast(&sh->ready);
+        pthread_mutex_unlock(&sh->lock);
+
+        return NULL;
+    }
+
+    while(1){
+        pthread_mutex_lock(&sh->lock);
+
+        //Waits until the slot of the next chunk has been written
+        while(sh->cursor < sh->len && sh->next - sh->written >= sh->nslots){
+            pthread_cond_wait(&sh->space, &sh->lock);
+        }
+
+        if(sh->cursor >= sh->len){
+            pthread_mutex_unlock(&sh->lock);
+            break;
+        }
+
+        //The chunk is extended to the end of the line where it would stop
+        size_t start = sh->cursor;
+        size_t end = sh->len - start > BATCH_INPUT_CHUNK ? start + BATCH_INPUT_CHUNK : sh->len;
+        const char *nl = end < sh->len ? memchr(sh->data + end, '\n', sh->len - end) : NULL;
+
+        end = nl ? (size_t)(nl - sh->data) + 1 : sh->len;
+        sh->cursor = end;
+
+        BatchSlot *slot = &sh->slots[sh->next++ % sh->nslots];
+
+        pthread_mutex_unlock(&sh->lock);
+
+        buffer_clear(&slot->out);
+        slot->failed = batch_lines(&ctx, sh->data + start, end - start, &slot->out);
+
+        pthread_mutex_lock(&sh->lock);
+        slot->full = 1;
+        pthread_cond_broadcast(&sh->ready);
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    if(sh->opts->stats){
+        pthread_mutex_lock(&sh->lock);
+        stats_merge(sh->opts->stats, &ctx.stats);
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    context_free(&ctx);
+
+    return NULL;
+}
+
+
+/**
+ * Parallel batch: `jobs` workers transform chunks of lines while the calling thread
+ * writes the finished chunks in input order
+ */
+static int batch_parallel(const char *data, size_t len, const BatchOptions *opts, FILE *out){
+    int jobs = opts->jobs;
+    BatchShared sh;
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+
+    sh.data = data;
+    sh.len = len;
+    sh.cursor = 0;
+    sh.next = 0;
+    sh.written = 0;
+    sh.oom = 0;
+    sh.opts = opts;
+    sh.nslots = (size_t)jobs * BATCH_SLOTS_PER_JOB;
+    sh.slots = calloc(sh.nslots, sizeof(BatchSlot));
+
+    if(!threads || !sh.slots){
+        free(threads);
+        free(sh.slots);
+        return -1;
+    }
+
+    for(size_t i = 0; i < sh.nslots; i++){
+        buffer_init(&sh.slots[i].out);
+    }
+
+    pthread_mutex_init(&sh.lock, NULL);
+    pthread_cond_init(&sh.ready, NULL);
+    pthread_cond_init(&sh.space, NULL);
+
+    int started = 0;
+
+    while(started < jobs && pthread_create(&threads[started], NULL, batch_worker, &sh) == 0){
+        started++;
+    }
+
+    int failed = started == 0 ? -1 : 0;
+
+    //Writer: chunks are written strictly in the order they were handed out
+    for(size_t id = 0; started > 0; id++){
+        BatchSlot *slot = &sh.slots[id % sh.nslots];
+
+        pthread_mutex_lock(&sh.lock);
+
+        while(!slot->full && !sh.oom && !(sh.cursor >= sh.len && id >= sh.next)){
+            pthread_cond_wait(&sh.ready, &sh.lock);
+        }
+
+        if(!slot->full){
+            if(sh.oom){
+                failed = -1;
+            }
+
+            pthread_mutex_unlock(&sh.lock);
+            break;
+        }
+
+        pthread_mutex_unlock(&sh.lock);
+
+        if(buffer_flush(&slot->out, out) != 0){
+            failed = -1;
+        }
+
+        failed |= slot->failed;
+
+        pthread_mutex_lock(&sh.lock);
+        slot->full = 0;
+        sh.written++;
+        pthread_cond_broadcast(&sh.space);
+        pthread_mutex_unlock(&sh.lock);
+    }
+
+    //Releases workers still waiting for space after an early stop
+    pthread_mutex_lock(&sh.lock);
+    sh.cursor = sh.len;
+    pthread_cond_broadcast(&sh.space);
+    pthread_mutex_unlock(&sh.lock);
+
+    for(int i = 0; i < started; i++){
+        pthread_join(threads[i], NULL);
+    }
+
+    for(size_t i = 0; i < sh.nslots; i++){
+        buffer_free(&sh.slots[i].out);
+    }
+
+    pthread_cond_destroy(&sh.space);
+    pthread_cond_destroy(&sh.ready);
+    pthread_mutex_destroy(&sh.lock);
+    free(sh.slots);
+    free(threads);
+
+    return failed;
+}
+
+
+/**
+ * Transforms every line of the input as an independent expression and writes one line
+ * of output per input line to `out`
+ *
+ * With one job a single parser and one output buffer are reused for all the records on
+ * the calling thread. With more, the input is split into chunks of whole lines that a
+ * pool of workers (each with its own parser and output buffer) transforms concurrently,
+ * and the chunks are written back in input order
+ *
+ * @param data: the input, not necessarily NUL-terminated
+ * @param len: its length in bytes
+ * @param opts: settings of the run
+ * @param out: destination of the results
+ * @return 0 if every record was transformed, 1 if at least one of them failed, -1 on a
+ *         fatal error (out of memory, write error)
+ */
+int batch_run(const char *data, size_t len, const BatchOptions *opts, FILE *out){
+    if(opts->jobs > 1 && len > BATCH_INPUT_CHUNK){
+        return batch_parallel(data, len, opts, out);
+    }
+
+    BatchContext ctx;
+    Buffer buf;
+
+    if(context_init(&ctx, opts) != 0 || buffer_init_sink(&buf, out, BATCH_OUTPUT_CHUNK) != 0){
+        context_free(&ctx);
+        return -1;
+    }
+
+    int failed = batch_lines(&ctx, data, len, &buf);
+
+    if(buffer_flush(&buf, out) != 0){
+        failed = -1;
+    }
+
+    if(opts->stats){
+        stats_merge(opts->stats, &ctx.stats);
+    }
+
+    buffer_free(&buf);
+    context_free(&ctx);
+
+    return failed;
+}
@@ -0,0 +1,33 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "stats.h"
+#include <stddef.h>
+#include <stdio.h>
+
+
+/**
+ * @file batch.h
+ * @brief Batch mode: transforms every line of a buffer as an independent expression
+ *
+ * Every line produces exactly one line of output, either the infix expression (or its
+ * value, see eval.h) or an "Error: ..." record, and the output keeps the order of the input whatever the number
+ * of worker threads
+ */
+
+
+/**
+ * @struct BatchOptions
+ * @brief Settings of a batch run
+ */
+typedef struct{
+    int jobs;   //Worker threads, 1 runs everything on the calling thread
+    int eval;   //Writes the value of each expression instead of its infix form
+    unsigned passes;    //Simplification passes run on each tree (PASS_* flags, see passes.h)
+    int dag;    //Shares the repeated subtrees of each expression (see ast.h)
+    Stats *stats;   //Receives the phases and the latency of every record, NULL to not measure
+} BatchOptions;
+
+int batch_run(const char *data, size_t len, const BatchOptions *opts, FILE *out);  //0 if every record succeeded, 1 otherwise, -1 on a fatal error
+
+#endif
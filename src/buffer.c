@@ -0,0 +1,219 @@
+#include "buffer.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * Initializes an empty buffer
+ * No memory is allocated until the first append
+ */
+void buffer_init(Buffer *b){
+    b->data = NULL;
+    b->len = 0;
+    b->cap = 0;
+    b->sink = NULL;
+    b->flushed = 0;
+    b->fixed = 0;
+}
+
+
+/**
+ * Initializes a streaming buffer of `cap` bytes that flushes itself to `sink` when full
+ * A single append larger than `cap` still grows the buffer
+ *
+ * @return 0 on success, -1 if memory allocation fails
+ */
+int buffer_init_sink(Buffer *b, FILE *sink, size_t cap){
+    buffer_init(b);
+
+    if(buffer_reserve(b, cap) != 0){
+        return -1;
+    }
+
+    b->sink = sink;
+
+    return 0;
+}
+
+
+/**
+ * Initializes a buffer over `cap` bytes at `data`, owned by the caller
+ * Appends that would need more than `cap` bytes (including the room for the terminating
+ * NUL) fail instead of allocating, and `buffer_free` leaves the memory alone
+ */
+void buffer_init_fixed(Buffer *b, char *data, size_t cap){
+    buffer_init(b);
+    b->data = data;
+    b->cap = cap;
+    b->fixed = 1;
+}
+
+
+/**
+ * Ensures that at least `extra` more bytes (plus a terminating NUL) fit in the buffer
+ * The capacity grows geometrically, so appending n bytes costs O(n) amortized
+ * A streaming buffer first writes its pending bytes to the sink to make room
+ *
+ * @param b: the buffer
+ * @param extra: number of bytes that are going to be appended
+ * @return 0 on success, -1 if memory allocation fails
+ */
+int buffer_reserve(Buffer *b, size_t extra){
+    size_t need = b->len + extra + 1;
+
+    if(need <= b->cap){
+        return 0;
+    }
+
+    if(b->sink && b->len > 0){
+        if(buffer_flush(b, b->sink) != 0){
+            return -1;
+        }
+
+        need = extra + 1;
+
+        if(need <= b->cap){
+            return 0;
+        }
+    }
+
+    if(b->fixed){
+        return -1;
+    }
+
+    size_t cap = b->cap ? b->cap : 256;
+
+    while(cap < need){
+        cap *= 2;
+    }
+
+    stats_note_alloc(cap);
+    char *data = realloc(b->data, cap);
+
+    if(!data){
+        return -1;
+    }
+
+    b->data = data;
+    b->cap = cap;
+
+    return 0;
+}
+
+
+/**
+ * Appends `n` bytes from `s` to the end of the buffer
+ */
+int buffer_append(Buffer *b, const char *s, size_t n){
+    if(buffer_reserve(b, n) != 0){
+        return -1;
+    }
+
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+
+    return 0;
+}
+
+
+/**
+ * Appends a NUL-terminated string
+ */
+int buffer_puts(Buffer *b, const char *s){
+    return buffer_append(b, s, strlen(s));
+}
+
+
+/**
+ * Appends a single character
+ */
+int buffer_putc(Buffer *b, char c){
+    if(buffer_reserve(b, 1) != 0){
+        return -1;
+    }
+
+    b->data[b->len++] = c;
+
+    return 0;
+}
+
+
+/**
+ * Appends a double with the fewest significant digits (15 to 17) that convert back to
+ * exactly the same value, so 0.1 prints as "0.1" and no information is lost
+ * NaN is always written as "nan", whatever its sign bit
+ */
+int buffer_put_double(Buffer *b, double v){
+    char tmp[32];
+    int n = 0;
+
+    if(v != v){
+        return buffer_puts(b, "nan");
+    }
+
+    for(int digits = 15; digits <= 17; digits++){
+        n = snprintf(tmp, sizeof(tmp), "%.*g", digits, v);
+
+        if(strtod(tmp, NULL) == v){
+            break;
+        }
+    }
+
+    return buffer_append(b, tmp, (size_t)n);
+}
+
+
+/**
+ * Returns the contents as a NUL-terminated string
+ * The terminator is not counted in `len`, so later appends overwrite it
+ */
+const char *buffer_cstr(Buffer *b){
+    if(buffer_reserve(b, 0) != 0){
+        return NULL;
+    }
+
+    b->data[b->len] = '\0';
+
+    return b->data;
+}
+
+
+/**
+ * Writes the whole contents of the buffer to `f` with a single `fwrite` and empties it
+ * The allocated memory is kept so the buffer can be reused
+ *
+ * @return 0 on success, -1 on a write error
+ */
+int buffer_flush(Buffer *b, FILE *f){
+    int rc = 0;
+
+    if(b->len > 0 && fwrite(b->data, 1, b->len, f) != b->len){
+        rc = -1;
+    }
+
+    b->flushed += b->len;
+    b->len = 0;
+
+    return rc;
+}
+
+
+/**
+ * Empties the buffer without releasing its memory
+ */
+void buffer_clear(Buffer *b){
+    b->len = 0;
+}
+
+
+/**
+ * Releases the memory owned by the buffer
+ */
+void buffer_free(Buffer *b){
+    if(!b->fixed){
+        free(b->data);
+    }
+
+    buffer_init(b);
+}
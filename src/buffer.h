@@ -0,0 +1,48 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+
+/**
+ * @file buffer.h
+ * @brief Growable byte buffer used to collect output before it is written in large chunks
+ */
+
+
+/**
+ * @struct Buffer
+ * @brief Contiguous, growable array of bytes
+ *
+ * `data` is not NUL-terminated unless `buffer_cstr` is called
+ *
+ * A buffer created with `buffer_init_sink` streams: instead of growing past its capacity
+ * it writes the pending bytes to `sink`, so its memory stays bounded
+ *
+ * A buffer created with `buffer_init_fixed` uses memory of the caller and never grows:
+ * an append that does not fit fails
+ */
+typedef struct{
+    char *data;
+    size_t len;
+    size_t cap;
+    FILE *sink;     //NULL for an in-memory buffer
+    size_t flushed; //Bytes written out by `buffer_flush` so far
+    int fixed;      //`data` belongs to the caller
+} Buffer;
+
+void buffer_init(Buffer *b);
+int buffer_init_sink(Buffer *b, FILE *sink, size_t cap);
+void buffer_init_fixed(Buffer *b, char *data, size_t cap);
+int buffer_reserve(Buffer *b, size_t extra);   //0 on success, -1 if memory allocation fails
+int buffer_append(Buffer *b, const char *s, size_t n);
+int buffer_puts(Buffer *b, const char *s);
+int buffer_putc(Buffer *b, char c);
+int buffer_put_double(Buffer *b, double v);     //Shortest "%g" form that reads back as `v`
+const char *buffer_cstr(Buffer *b);    //NUL-terminates the contents without changing `len`
+int buffer_flush(Buffer *b, FILE *f);  //Writes the contents to `f` and empties the buffer
+void buffer_clear(Buffer *b);
+void buffer_free(Buffer *b);
+
+#endif
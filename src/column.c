@@ -0,0 +1,310 @@
+#include "column.h"
+#include "stats.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define COLUMN_X86 1
+#endif
+
+
+/**
+ * Rows evaluated together; a multiple of every vector width
+ */
+#define COLUMN_BLOCK 512
+
+
+typedef void (*BinaryKernel)(double *dst, const double *a, const double *b, size_t n);
+typedef void (*SelectKernel)(double *dst, const double *c, const double *a, const double *b, size_t n);
+
+
+/**
+ * The element-wise operations of one instruction set
+ * `dst` may be the same array as an operand
+ */
+typedef struct{
+    const char *name;
+    BinaryKernel add, sub, mul, div;
+    SelectKernel select;
+} ColumnKernels;
+
+
+#define SCALAR_BINARY(name, op)                                                         \
+    static void name##_scalar(double *dst, const double *a, const double *b, size_t n){ \
+        for(size_t i = 0; i < n; i++){                                                  \
+            dst[i] = a[i] op b[i];                                                      \
+        }                                                                               \
+    }
+
+SCALAR_BINARY(add, +)
+SCALAR_BINARY(sub, -)
+SCALAR_BINARY(mul, *)
+SCALAR_BINARY(div, /)
+
+
+static void select_scalar(double *dst, const double *c, const double *a, const double *b, size_t n){
+    for(size_t i = 0; i < n; i++){
+        dst[i] = c[i] != 0.0 ? a[i] : b[i];
+    }
+}
+
+
+static const ColumnKernels kernels_scalar = {
+    "scalar", add_scalar, sub_scalar, mul_scalar, div_scalar, select_scalar
+};
+
+
+#ifdef COLUMN_X86
+
+/**
+ * AVX2: 4 doubles per operation, the tail of the last block in scalar code
+ */
+#define AVX2_BINARY(name, intrin, op)                                                         \
+    __attribute__((target("avx2")))                                                         \
+    static void name##_avx2(double *dst, const double *a, const double *b, size_t n){       \
+        size_t i = 0;                                                                       \
+        for(; i + 4 <= n; i += 4){                                                          \
+            _mm256_storeu_pd(dst + i, intrin(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i))); \
+        }                                                                                   \
+        for(; i < n; i++){                                                                  \
+            dst[i] = a[i] op b[i];                                                          \
+        }                                                                                   \
+    }
+
+AVX2_BINARY(add, _mm256_add_pd, +)
+AVX2_BINARY(sub, _mm256_sub_pd, -)
+AVX2_BINARY(mul, _mm256_mul_pd, *)
+AVX2_BINARY(div, _mm256_div_pd, /)
+
+
+/**
+ * `c != 0` (unordered, so NaN selects `a`) builds the mask that blends `a` over `b`
+ */
+__attribute__((target("avx2")))
+static void select_avx2(double *dst, const double *c, const double *a, const double *b, size_t n){
+    const __m256d zero = _mm256_setzero_pd();
+    size_t i = 0;
+
+    for(; i + 4 <= n; i += 4){
+        __m256d mask = _mm256_cmp_pd(_mm256_loadu_pd(c + i), zero, _CMP_NEQ_UQ);
+        _mm256_storeu_pd(dst + i, _mm256_blendv_pd(_mm256_loadu_pd(b + i), _mm256_loadu_pd(a + i), mask));
+    }
+
+    select_scalar(dst + i, c + i, a + i, b + i, n - i);
+}
+
+
+static const ColumnKernels kernels_avx2 = {
+    "avx2", add_avx2, sub_avx2, mul_avx2, div_avx2, select_avx2
+};
+
+
+/**
+ * AVX-512: 8 doubles per operation
+ */
+#define AVX512_BINARY(name, intrin, op)                                                       \
+    __attribute__((target("avx512f")))                                                      \
+    static void name##_avx512(double *dst, const double *a, const double *b, size_t n){     \
+        size_t i = 0;                                                                       \
+        for(; i + 8 <= n; i += 8){                                                          \
+            _mm512_storeu_pd(dst + i, intrin(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i))); \
+        }                                                                                   \
+        for(; i < n; i++){                                                                  \
+            dst[i] = a[i] op b[i];                                                          \
+        }                                                                                   \
+    }
+
+AVX512_BINARY(add, _mm512_add_pd, +)
+AVX512_BINARY(sub, _mm512_sub_pd, -)
+AVX512_BINARY(mul, _mm512_mul_pd, *)
+AVX512_BINARY(div, _mm512_div_pd, /)
+
+
+__attribute__((target("avx512f")))
+static void select_avx512(double *dst, const double *c, const double *a, const double *b, size_t n){
+    const __m512d zero = _mm512_setzero_pd();
+    size_t i = 0;
+
+    for(; i + 8 <= n; i += 8){
+        __mmask8 mask = _mm512_cmp_pd_mask(_mm512_loadu_pd(c + i), zero, _CMP_NEQ_UQ);
+        _mm512_storeu_pd(dst + i, _mm512_mask_blend_pd(mask, _mm512_loadu_pd(b + i), _mm512_loadu_pd(a + i)));
+    }
+
+    select_scalar(dst + i, c + i, a + i, b + i, n - i);
+}
+
+
+static const ColumnKernels kernels_avx512 = {
+    "avx512", add_avx512, sub_avx512, mul_avx512, div_avx512, select_avx512
+};
+
+#endif
+
+
+static const ColumnKernels *kernels = &kernels_scalar;
+
+
+/**
+ * Evaluates a straight-line program (see `program_compile_select`) for every row
+ *
+ * The value stack holds pointers: a variable is pushed as a pointer into its column, and
+ * every other entry points to the scratch block of its stack slot, where the operation
+ * that produced it wrote its results, or to the block of a temporary
+ *
+ * @param p: the compiled program
+ * @param vars: one column per variable of the program, indexed like `p->vars`
+ * @param nrows: number of values in each column
+ * @param out: receives one result per row
+ * @return 0 on success, -1 if memory allocation fails or the program contains jumps
+ */
+int column_eval(const Program *p, const double *const *vars, size_t nrows, double *out){
+    const ColumnKernels *k = kernels;
+    stats_note_alloc((p->max_stack + p->ntemps) * COLUMN_BLOCK * sizeof(double));
+    stats_note_alloc(p->max_stack * sizeof(double *));
+    double *scratch = malloc((p->max_stack + p->ntemps) * COLUMN_BLOCK * sizeof(double));
+    const double **stack = malloc(p->max_stack * sizeof(double *));
+    int rc = 0;
+
+    if(!scratch || !stack){
+        free(scratch);
+        free(stack);
+        return -1;
+    }
+
+    double *temps = scratch + p->max_stack * COLUMN_BLOCK;   //After the blocks of the stack
+
+    for(size_t row = 0; row < nrows && rc == 0; row += COLUMN_BLOCK){
+        size_t n = nrows - row < COLUMN_BLOCK ? nrows - row : COLUMN_BLOCK;
+        size_t sp = 0;
+
+        for(size_t pc = 0; pc < p->len && rc == 0; pc++){
+            const Instr in = p->code[pc];
+            double *dst = scratch + (sp >= 2 ? sp - 2 : 0) * COLUMN_BLOCK;
+
+            switch ((OpCode)in.op){
+                case OPC_PUSH:{
+                    double *slot = scratch + sp * COLUMN_BLOCK;
+                    double v = p->consts[in.arg];
+
+                    for(size_t i = 0; i < n; i++){
+                        slot[i] = v;
+                    }
+
+                    stack[sp++] = slot;
+                    break;
+                }
+                case OPC_LOAD:
+                    stack[sp++] = vars[in.arg] + row;
+                    break;
+                case OPC_ADD:
+                    k->add(dst, stack[sp - 2], stack[sp - 1], n);
+                    stack[--sp - 1] = dst;
+                    break;
+                case OPC_SUB:
+                    k->sub(dst, stack[sp - 2], stack[sp - 1], n);
+                    stack[--sp - 1] = dst;
+                    break;
+                case OPC_MUL:
+                    k->mul(dst, stack[sp - 2], stack[sp - 1], n);
+                    stack[--sp - 1] = dst;
+                    break;
+                case OPC_DIV:
+                    k->div(dst, stack[sp - 2], stack[sp - 1], n);
+                    stack[--sp - 1] = dst;
+                    break;
+                case OPC_MOD:   //No vector form in libm: one call per row
+                    for(size_t i = 0; i < n; i++){
+                        dst[i] = fmod(stack[sp - 2][i], stack[sp - 1][i]);
+                    }
+
+                    stack[--sp - 1] = dst;
+                    break;
+                case OPC_POW:
+                    for(size_t i = 0; i < n; i++){
+                        dst[i] = pow(stack[sp - 2][i], stack[sp - 1][i]);
+                    }
+
+                    stack[--sp - 1] = dst;
+                    break;
+                case OPC_SELECT:{
+                    double *slot = scratch + (sp - 3) * COLUMN_BLOCK;
+
+                    k->select(slot, stack[sp - 3], stack[sp - 2], stack[sp - 1], n);
+                    sp -= 2;
+                    stack[sp - 1] = slot;
+                    break;
+                }
+                case OPC_STORE:     //A copy: the block of the stack slot is reused
+                    memcpy(temps + in.arg * COLUMN_BLOCK, stack[sp - 1], n * sizeof(double));
+                    break;
+                case OPC_TEMP:
+                    stack[sp++] = temps + in.arg * COLUMN_BLOCK;
+                    break;
+                case OPC_RET:
+                    memcpy(out + row, stack[sp - 1], n * sizeof(double));
+                    break;
+                case OPC_JZ:
+                case OPC_JMP:
+                    rc = -1;
+                    break;
+            }
+        }
+    }
+
+    free(scratch);
+    free(stack);
+
+    return rc;
+}
+
+
+/**
+ * Selects the instruction set of the kernels
+ * @param name: "scalar", "avx2" or "avx512"
+ * @return 0 on success, -1 if the variant is unknown or not supported by this CPU
+ */
+int column_select(const char *name){
+    if(strcmp(name, "scalar") == 0){
+        kernels = &kernels_scalar;
+        return 0;
+    }
+
+#ifdef COLUMN_X86
+    if(strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")){
+        kernels = &kernels_avx2;
+        return 0;
+    }
+
+    if(strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512f")){
+        kernels = &kernels_avx512;
+        return 0;
+    }
+#endif
+
+    return -1;
+}
+
+
+/**
+ * Returns the name of the variant in use
+ */
+const char *column_selected(void){
+    return kernels->name;
+}
+
+
+/**
+ * Picks the widest variant supported by the CPU before `main` runs
+ */
+__attribute__((constructor))
+static void column_init(void){
+#ifdef COLUMN_X86
+    __builtin_cpu_init();
+
+    if(column_select("avx512") != 0){
+        column_select("avx2");
+    }
+#endif
+}
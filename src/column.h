@@ -0,0 +1,26 @@
+#ifndef COLUMN_H
+#define COLUMN_H
+
+#include "eval.h"
+#include <stddef.h>
+
+
+/**
+ * @file column.h
+ * @brief Evaluates one compiled expression over whole columns of values
+ *
+ * The program must come from `program_compile_select` (no jumps). Rows are processed in
+ * blocks: every instruction runs over a whole block before the next one, so the cost of
+ * decoding the bytecode is paid once per block and the arithmetic runs 4 (AVX2) or 8
+ * (AVX-512) lanes at a time. `tern` evaluates both branches and blends them
+ *
+ * Unlike `program_run`, the arithmetic follows IEEE rules everywhere: a division by zero
+ * gives an infinity or NaN for that row instead of stopping the evaluation
+ */
+
+int column_eval(const Program *p, const double *const *vars, size_t nrows, double *out);  //0 on success, -1 if memory allocation fails
+
+int column_select(const char *name);   //Forces "scalar", "avx2" or "avx512"; -1 if not available here
+const char *column_selected(void);     //Name of the variant in use
+
+#endif
@@ -0,0 +1,538 @@
+#include "eval.h"
+#include "stats.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * Values that fit in this many slots are kept on the machine stack while running
+ */
+#define EVAL_LOCAL_STACK 256
+
+
+/**
+ * A node of the tree being compiled
+ * `stage` counts the children already compiled; the ternary operator also remembers the
+ * instruction it has to patch and the stack depth at its branches
+ */
+typedef struct{
+    const AST *node;
+    size_t stage;
+    size_t patch;
+    size_t depth;
+} CompileFrame;
+
+
+/**
+ * Growable stack of compile frames, in a small local array until it has to grow
+ */
+typedef struct{
+    CompileFrame *items;
+    size_t len;
+    size_t cap;
+    CompileFrame local[64];
+} CompileStack;
+
+
+/**
+ * Pushes a subtree to compile
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int push_frame(CompileStack *st, const AST *node){
+    if(st->len == st->cap){
+        size_t cap = st->cap * 2;
+        stats_note_alloc(cap * sizeof(CompileFrame));
+        CompileFrame *items = st->items == st->local ? malloc(cap * sizeof(CompileFrame))
+                                                     : realloc(st->items, cap * sizeof(CompileFrame));
+
+        if(!items){
+            return -1;
+        }
+
+        if(st->items == st->local){
+            memcpy(items, st->local, sizeof(st->local));
+        }
+
+        st->items = items;
+        st->cap = cap;
+    }
+
+    CompileFrame *f = &st->items[st->len++];
+    f->node = node;
+    f->stage = 0;
+    f->patch = 0;
+    f->depth = 0;
+
+    return 0;
+}
+
+
+/**
+ * Appends an instruction
+ * @return its index, or (size_t)-1 if memory allocation fails
+ */
+static size_t emit(Program *p, OpCode op, uint32_t arg){
+    if(p->len == p->cap){
+        size_t cap = p->cap ? p->cap * 2 : 64;
+        stats_note_alloc(cap * sizeof(Instr));
+        Instr *code = realloc(p->code, cap * sizeof(Instr));
+
+        if(!code){
+            return (size_t)-1;
+        }
+
+        p->code = code;
+        p->cap = cap;
+    }
+
+    p->code[p->len].op = op;
+    p->code[p->len].arg = arg;
+
+    return p->len++;
+}
+
+
+/**
+ * Appends a constant to the pool
+ * @return its index, or (size_t)-1 if memory allocation fails
+ */
+static size_t add_const(Program *p, double value){
+    if(p->nconsts == p->consts_cap){
+        size_t cap = p->consts_cap ? p->consts_cap * 2 : 64;
+        stats_note_alloc(cap * sizeof(double));
+        double *consts = realloc(p->consts, cap * sizeof(double));
+
+        if(!consts){
+            return (size_t)-1;
+        }
+
+        p->consts = consts;
+        p->consts_cap = cap;
+    }
+
+    p->consts[p->nconsts] = value;
+
+    return p->nconsts++;
+}
+
+
+/**
+ * Returns the slot of a variable, adding it the first time its name is seen
+ * @return the slot, or (size_t)-1 if memory allocation fails
+ */
+static size_t add_var(Program *p, const char *name, size_t len){
+    for(size_t i = 0; i < p->nvars; i++){
+        if(p->vars[i].len == len && memcmp(p->vars[i].name, name, len) == 0){
+            return i;
+        }
+    }
+
+    if(p->nvars == p->vars_cap){
+        size_t cap = p->vars_cap ? p->vars_cap * 2 : 8;
+        stats_note_alloc(cap * sizeof(ProgramVar));
+        ProgramVar *vars = realloc(p->vars, cap * sizeof(ProgramVar));
+
+        if(!vars){
+            return (size_t)-1;
+        }
+
+        p->vars = vars;
+        p->vars_cap = cap;
+    }
+
+    p->vars[p->nvars].name = name;
+    p->vars[p->nvars].len = len;
+
+    return p->nvars++;
+}
+
+
+/**
+ * Initializes an empty program
+ */
+void program_init(Program *p){
+    p->code = NULL;
+    p->len = 0;
+    p->cap = 0;
+    p->consts = NULL;
+    p->nconsts = 0;
+    p->consts_cap = 0;
+    p->vars = NULL;
+    p->nvars = 0;
+    p->vars_cap = 0;
+    p->max_stack = 0;
+    p->ntemps = 0;
+}
+
+
+/**
+ * Called when the value of an operation is on the stack: the value of a shared node is
+ * kept in a new temporary, unless the code may not run (`cond` > 0: inside a lazy branch)
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int keep_shared(Program *p, AstMap *temps, const AST *a, size_t cond){
+    if(!a->shared || cond > 0){
+        return 0;
+    }
+
+    size_t t = p->ntemps++;
+
+    if(emit(p, OPC_STORE, (uint32_t)t) == (size_t)-1){
+        return -1;
+    }
+
+    return ast_map_put(temps, a, (void *)(uintptr_t)(t + 1));
+}
+
+
+/**
+ * Compiles a tree into postfix bytecode, replacing the previous contents of `p`
+ *
+ * Operands are emitted before their operator. With `select` unset, `tern(c, a, b)` becomes
+ *     c; JZ else; a; JMP end; else: b; end:
+ * so only one branch runs; with it set, it becomes `c; a; b; SELECT`. The walk is
+ * iterative, like the printer's
+ *
+ * A shared node whose value is in a temporary is replaced by OPC_TEMP and not walked again
+ *
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int compile(Program *p, const AST *ast, int select){
+    static const OpCode binary[] = {
+        [OP_ADD] = OPC_ADD, [OP_SUB] = OPC_SUB, [OP_MUL] = OPC_MUL,
+        [OP_DIV] = OPC_DIV, [OP_MOD] = OPC_MOD, [OP_POW] = OPC_POW
+    };
+    CompileStack st;
+    AstMap temps;   //Shared node -> its temporary + 1
+    size_t depth = 0;
+    size_t cond = 0;    //Lazy branches around the current node
+    int rc = 0;
+
+    p->len = 0;
+    p->nconsts = 0;
+    p->nvars = 0;
+    p->max_stack = 0;
+    p->ntemps = 0;
+    ast_map_init(&temps);
+
+    st.items = st.local;
+    st.len = 0;
+    st.cap = sizeof(st.local) / sizeof(st.local[0]);
+
+    rc = push_frame(&st, ast);
+
+    while(st.len > 0 && rc == 0){
+        CompileFrame *f = &st.items[st.len - 1];
+        const AST *a = f->node;
+
+        if(a->type == NODE_NUMBER || a->type == NODE_VAR){
+            int is_var = a->type == NODE_VAR;
+            size_t k = is_var ? add_var(p, a->num_text, a->num_len) : add_const(p, a->num_value);
+
+            rc = k == (size_t)-1 || emit(p, is_var ? OPC_LOAD : OPC_PUSH, (uint32_t)k) == (size_t)-1 ? -1 : 0;
+            st.len--;
+
+            if(++depth > p->max_stack){
+                p->max_stack = depth;
+            }
+
+            continue;
+        }
+
+        uintptr_t temp = f->stage == 0 && a->shared ? (uintptr_t)ast_map_get(&temps, a) : 0;
+
+        if(temp){
+            rc = emit(p, OPC_TEMP, (uint32_t)(temp - 1)) == (size_t)-1 ? -1 : 0;
+            st.len--;
+
+            if(++depth > p->max_stack){
+                p->max_stack = depth;
+            }
+
+            continue;
+        }
+
+        //Chain: the operator follows every operand but the first of a left-nested chain,
+        //and all the operands of a right-nested one, as with the binary links
+        if(a->type == NODE_CHAIN){
+            size_t i = f->stage++;
+            size_t ops = a->right_nested ? (i == a->count ? a->count - 1 : 0) : i > 1;
+
+            for(size_t k = 0; k < ops && rc == 0; k++){
+                rc = emit(p, binary[a->op], 0) == (size_t)-1 ? -1 : 0;
+            }
+
+            depth -= ops;
+
+            if(rc == 0 && i < a->count){
+                rc = push_frame(&st, a->args[i]);
+            }
+            else if(rc == 0){
+                rc = keep_shared(p, &temps, a, cond);
+                st.len--;
+            }
+
+            continue;
+        }
+
+        if(a->op != OP_TERN){
+            switch (f->stage++){
+                case 0:
+                    rc = push_frame(&st, a->left);
+                    break;
+                case 1:
+                    rc = push_frame(&st, a->right);
+                    break;
+                default:
+                    rc = emit(p, binary[a->op], 0) == (size_t)-1 ? -1 : keep_shared(p, &temps, a, cond);
+                    depth--;
+                    st.len--;
+                    break;
+            }
+
+            continue;
+        }
+
+        //Ternary without jumps: the three operands, then SELECT
+        if(select){
+            switch (f->stage++){
+                case 0:
+                    rc = push_frame(&st, a->left);
+                    break;
+                case 1:
+                    rc = push_frame(&st, a->middle);
+                    break;
+                case 2:
+                    rc = push_frame(&st, a->right);
+                    break;
+                default:
+                    rc = emit(p, OPC_SELECT, 0) == (size_t)-1 ? -1 : keep_shared(p, &temps, a, cond);
+                    depth -= 2;
+                    st.len--;
+                    break;
+            }
+
+            continue;
+        }
+
+        //Ternary: condition, then branch, jump over the other, then the other branch
+        switch (f->stage++){
+            case 0:
+                rc = push_frame(&st, a->left);
+                break;
+            case 1:
+                depth--;    //JZ consumes the condition
+                cond++;
+                f->depth = depth;
+                f->patch = emit(p, OPC_JZ, 0);
+                rc = f->patch == (size_t)-1 ? -1 : push_frame(&st, a->middle);
+                break;
+            case 2:{
+                size_t jz = f->patch;
+
+                f->patch = emit(p, OPC_JMP, 0);
+
+                if(f->patch == (size_t)-1){
+                    rc = -1;
+                    break;
+                }
+
+                p->code[jz].arg = (uint32_t)p->len;
+                depth = f->depth;   //The other branch starts from the same depth
+                rc = push_frame(&st, a->right);
+                break;
+            }
+            default:
+                p->code[f->patch].arg = (uint32_t)p->len;
+                cond--;
+                rc = keep_shared(p, &temps, a, cond);
+                st.len--;
+                break;
+        }
+    }
+
+    if(rc == 0 && emit(p, OPC_RET, 0) == (size_t)-1){
+        rc = -1;
+    }
+
+    if(st.items != st.local){
+        free(st.items);
+    }
+
+    ast_map_free(&temps);
+
+    return rc;
+}
+
+
+/**
+ * Compiles a tree with lazy `tern` (conditional jumps)
+ * @param p: the program to fill
+ * @param ast: the expression
+ * @return 0 on success, -1 if memory allocation fails
+ */
+int program_compile(Program *p, const AST *ast){
+    return compile(p, ast, 0);
+}
+
+
+/**
+ * Compiles a tree into straight-line code: `tern` evaluates both branches and selects one
+ * @param p: the program to fill
+ * @param ast: the expression
+ * @return 0 on success, -1 if memory allocation fails
+ */
+int program_compile_select(Program *p, const AST *ast){
+    return compile(p, ast, 1);
+}
+
+
+/**
+ * Runs a compiled program
+ *
+ * The value stack (and the temporaries) live on the machine stack for the usual small
+ * programs and on the heap for deep ones; `sp` points to the next free slot
+ *
+ * @param p: the compiled program
+ * @param vars: values of the variables, indexed like `p->vars` (null if there are none)
+ * @param result: receives the value of the expression on success
+ * @return EVAL_OK, or the error that stopped the evaluation
+ */
+EvalError program_run(const Program *p, const double *vars, double *result){
+    double local[EVAL_LOCAL_STACK];
+    double *stack = local;
+
+    if(p->nvars > 0 && !vars){
+        return EVAL_UNBOUND;
+    }
+
+    //The temporaries follow the stack
+    if(p->max_stack + p->ntemps > EVAL_LOCAL_STACK){
+        stats_note_alloc((p->max_stack + p->ntemps) * sizeof(double));
+        stack = malloc((p->max_stack + p->ntemps) * sizeof(double));
+
+        if(!stack){
+            return EVAL_NO_MEMORY;
+        }
+    }
+
+    double *temps = stack + p->max_stack;
+
+    const Instr *code = p->code;
+    const double *consts = p->consts;
+    double *sp = stack;
+    EvalError err = EVAL_OK;
+    size_t pc = 0;
+
+    while(1){
+        const Instr in = code[pc++];
+
+        switch ((OpCode)in.op){
+            case OPC_PUSH:
+                *sp++ = consts[in.arg];
+                continue;
+            case OPC_LOAD:
+                *sp++ = vars[in.arg];
+                continue;
+            case OPC_ADD:
+                sp--;
+                sp[-1] += sp[0];
+                continue;
+            case OPC_SUB:
+                sp--;
+                sp[-1] -= sp[0];
+                continue;
+            case OPC_MUL:
+                sp--;
+                sp[-1] *= sp[0];
+                continue;
+            case OPC_DIV:
+                sp--;
+
+                if(sp[0] == 0.0){
+                    err = EVAL_DIV_ZERO;
+                    break;
+                }
+
+                sp[-1] /= sp[0];
+                continue;
+            case OPC_MOD:
+                sp--;
+
+                if(sp[0] == 0.0){
+                    err = EVAL_MOD_ZERO;
+                    break;
+                }
+
+                sp[-1] = fmod(sp[-1], sp[0]);
+                continue;
+            case OPC_POW:
+                sp--;
+                sp[-1] = pow(sp[-1], sp[0]);
+                continue;
+            case OPC_JZ:
+                if(*--sp == 0.0){
+                    pc = in.arg;
+                }
+
+                continue;
+            case OPC_JMP:
+                pc = in.arg;
+                continue;
+            case OPC_SELECT:
+                sp -= 2;
+                sp[-1] = sp[-1] != 0.0 ? sp[0] : sp[1];
+                continue;
+            case OPC_STORE:
+                temps[in.arg] = sp[-1];
+                continue;
+            case OPC_TEMP:
+                *sp++ = temps[in.arg];
+                continue;
+            case OPC_RET:
+                *result = sp[-1];
+                break;
+        }
+
+        break;
+    }
+
+    if(stack != local){
+        free(stack);
+    }
+
+    return err;
+}
+
+
+/**
+ * Returns the message of an evaluation error
+ */
+const char *program_strerror(EvalError err){
+    switch (err){
+        case EVAL_OK:
+            return "No error";
+        case EVAL_DIV_ZERO:
+            return "Division by zero";
+        case EVAL_MOD_ZERO:
+            return "Modulo by zero";
+        case EVAL_UNBOUND:
+            return "Variables cannot be evaluated";
+        case EVAL_NO_MEMORY:
+            return "Out of memory";
+    }
+
+    return "Unknown error";
+}
+
+
+/**
+ * Releases the memory of a program
+ */
+void program_free(Program *p){
+    free(p->code);
+    free(p->consts);
+    free(p->vars);
+    program_init(p);
+}
@@ -0,0 +1,118 @@
+#ifndef EVAL_H
+#define EVAL_H
+
+#include "ast.h"
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * @file eval.h
+ * @brief Numeric evaluation: the AST is compiled once into a flat postfix bytecode that a
+ *        small stack machine runs as many times as needed
+ *
+ * Semantics of the operators on doubles:
+ * - `add`, `sub`, `mul`: IEEE arithmetic
+ * - `div`: IEEE division; a zero divisor is an error
+ * - `mod`: `fmod` (the result has the sign of the dividend); a zero divisor is an error
+ * - `pow`: C `pow`
+ * - `tern(c, a, b)`: `a` if `c` is not zero (NaN counts as not zero), `b` otherwise. Only
+ *   the selected branch is evaluated, so an error in the other one is not reported
+ *
+ * Variables are numbered in order of first appearance (`Program.vars`) and read from an
+ * array of values given to `program_run`
+ *
+ * `program_compile_select` produces straight-line code without jumps, where `tern`
+ * evaluates both branches and picks one with OPC_SELECT; it is the form that column
+ * evaluation (see column.h) runs on many rows at once
+ *
+ * In a DAG (see ast.h) a shared subexpression is computed once: its value is kept in a
+ * temporary (OPC_STORE) and pushed again (OPC_TEMP) where it appears later. With lazy
+ * `tern`, a value computed inside a branch is not kept, since the branch may not run
+ */
+
+
+/**
+ * @enum OpCode
+ * @brief Instructions of the stack machine
+ */
+typedef enum{
+    OPC_PUSH,       //Pushes `consts[arg]`
+    OPC_LOAD,       //Pushes the value of variable `arg`
+    OPC_ADD,        //Binary operations pop two values and push the result
+    OPC_SUB,
+    OPC_MUL,
+    OPC_DIV,
+    OPC_MOD,
+    OPC_POW,
+    OPC_JZ,         //Pops a value and jumps to `arg` if it is zero
+    OPC_JMP,        //Jumps to `arg`
+    OPC_SELECT,     //Pops c, a, b and pushes `c != 0 ? a : b`
+    OPC_STORE,      //Copies the top of the stack to temporary `arg` (it stays on the stack)
+    OPC_TEMP,       //Pushes temporary `arg`
+    OPC_RET         //Returns the top of the stack
+} OpCode;
+
+
+/**
+ * @struct Instr
+ * @brief One instruction: an opcode and its operand (a constant index, a variable slot or a
+ *        jump target)
+ */
+typedef struct{
+    uint32_t op;
+    uint32_t arg;
+} Instr;
+
+
+/**
+ * @enum EvalError
+ * @brief Errors reported by `program_run`
+ */
+typedef enum{
+    EVAL_OK,
+    EVAL_DIV_ZERO,
+    EVAL_MOD_ZERO,
+    EVAL_UNBOUND,
+    EVAL_NO_MEMORY
+} EvalError;
+
+
+/**
+ * @struct ProgramVar
+ * @brief Name of a variable, pointing into the text of the expression
+ */
+typedef struct{
+    const char *name;
+    size_t len;
+} ProgramVar;
+
+
+/**
+ * @struct Program
+ * @brief A compiled expression
+ *
+ * The arrays are reused by successive calls to `program_compile`
+ */
+typedef struct{
+    Instr *code;
+    size_t len, cap;
+
+    double *consts;
+    size_t nconsts, consts_cap;
+
+    ProgramVar *vars;
+    size_t nvars, vars_cap;
+
+    size_t max_stack;   //Deepest the value stack gets while running
+    size_t ntemps;      //Temporaries of the shared subexpressions
+} Program;
+
+void program_init(Program *p);
+int program_compile(Program *p, const AST *ast);   //0 on success, -1 if memory allocation fails
+int program_compile_select(Program *p, const AST *ast);
+EvalError program_run(const Program *p, const double *vars, double *result);   //`vars` may be null without variables
+const char *program_strerror(EvalError err);
+void program_free(Program *p);
+
+#endif
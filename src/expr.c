@@ -0,0 +1,377 @@
+#include "expr.h"
+#include "parser.h"
+#include "printer.h"
+#include "buffer.h"
+#include "eval.h"
+#include "passes.h"
+#include "flat.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * State reused by the transformations of one thread
+ */
+struct ExprContext{
+    Parser *parser;
+    FlatTree flat;      //Used when the expression is not rewritten (see flat.h)
+    Program prog;       //Evaluation of an AST
+    Buffer scratch;     //Measures a result that does not fit in the caller's buffer
+
+    //The analyzed expression, valid until the next call
+    const AST *ast;     //NULL when it is in `flat`
+    double value;       //EXPR_EVAL
+};
+
+
+/**
+ * Creates a context; its memory grows with the largest expression it transforms and is
+ * released by `expr_context_destroy`
+ * @return the context, or null if memory allocation fails
+ */
+ExprContext *expr_context_create(void){
+    ExprContext *ctx = malloc(sizeof(ExprContext));
+
+    if(!ctx){
+        return NULL;
+    }
+
+    if(!(ctx->parser = parser_create("", 0))){
+        free(ctx);
+        return NULL;
+    }
+
+    flat_init(&ctx->flat);
+    program_init(&ctx->prog);
+    buffer_init(&ctx->scratch);
+    ctx->ast = NULL;
+    ctx->value = 0.0;
+
+    return ctx;
+}
+
+
+void expr_context_destroy(ExprContext *ctx){
+    if(!ctx){
+        return;
+    }
+
+    parser_destroy(ctx->parser);
+    flat_free(&ctx->flat);
+    program_free(&ctx->prog);
+    buffer_free(&ctx->scratch);
+    free(ctx);
+}
+
+
+/**
+ * Fills `err` with a status that has no location
+ * @return the status
+ */
+static ExprStatus failure(ExprError *err, ExprStatus status){
+    err->status = status;
+    err->offset = 0;
+    err->line = 0;
+    err->column = 0;
+
+    return status;
+}
+
+
+/**
+ * Fills `err` with the syntax error of the last analysis; the line and column are counted
+ * here rather than with the lexer's line index, which would allocate
+ * @return its status
+ */
+static ExprStatus syntax_error(ExprContext *ctx, const char *input, size_t len, ExprError *err){
+    static const ExprStatus codes[] = {
+        [PARSE_OK] = EXPR_ERR_NO_MEMORY,
+        [PARSE_ERR_INVALID_CHARACTER] = EXPR_ERR_INVALID_CHARACTER,
+        [PARSE_ERR_INVALID_NUMBER] = EXPR_ERR_INVALID_NUMBER,
+        [PARSE_ERR_UNCLOSED_COMMENT] = EXPR_ERR_UNCLOSED_COMMENT,
+        [PARSE_ERR_EXPECTED_OPERAND] = EXPR_ERR_EXPECTED_OPERAND,
+        [PARSE_ERR_EXPECTED_LPAREN] = EXPR_ERR_EXPECTED_LPAREN,
+        [PARSE_ERR_EXPECTED_SEPARATOR] = EXPR_ERR_EXPECTED_SEPARATOR,
+        [PARSE_ERR_EXPECTED_RPAREN] = EXPR_ERR_EXPECTED_RPAREN,
+        [PARSE_ERR_TRAILING_TOKEN] = EXPR_ERR_TRAILING_TOKEN,
+        [PARSE_ERR_ARITY] = EXPR_ERR_ARITY,
+        [PARSE_ERR_UNKNOWN_FUNCTION] = EXPR_ERR_UNKNOWN_FUNCTION,
+        [PARSE_ERR_NO_MEMORY] = EXPR_ERR_NO_MEMORY
+    };
+    size_t offset;
+    ExprStatus status = codes[parser_error_code(ctx->parser, &offset)];
+
+    if(status == EXPR_ERR_NO_MEMORY){
+        return failure(err, status);
+    }
+
+    const char *p = input;
+    const char *end = input + (offset < len ? offset : len);
+    const char *nl;
+
+    err->status = status;
+    err->offset = offset;
+    err->line = 1;
+
+    while((nl = memchr(p, '\n', end - p))){
+        err->line++;
+        p = nl + 1;
+    }
+
+    err->column = (size_t)(end - p) + 1;
+
+    return status;
+}
+
+
+/**
+ * Analyzes (and with EXPR_EVAL evaluates) an expression into the context
+ * @return EXPR_OK, or the status written to `err`
+ */
+static ExprStatus analyze(ExprContext *ctx, const char *input, size_t len, unsigned flags, ExprError *err){
+    static const ExprStatus eval_codes[] = {
+        [EVAL_OK] = EXPR_OK,
+        [EVAL_DIV_ZERO] = EXPR_ERR_DIV_ZERO,
+        [EVAL_MOD_ZERO] = EXPR_ERR_MOD_ZERO,
+        [EVAL_UNBOUND] = EXPR_ERR_UNBOUND,
+        [EVAL_NO_MEMORY] = EXPR_ERR_NO_MEMORY
+    };
+    unsigned passes = (flags & EXPR_FOLD ? PASS_FOLD : 0) | (flags & EXPR_IDENTITY ? PASS_IDENTITY : 0)
+                      | (flags & EXPR_TERN ? PASS_TERN : 0);
+    EvalError e = EVAL_OK;
+
+    parser_reset(ctx->parser, input, len);
+    parser_set_dag(ctx->parser, (flags & EXPR_DAG) != 0);
+    ctx->ast = NULL;
+
+    //Same choice as the command line: the compact tree unless the tree is rewritten or shared
+    if(!passes && !(flags & EXPR_DAG)){
+        if(parser_parse_flat(ctx->parser, &ctx->flat) != 0){
+            return syntax_error(ctx, input, len, err);
+        }
+
+        if(flags & EXPR_EVAL){
+            e = flat_eval(&ctx->flat, &ctx->value);
+        }
+    }
+    else{
+        AST *ast = parser_parse(ctx->parser);
+
+        if(!ast){
+            return syntax_error(ctx, input, len, err);
+        }
+
+        if(!(ctx->ast = passes_run(ast, passes, parser_arena(ctx->parser)))){
+            return failure(err, EXPR_ERR_NO_MEMORY);
+        }
+
+        if(flags & EXPR_EVAL){
+            e = program_compile(&ctx->prog, ctx->ast) == 0 ? program_run(&ctx->prog, NULL, &ctx->value)
+                                                           : EVAL_NO_MEMORY;
+        }
+    }
+
+    if(e != EVAL_OK){
+        return failure(err, eval_codes[e]);
+    }
+
+    failure(err, EXPR_OK);
+
+    return EXPR_OK;
+}
+
+
+/**
+ * Appends the result of the analyzed expression and a NUL (not counted in `out->len`)
+ * @return 0 on success, -1 if it does not fit or memory allocation fails
+ */
+static int emit(ExprContext *ctx, unsigned flags, Buffer *out){
+    int rc;
+
+    if(flags & EXPR_EVAL){
+        rc = buffer_put_double(out, ctx->value);
+    }
+    else{
+        rc = ctx->ast ? ast_print(ctx->ast, out) : flat_print(&ctx->flat, out);
+    }
+
+    return rc == 0 && buffer_cstr(out) ? 0 : -1;
+}
+
+
+/**
+ * Writes the result of the analyzed expression at the end of `out`, or finds how long it
+ * would be when it does not fit
+ *
+ * @param len: receives the length of the result (without the NUL) on success and on
+ *             EXPR_ERR_NO_SPACE
+ * @return EXPR_OK, EXPR_ERR_NO_SPACE (`out` is left as it was) or EXPR_ERR_NO_MEMORY
+ */
+static ExprStatus output(ExprContext *ctx, unsigned flags, Buffer *out, size_t *len){
+    size_t start = out->len;
+
+    if(emit(ctx, flags, out) == 0){
+        *len = out->len - start;
+        return EXPR_OK;
+    }
+
+    out->len = start;
+    buffer_clear(&ctx->scratch);
+
+    if(emit(ctx, flags, &ctx->scratch) != 0){
+        return EXPR_ERR_NO_MEMORY;
+    }
+
+    *len = ctx->scratch.len;
+
+    return EXPR_ERR_NO_SPACE;
+}
+
+
+/**
+ * Transforms one expression into its infix form (or its value, with EXPR_EVAL)
+ *
+ * @param ctx: the context, used by one thread at a time
+ * @param input: the expression; it does not need to be NUL-terminated
+ * @param len: its length in bytes
+ * @param flags: EXPR_* flags
+ * @param out: receives the NUL-terminated result
+ * @param cap: size of `out`, which must leave room for the NUL
+ * @param out_len: receives the length of the result without the NUL, or on
+ *                 EXPR_ERR_NO_SPACE the length it needs (so `cap` must exceed it); may be NULL
+ * @param err: receives the details of an error; may be NULL
+ * @return EXPR_OK or the error
+ */
+ExprStatus expr_transform(ExprContext *ctx, const char *input, size_t len, unsigned flags,
+                          char *out, size_t cap, size_t *out_len, ExprError *err){
+    ExprError local;
+    Buffer b;
+    size_t n = 0;
+
+    err = err ? err : &local;
+
+    ExprStatus status = analyze(ctx, input, len, flags, err);
+
+    if(status == EXPR_OK){
+        buffer_init_fixed(&b, out, cap);
+
+        if((status = output(ctx, flags, &b, &n)) != EXPR_OK){
+            failure(err, status);
+        }
+    }
+
+    if(out_len){
+        *out_len = n;
+    }
+
+    return status;
+}
+
+
+/**
+ * Transforms an array of expressions in order, packing their NUL-terminated results into
+ * `out` one after the other
+ *
+ * An expression that fails gets its error in its `ExprResult` and the batch carries on.
+ * The batch stops at the first result that does not fit in the rest of `out`: that result
+ * gets EXPR_ERR_NO_SPACE with the length it needs, and the caller can resume from it with
+ * a new buffer
+ *
+ * @param ctx: the context, used by one thread at a time
+ * @param inputs: the expressions
+ * @param n: their number
+ * @param flags: EXPR_* flags, for all of them
+ * @param out: receives the results
+ * @param cap: size of `out`
+ * @param results: receives one result per expression that was processed
+ * @return the number of expressions that were processed (their results are final); if it
+ *         is less than `n`, `results` at that index holds EXPR_ERR_NO_SPACE or EXPR_ERR_NO_MEMORY
+ */
+size_t expr_transform_batch(ExprContext *ctx, const ExprInput *inputs, size_t n, unsigned flags,
+                            char *out, size_t cap, ExprResult *results){
+    Buffer b;
+
+    buffer_init_fixed(&b, out, cap);
+
+    for(size_t i = 0; i < n; i++){
+        ExprResult *r = &results[i];
+
+        r->offset = b.len;
+        r->len = 0;
+
+        if(analyze(ctx, inputs[i].text, inputs[i].len, flags, &r->error) != EXPR_OK){
+            continue;
+        }
+
+        ExprStatus status = output(ctx, flags, &b, &r->len);
+
+        if(status != EXPR_OK){
+            failure(&r->error, status);
+            return i;
+        }
+
+        b.len++;    //Keeps the NUL between the results
+    }
+
+    return n;
+}
+
+
+/**
+ * Describes the failure `err` of the last transformation of `ctx` with the text batch mode
+ * writes for it: the parser's message for a syntax error (with the line and column of a
+ * lexical one), else the description of the status
+ * @return the text, valid until the next transformation with `ctx`
+ */
+const char *expr_describe(ExprContext *ctx, const ExprError *err){
+    const char *msg = parser_error(ctx->parser);
+
+    if(err->status >= EXPR_ERR_INVALID_CHARACTER && err->status <= EXPR_ERR_UNKNOWN_FUNCTION && msg){
+        return msg;
+    }
+
+    return expr_strerror(err->status);
+}
+
+
+/**
+ * Returns a description of a status
+ */
+const char *expr_strerror(ExprStatus status){
+    switch (status){
+        case EXPR_OK:
+            return "No error";
+        case EXPR_ERR_INVALID_CHARACTER:
+            return "Invalid character";
+        case EXPR_ERR_INVALID_NUMBER:
+            return "Invalid number";
+        case EXPR_ERR_UNCLOSED_COMMENT:
+            return "Unclosed comment";
+        case EXPR_ERR_EXPECTED_OPERAND:
+            return "Expected number or function call";
+        case EXPR_ERR_EXPECTED_LPAREN:
+            return "Expected '(' after identifier";
+        case EXPR_ERR_EXPECTED_SEPARATOR:
+            return "Expected ',' or ')'";
+        case EXPR_ERR_EXPECTED_RPAREN:
+            return "Expected ')'";
+        case EXPR_ERR_TRAILING_TOKEN:
+            return "Unexpected token after expression";
+        case EXPR_ERR_ARITY:
+            return "Wrong number of arguments";
+        case EXPR_ERR_UNKNOWN_FUNCTION:
+            return "Unknown function";
+        case EXPR_ERR_DIV_ZERO:
+            return "Division by zero";
+        case EXPR_ERR_MOD_ZERO:
+            return "Modulo by zero";
+        case EXPR_ERR_UNBOUND:
+            return program_strerror(EVAL_UNBOUND);  //The same message as batch mode
+        case EXPR_ERR_NO_MEMORY:
+            return "Out of memory";
+        case EXPR_ERR_NO_SPACE:
+            return "Output buffer too small";
+    }
+
+    return "Unknown error";
+}
@@ -0,0 +1,119 @@
+#ifndef EXPR_H
+#define EXPR_H
+
+#include <stddef.h>
+
+
+/**
+ * @file expr.h
+ * @brief Public API of libexpr (libexpr.a, libexpr.so): transforms expressions in-process
+ *
+ * This header is self-contained; it is the only one a program linked with the library
+ * needs.
+ *
+ * - Reentrant: all the state lives in an `ExprContext`. A context is used by one thread at
+ *   a time, and any number of contexts can be used concurrently; the library has no
+ *   mutable global state
+ * - Memory: results are written to a buffer of the caller. The context keeps its memory
+ *   (parser stack, tree, arena) between calls, so once it has transformed an expression
+ *   of a given size and shape, the next ones up to that size allocate nothing
+ * - Errors: a status code, with the byte offset (and line and column) of the token where
+ *   a syntax error was found; `expr_describe` gives the parser's message for it
+ */
+
+
+/**
+ * Functions exported by the shared library (the other objects are built hidden)
+ */
+#define EXPR_API __attribute__((visibility("default")))
+
+
+/**
+ * Flags of a transformation
+ */
+enum{
+    EXPR_EVAL = 1 << 0,     //Writes the value of the expression instead of its infix form
+    EXPR_DAG = 1 << 1,      //Shares the repeated subtrees (same output, less work on redundant input)
+    EXPR_FOLD = 1 << 2,     //Folds constant subtrees
+    EXPR_IDENTITY = 1 << 3, //Removes `x + 0`, `x * 1`, ...
+    EXPR_TERN = 1 << 4,     //Selects the branch of a `tern` with a constant condition
+    EXPR_SIMPLIFY = EXPR_FOLD | EXPR_IDENTITY | EXPR_TERN
+};
+
+
+/**
+ * @enum ExprStatus
+ * @brief Result of a transformation
+ */
+typedef enum{
+    EXPR_OK,
+    EXPR_ERR_INVALID_CHARACTER,
+    EXPR_ERR_INVALID_NUMBER,
+    EXPR_ERR_UNCLOSED_COMMENT,
+    EXPR_ERR_EXPECTED_OPERAND,      //Expected number or function call
+    EXPR_ERR_EXPECTED_LPAREN,       //Expected '(' after identifier
+    EXPR_ERR_EXPECTED_SEPARATOR,    //Expected ',' or ')'
+    EXPR_ERR_EXPECTED_RPAREN,       //Expected ')'
+    EXPR_ERR_TRAILING_TOKEN,        //Unexpected token after expression
+    EXPR_ERR_ARITY,                 //Wrong number of arguments
+    EXPR_ERR_UNKNOWN_FUNCTION,
+    EXPR_ERR_DIV_ZERO,              //EXPR_EVAL only
+    EXPR_ERR_MOD_ZERO,              //EXPR_EVAL only
+    EXPR_ERR_UNBOUND,               //EXPR_EVAL of an expression with variables
+    EXPR_ERR_NO_MEMORY,
+    EXPR_ERR_NO_SPACE               //The output buffer is too small
+} ExprStatus;
+
+
+/**
+ * @struct ExprError
+ * @brief Details of a failed transformation
+ *
+ * For syntax errors, `offset` is the byte offset in the input of the offending token (of
+ * the name of the function for EXPR_ERR_ARITY and EXPR_ERR_UNKNOWN_FUNCTION), and `line`
+ * and `column` are its 1-based location. They are 0 for the other statuses
+ */
+typedef struct{
+    ExprStatus status;
+    size_t offset;
+    size_t line;
+    size_t column;
+} ExprError;
+
+
+/**
+ * @struct ExprInput
+ * @brief One expression of a batch; it does not need to be NUL-terminated
+ */
+typedef struct{
+    const char *text;
+    size_t len;
+} ExprInput;
+
+
+/**
+ * @struct ExprResult
+ * @brief Outcome of one expression of a batch
+ *
+ * On success, the result is the NUL-terminated string of `len` bytes at `out + offset`.
+ * On EXPR_ERR_NO_SPACE, `len` is the length it needs
+ */
+typedef struct{
+    size_t offset;
+    size_t len;
+    ExprError error;
+} ExprResult;
+
+
+typedef struct ExprContext ExprContext;
+
+EXPR_API ExprContext *expr_context_create(void);    //NULL if memory allocation fails
+EXPR_API void expr_context_destroy(ExprContext *ctx);
+EXPR_API ExprStatus expr_transform(ExprContext *ctx, const char *input, size_t len, unsigned flags,
+                                   char *out, size_t cap, size_t *out_len, ExprError *err);
+EXPR_API size_t expr_transform_batch(ExprContext *ctx, const ExprInput *inputs, size_t n, unsigned flags,
+                                     char *out, size_t cap, ExprResult *results);
+EXPR_API const char *expr_strerror(ExprStatus status);
+EXPR_API const char *expr_describe(ExprContext *ctx, const ExprError *err);   //Message of the last failure, as batch mode writes it
+
+#endif
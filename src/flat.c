@@ -0,0 +1,394 @@
+#include "flat.h"
+#include "stats.h"
+#include "printer.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * Values that fit in this many slots are kept on the machine stack by `flat_eval`
+ */
+#define FLAT_LOCAL_STACK 256
+
+
+/**
+ * Initializes an empty tree
+ * No memory is allocated until the first node
+ */
+void flat_init(FlatTree *t){
+    t->nodes = NULL;
+    t->len = 0;
+    t->cap = 0;
+    buffer_init(&t->lits);
+}
+
+
+/**
+ * Appends a node
+ * @return the new node, or null if the tree already has 2^32 - 1 nodes or memory
+ *         allocation fails
+ */
+static FlatNode *add_node(FlatTree *t, uint8_t tag, uint32_t a, uint32_t b){
+    if(t->len == t->cap){
+        size_t cap = t->cap ? t->cap * 2 : 256;
+        FlatNode *nodes;
+
+        if(t->len >= UINT32_MAX){
+            return NULL;
+        }
+
+        stats_note_alloc(cap * sizeof(FlatNode));
+
+        if(!(nodes = realloc(t->nodes, cap * sizeof(FlatNode)))){
+            return NULL;
+        }
+
+        t->nodes = nodes;
+        t->cap = cap;
+    }
+
+    FlatNode *n = &t->nodes[t->len++];
+    n->tag = tag;
+    n->a = a;
+    n->b = b;
+
+    return n;
+}
+
+
+/**
+ * Appends an operation; its operands are the nodes that follow
+ * The indices of its middle and right operands are set by the caller once they are known
+ * @return 0 on success, -1 if the tree is full or memory allocation fails
+ */
+int flat_add_op(FlatTree *t, OpType op){
+    return add_node(t, (uint8_t)op, 0, 0) ? 0 : -1;
+}
+
+
+/**
+ * Appends a leaf whose record in `lits` is `prefix` (`plen` bytes) followed by its text
+ * @return 0 on success, -1 if the tree is full or memory allocation fails
+ */
+static int add_leaf(FlatTree *t, uint8_t tag, const void *prefix, size_t plen, const char *text, size_t len){
+    size_t at = t->lits.len;
+
+    if(at + plen + len > UINT32_MAX){
+        return -1;
+    }
+
+    if((plen > 0 && buffer_append(&t->lits, prefix, plen) != 0) || buffer_append(&t->lits, text, len) != 0){
+        return -1;
+    }
+
+    return add_node(t, tag, (uint32_t)at, (uint32_t)len) ? 0 : -1;
+}
+
+
+/**
+ * Appends a number: its value is converted once and stored before a copy of its text
+ * @return 0 on success, -1 if the tree is full or memory allocation fails
+ */
+int flat_add_number(FlatTree *t, const char *text, size_t len){
+    double value = ast_number_value(text, len);
+
+    return add_leaf(t, FLAT_NUMBER, &value, sizeof(double), text, len);
+}
+
+
+/**
+ * Appends a variable, with a copy of its name
+ * @return 0 on success, -1 if the tree is full or memory allocation fails
+ */
+int flat_add_var(FlatTree *t, const char *name, size_t len){
+    return add_leaf(t, FLAT_VAR, NULL, 0, name, len);
+}
+
+
+/**
+ * Returns the text of leaf `i` (its length is `nodes[i].b`)
+ */
+const char *flat_text(const FlatTree *t, size_t i){
+    const FlatNode *n = &t->nodes[i];
+
+    return t->lits.data + n->a + (n->tag == FLAT_NUMBER ? sizeof(double) : 0);
+}
+
+
+/**
+ * Value of number `n`
+ */
+static double number_value(const FlatTree *t, const FlatNode *n){
+    double v;
+    memcpy(&v, t->lits.data + n->a, sizeof(double));
+
+    return v;
+}
+
+
+/**
+ * One pending piece of output: the subtree rooted at `node`, printed in the context
+ * given by `parent_prec`/`is_right_child`, or a fixed text
+ */
+typedef struct{
+    const char *text;   //NULL for a subtree
+    uint32_t node;
+    int parent_prec;
+    int is_right_child;
+} FlatTask;
+
+typedef struct{
+    FlatTask *items;
+    size_t len;
+    size_t cap;
+    FlatTask local[64];
+} FlatStack;
+
+
+/**
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int push_task(FlatStack *st, const char *text, uint32_t node, int parent_prec, int is_right_child){
+    if(st->len == st->cap){
+        size_t cap = st->cap * 2;
+        stats_note_alloc(cap * sizeof(FlatTask));
+        FlatTask *items = st->items == st->local ? malloc(cap * sizeof(FlatTask))
+                                                 : realloc(st->items, cap * sizeof(FlatTask));
+
+        if(!items){
+            return -1;
+        }
+
+        if(st->items == st->local){
+            memcpy(items, st->local, sizeof(st->local));
+        }
+
+        st->items = items;
+        st->cap = cap;
+    }
+
+    FlatTask *k = &st->items[st->len++];
+    k->text = text;
+    k->node = node;
+    k->parent_prec = parent_prec;
+    k->is_right_child = is_right_child;
+
+    return 0;
+}
+
+
+/**
+ * Appends the infix form of the tree to `out`, exactly like `ast_print`
+ *
+ * The walk is the printer's: the pieces that follow the current one are pushed in reverse
+ * order and the left operands are followed first, which in preorder means moving to the
+ * next node, so most of the tree is read in order
+ *
+ * @return 0 on success, -1 if memory allocation (or the write of a streaming buffer) fails
+ */
+int flat_print(const FlatTree *t, Buffer *out){
+    FlatStack st;
+    int rc = 0;
+
+    if(t->len == 0){
+        return 0;
+    }
+
+    st.items = st.local;
+    st.len = 0;
+    st.cap = sizeof(st.local) / sizeof(st.local[0]);
+
+    rc = push_task(&st, NULL, 0, 0, 0);
+
+    while(st.len > 0 && rc == 0){
+        FlatTask k = st.items[--st.len];
+
+        if(k.text){
+            rc = buffer_puts(out, k.text);
+            continue;
+        }
+
+        size_t i = k.node;
+        int parent_prec = k.parent_prec;
+        int is_right_child = k.is_right_child;
+
+        while(t->nodes[i].tag < FLAT_NUMBER && rc == 0){
+            const FlatNode *n = &t->nodes[i];
+            OpType op = (OpType)n->tag;
+            int my_prec = ast_op_prec(op);
+            int parens = ast_op_needs_parens(op, parent_prec, is_right_child);
+
+            if(parens){
+                rc |= push_task(&st, ")", 0, 0, 0);
+            }
+
+            if(op == OP_TERN){
+                rc |= push_task(&st, NULL, n->b, my_prec, 1);
+                rc |= push_task(&st, ":", 0, 0, 0);
+                rc |= push_task(&st, NULL, n->a, my_prec, 0);
+                rc |= push_task(&st, "?", 0, 0, 0);
+            }
+            else{
+                rc |= push_task(&st, NULL, n->b, my_prec, 1);
+                rc |= push_task(&st, ast_op_symbol(op), 0, 0, 0);
+            }
+
+            if(parens){
+                rc |= buffer_putc(out, '(');
+            }
+
+            i++;
+            parent_prec = my_prec;
+            is_right_child = 0;
+        }
+
+        if(rc == 0){
+            rc = buffer_append(out, flat_text(t, i), t->nodes[i].b);
+        }
+    }
+
+    if(st.items != st.local){
+        free(st.items);
+    }
+
+    return rc == 0 ? 0 : -1;
+}
+
+
+/**
+ * A value of `flat_eval` and the error that produced it, if any
+ */
+typedef struct{
+    double v;
+    EvalError err;
+} FlatValue;
+
+
+/**
+ * Evaluates the tree with the semantics of `program_run`
+ *
+ * The array is scanned once backwards: the operands of a node come after it in preorder,
+ * so they are already on the stack when it is reached, the left one on top. Both branches
+ * of a `tern` are computed, but an error is carried with its value instead of stopping
+ * the scan, and an operation takes the error of its first failing operand, so the error
+ * reported is the one a left-to-right evaluation that skips the other branch would meet
+ *
+ * @param t: the tree
+ * @param result: receives the value of the expression on success
+ * @return EVAL_OK, the error of the evaluation, or EVAL_UNBOUND if there are variables
+ */
+EvalError flat_eval(const FlatTree *t, double *result){
+    FlatValue local[FLAT_LOCAL_STACK];
+    FlatValue *stack = local;
+    size_t cap = FLAT_LOCAL_STACK;
+    size_t sp = 0;
+    int has_var = 0;
+
+    for(size_t i = t->len; i-- > 0;){
+        const FlatNode *n = &t->nodes[i];
+
+        if(n->tag >= FLAT_NUMBER){
+            if(sp == cap){
+                stats_note_alloc(2 * cap * sizeof(FlatValue));
+                FlatValue *grown = stack == local ? malloc(2 * cap * sizeof(FlatValue))
+                                                  : realloc(stack, 2 * cap * sizeof(FlatValue));
+
+                if(!grown){
+                    if(stack != local){
+                        free(stack);
+                    }
+
+                    return EVAL_NO_MEMORY;
+                }
+
+                if(stack == local){
+                    memcpy(grown, local, sizeof(local));
+                }
+
+                stack = grown;
+                cap *= 2;
+            }
+
+            has_var |= n->tag == FLAT_VAR;
+            stack[sp].v = n->tag == FLAT_NUMBER ? number_value(t, n) : 0.0;
+            stack[sp++].err = EVAL_OK;
+            continue;
+        }
+
+        //Left operand on top, then the middle one (tern), then the right one
+        FlatValue l = stack[--sp];
+
+        if(n->tag == OP_TERN){
+            FlatValue m = stack[--sp];
+            FlatValue r = stack[sp - 1];
+
+            stack[sp - 1] = l.err ? l : l.v != 0.0 ? m : r;
+            continue;
+        }
+
+        FlatValue r = stack[sp - 1];
+        FlatValue *res = &stack[sp - 1];
+
+        if(l.err || r.err){
+            *res = l.err ? l : r;
+            continue;
+        }
+
+        switch ((OpType)n->tag){
+            case OP_ADD:
+                res->v = l.v + r.v;
+                break;
+            case OP_SUB:
+                res->v = l.v - r.v;
+                break;
+            case OP_MUL:
+                res->v = l.v * r.v;
+                break;
+            case OP_DIV:
+                res->err = r.v == 0.0 ? EVAL_DIV_ZERO : EVAL_OK;
+                res->v = l.v / r.v;
+                break;
+            case OP_MOD:
+                res->err = r.v == 0.0 ? EVAL_MOD_ZERO : EVAL_OK;
+                res->v = fmod(l.v, r.v);
+                break;
+            case OP_POW:
+                res->v = pow(l.v, r.v);
+                break;
+            case OP_TERN:
+                break;
+        }
+    }
+
+    EvalError err = has_var ? EVAL_UNBOUND : sp == 1 ? stack[0].err : EVAL_NO_MEMORY;
+
+    if(err == EVAL_OK){
+        *result = stack[0].v;
+    }
+
+    if(stack != local){
+        free(stack);
+    }
+
+    return err;
+}
+
+
+/**
+ * Empties the tree, keeping its memory for the next one
+ */
+void flat_clear(FlatTree *t){
+    t->len = 0;
+    buffer_clear(&t->lits);
+}
+
+
+/**
+ * Releases the memory of the tree: two arrays, whatever its size
+ */
+void flat_free(FlatTree *t){
+    free(t->nodes);
+    buffer_free(&t->lits);
+    flat_init(t);
+}
@@ -0,0 +1,65 @@
+#ifndef FLAT_H
+#define FLAT_H
+
+#include "ast.h"
+#include "buffer.h"
+#include "eval.h"
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * @file flat.h
+ * @brief Compact layout of a tree: one array of 12-byte nodes in preorder
+ *
+ * The left operand of an operation is always the next node, so a node only stores the
+ * 32-bit indices of its other operands. Literal texts are copied into a side buffer (a
+ * number is stored as its double followed by its text), so the tree does not reference
+ * the input. A node takes 12 bytes plus its literal instead of the 72 bytes of an `AST`
+ * node, and printing and evaluating are scans of the array rather than pointer walks
+ */
+
+
+/**
+ * Tags of the leaves; an operation is tagged with its `OpType`
+ */
+enum{
+    FLAT_NUMBER = OP_TERN + 1,
+    FLAT_VAR
+};
+
+
+/**
+ * @struct FlatNode
+ * @brief One node: the left operand of an operation at index i is at i + 1
+ */
+typedef struct{
+    uint8_t tag;    //OpType, FLAT_NUMBER or FLAT_VAR
+    uint32_t a;     //Operation: index of the middle operand of `tern`; leaf: offset in `lits`
+    uint32_t b;     //Operation: index of the right operand; leaf: length of its text
+} FlatNode;
+
+
+/**
+ * @struct FlatTree
+ * @brief The nodes of one expression and the texts of its literals
+ *
+ * The arrays are reused by successive trees (see `flat_clear`)
+ */
+typedef struct{
+    FlatNode *nodes;
+    size_t len, cap;
+    Buffer lits;
+} FlatTree;
+
+void flat_init(FlatTree *t);
+int flat_add_op(FlatTree *t, OpType op);    //0 on success, -1 if the tree is full or memory allocation fails
+int flat_add_number(FlatTree *t, const char *text, size_t len);
+int flat_add_var(FlatTree *t, const char *name, size_t len);
+const char *flat_text(const FlatTree *t, size_t i);     //Text of a leaf (not NUL-terminated)
+int flat_print(const FlatTree *t, Buffer *out);         //Same text as `ast_print`
+EvalError flat_eval(const FlatTree *t, double *result); //Same semantics as `program_run`, without variables
+void flat_clear(FlatTree *t);
+void flat_free(FlatTree *t);
+
+#endif
@@ -0,0 +1,185 @@
+#include "input.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/**
+ * Size of the first read from a pipe; the buffer doubles every time it fills up
+ */
+#define INPUT_CHUNK (1024 * 1024)
+
+static int load(Input *in, const char *path, int stream);
+
+
+/**
+ * Maps a regular file of `size` bytes, read-only and without copying it
+ * @return 0 on success, -1 on error
+ */
+static int map_file(Input *in, int fd, size_t size){
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if(map == MAP_FAILED){
+        return -1;
+    }
+
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);  //Only a hint, the result does not matter
+
+    in->map = map;
+    in->map_len = size;
+    in->data = map;
+    in->len = size;
+
+    return 0;
+}
+
+
+/**
+ * Reads everything from `fd` into a heap buffer, in chunks that grow geometrically
+ * @return 0 on success, -1 on error
+ */
+static int read_all(Input *in, int fd){
+    size_t cap = INPUT_CHUNK;
+    size_t len = 0;
+    char *buf = malloc(cap);
+
+    if(!buf){
+        return -1;
+    }
+
+    while(1){
+        if(len == cap){
+            char *grown = realloc(buf, cap * 2);
+
+            if(!grown){
+                free(buf);
+                return -1;
+            }
+
+            buf = grown;
+            cap *= 2;
+        }
+
+        ssize_t n = read(fd, buf + len, cap - len);
+
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+
+            free(buf);
+            return -1;
+        }
+
+        if(n == 0){
+            break;
+        }
+
+        len += (size_t)n;
+    }
+
+    in->heap = buf;
+    in->data = buf;
+    in->len = len;
+
+    return 0;
+}
+
+
+/**
+ * Loads the input of the program
+ *
+ * A regular file is memory-mapped (when stdin is a regular file positioned at its start
+ * it is mapped as well); anything else, such as a pipe, is read until EOF
+ *
+ * @param in: receives the input
+ * @param path: file to read, NULL or "-" for stdin
+ * @return 0 on success, -1 on error (errno describes it)
+ */
+int input_open(Input *in, const char *path){
+    return load(in, path, 0);
+}
+
+
+/**
+ * Like `input_open`, except that an input that cannot be mapped (a pipe, a terminal) is
+ * not read: it is left open in `in->fd`, with `len` 0, for a consumer that reads it as it
+ * goes and so never needs it whole in memory
+ */
+int input_open_fd(Input *in, const char *path){
+    return load(in, path, 1);
+}
+
+
+/**
+ * Opens the input for `input_open` (`stream` 0) or `input_open_fd`
+ * @return 0 on success, -1 on error
+ */
+static int load(Input *in, const char *path, int stream){
+    in->data = "";
+    in->len = 0;
+    in->map = NULL;
+    in->map_len = 0;
+    in->heap = NULL;
+    in->fd = -1;
+
+    int use_stdin = !path || strcmp(path, "-") == 0;
+    int fd = use_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+
+    if(fd < 0){
+        return -1;
+    }
+
+    struct stat st;
+    int rc;
+
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (!use_stdin || lseek(fd, 0, SEEK_CUR) == 0)){
+        //An empty file cannot be mapped, and there is nothing to read either
+        rc = st.st_size > 0 ? map_file(in, fd, (size_t)st.st_size) : 0;
+
+        if(rc != 0){
+            rc = read_all(in, fd);
+        }
+    }
+    else if(stream){
+        in->fd = fd;    //Closed by `input_close`
+        return 0;
+    }
+    else{
+        rc = read_all(in, fd);
+    }
+
+    if(!use_stdin){
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+
+    return rc;
+}
+
+
+/**
+ * Releases the mapping, the buffer or the descriptor of the input
+ */
+void input_close(Input *in){
+    if(in->map){
+        munmap(in->map, in->map_len);
+    }
+
+    free(in->heap);
+
+    if(in->fd >= 0 && in->fd != STDIN_FILENO){
+        close(in->fd);
+    }
+
+    in->data = "";
+    in->len = 0;
+    in->map = NULL;
+    in->heap = NULL;
+    in->fd = -1;
+}
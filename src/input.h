@@ -0,0 +1,36 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+
+
+/**
+ * @file input.h
+ * @brief Loads the whole input of the program into memory with as few copies as possible
+ *
+ * Regular files (given by path or redirected to stdin) are memory-mapped, so the parser
+ * reads the page cache directly. Pipes and terminals are read in large chunks, or left
+ * unread for a consumer that streams them (see `input_open_fd`)
+ * The data is not NUL-terminated: always use `len`
+ */
+
+
+/**
+ * @struct Input
+ * @brief The loaded input and what has to be released afterwards
+ */
+typedef struct{
+    const char *data;
+    size_t len;
+
+    void *map;      //Mapped region, NULL if the input was read into `heap`
+    size_t map_len;
+    char *heap;
+    int fd;         //Descriptor left to read by `input_open_fd`, -1 if the data is loaded
+} Input;
+
+int input_open(Input *in, const char *path);   //NULL or "-" reads stdin. 0 on success, -1 on error (errno is set)
+int input_open_fd(Input *in, const char *path); //The same, but a pipe or terminal is left unread in `fd`
+void input_close(Input *in);
+
+#endif
@@ -0,0 +1,521 @@
+/**
+ * MAP_ANONYMOUS is not part of POSIX 2008; glibc exposes it with this macro
+ */
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+#include "buffer.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#define JIT_X86 1
+#endif
+
+
+/**
+ * Generated entry point: evaluates rows [0, nrows) of the columns into `out`
+ */
+typedef void (*JitEntry)(const double *const *vars, double *out, size_t nrows);
+
+struct JitFunction{
+    JitEntry entry;
+    void *map;
+    size_t map_len;
+};
+
+
+#ifdef JIT_X86
+
+/**
+ * Stack positions 0..JIT_REGS-1 live in xmm0..xmm12; deeper ones only in their home slot
+ * xmm13..xmm15 are scratch registers
+ */
+#define JIT_REGS 13
+#define X13 13
+#define X14 14
+#define X15 15
+
+
+/**
+ * Second operand of an SSE instruction
+ */
+typedef enum{
+    OPR_REG,    //xmm register `n`
+    OPR_HOME,   //[rsp + n]: the home slots of the stack positions, one double per lane
+    OPR_CONST,  //[rip + ...]: constant `n` of the pool placed after the code
+    OPR_COL,    //[rax + r14*8]: the current row of the column loaded in rax
+    OPR_OUT     //[r12 + r14*8]: the current row of the output
+} OperandKind;
+
+typedef struct{
+    OperandKind kind;
+    int32_t n;
+} Operand;
+
+
+/**
+ * State of the code generator
+ */
+typedef struct{
+    Buffer code;
+    int rc;             //Becomes -1 when an append fails
+    int vex;            //AVX encoding: 4 rows per packed instruction instead of 2
+    int lanes;          //Rows per packed instruction
+    int packed;         //All the lanes (the "pd" forms) or one row (the "sd" forms)
+
+    size_t *fixups;     //Offsets of the rip-relative displacements to patch...
+    uint32_t *fixup_const;  //...with the address of these constants
+    size_t nfixups;
+} JitGen;
+
+
+static void put(JitGen *g, const char *bytes, size_t n){
+    g->rc |= buffer_append(&g->code, bytes, n);
+}
+
+static void put8(JitGen *g, unsigned v){
+    char b = (char)v;
+    put(g, &b, 1);
+}
+
+static void put32(JitGen *g, uint32_t v){
+    char b[4] = {(char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24)};
+    put(g, b, 4);
+}
+
+static void put64(JitGen *g, uint64_t v){
+    put32(g, (uint32_t)v);
+    put32(g, (uint32_t)(v >> 32));
+}
+
+
+static Operand reg(int n){
+    Operand o = {OPR_REG, n};
+    return o;
+}
+
+/**
+ * Home slot of a stack position: one value per lane
+ */
+static Operand home(const JitGen *g, size_t pos, int lane){
+    Operand o = {OPR_HOME, (int32_t)((pos * g->lanes + lane) * 8)};
+    return o;
+}
+
+/**
+ * Where a stack position lives while no call is in progress
+ */
+static Operand position(const JitGen *g, size_t pos){
+    return pos < JIT_REGS ? reg((int)pos) : home(g, pos, 0);
+}
+
+
+/**
+ * Emits `prefix 0F opcode` with xmm `r` in the reg field and `rm` as the other operand
+ * A prefix of 0 is omitted
+ *
+ * With AVX the same instruction is VEX-encoded: 256 bits wide when packed, and with `r`
+ * also as the first source, so `op r, rm` keeps its two-operand meaning `r = r op rm`
+ */
+static void sse(JitGen *g, unsigned prefix, unsigned opcode, int r, Operand rm){
+    unsigned rex = (r >> 3) << 2;
+
+    if(rm.kind == OPR_REG){
+        rex |= rm.n >> 3;
+    }
+    else if(rm.kind == OPR_COL){
+        rex |= 2;       //REX.X: r14 as index
+    }
+    else if(rm.kind == OPR_OUT){
+        rex |= 2 | 1;   //REX.X and REX.B: r14 as index, r12 as base
+    }
+
+    if(g->vex){
+        unsigned pp = prefix == 0x66 ? 1 : prefix == 0xF3 ? 2 : prefix == 0xF2 ? 3 : 0;
+        int moves = opcode == 0x10 || opcode == 0x11 || opcode == 0x28;
+        unsigned vvvv = moves ? 0 : (unsigned)r;   //Moves have no first source
+
+        put8(g, 0xC4);
+        put8(g, (~rex & 7) << 5 | 0x01);           //Inverted R, X, B; map 0F
+        put8(g, (~vvvv & 15) << 3 | g->packed << 2 | pp);
+        put8(g, opcode);
+    }
+    else{
+        if(prefix){
+            put8(g, prefix);
+        }
+
+        if(rex){
+            put8(g, 0x40 | rex);
+        }
+
+        put8(g, 0x0F);
+        put8(g, opcode);
+    }
+
+    switch (rm.kind){
+        case OPR_REG:
+            put8(g, 0xC0 | (r & 7) << 3 | (rm.n & 7));
+            break;
+        case OPR_HOME:
+            put8(g, 0x84 | (r & 7) << 3);
+            put8(g, 0x24);
+            put32(g, (uint32_t)rm.n);
+            break;
+        case OPR_CONST:
+            put8(g, 0x05 | (r & 7) << 3);
+            g->fixups[g->nfixups] = g->code.len;
+            g->fixup_const[g->nfixups++] = (uint32_t)rm.n;
+            put32(g, 0);
+            break;
+        case OPR_COL:
+            put8(g, 0x04 | (r & 7) << 3);
+            put8(g, 0xF0);
+            break;
+        case OPR_OUT:
+            put8(g, 0x04 | (r & 7) << 3);
+            put8(g, 0xF4);
+            break;
+    }
+}
+
+
+/**
+ * Prefix of the arithmetic forms: 66 for packed doubles, F2 for a scalar double
+ */
+static unsigned arith(const JitGen *g){
+    return g->packed ? 0x66 : 0xF2;
+}
+
+/**
+ * Copies an operand into xmm `r`: movapd between registers, movupd/movsd from memory
+ */
+static void load(JitGen *g, int r, Operand src){
+    if(src.kind == OPR_REG){
+        if(src.n != r){
+            sse(g, 0x66, 0x28, r, src);
+        }
+    }
+    else{
+        sse(g, arith(g), 0x10, r, src);
+    }
+}
+
+/**
+ * Moves xmm `r` to a stack position
+ */
+static void store(JitGen *g, size_t pos, int r){
+    Operand dst = position(g, pos);
+
+    if(dst.kind == OPR_REG){
+        load(g, dst.n, reg(r));
+    }
+    else{
+        sse(g, arith(g), 0x11, r, dst);
+    }
+}
+
+
+/**
+ * Calls `fn(a, b)` from libm for the positions `a` and `b`, once per row of the
+ * iteration, and leaves the result in position `a`
+ * Every call clobbers the xmm registers, so the live positions go to their home slots
+ * first and come back afterwards
+ */
+static void call_libm(JitGen *g, double (*fn)(double, double), size_t a, size_t b){
+    for(size_t pos = 0; pos <= b && pos < JIT_REGS; pos++){
+        sse(g, arith(g), 0x11, (int)pos, home(g, pos, 0));
+    }
+
+    for(int lane = 0; lane < (g->packed ? g->lanes : 1); lane++){
+        if(g->vex){
+            put(g, "\xC5\xF8\x77", 3);         //vzeroupper: no AVX-SSE transition in libm
+        }
+
+        sse(g, 0xF2, 0x10, 0, home(g, a, lane));    //movsd xmm0, a
+        sse(g, 0xF2, 0x10, 1, home(g, b, lane));    //movsd xmm1, b
+        put(g, "\x48\xB8", 2);                      //mov rax, fn
+        put64(g, (uint64_t)(uintptr_t)fn);
+        put(g, "\xFF\xD0", 2);                      //call rax
+        sse(g, 0xF2, 0x11, 0, home(g, a, lane));    //movsd a, xmm0
+    }
+
+    for(size_t pos = 0; pos <= a && pos < JIT_REGS; pos++){
+        sse(g, arith(g), 0x10, (int)pos, home(g, pos, 0));
+    }
+}
+
+
+/**
+ * Emits the code of one row (or of all the lanes, when packed) of the program
+ */
+static void gen_body(JitGen *g, const Program *p){
+    static const unsigned char binary[] = {
+        [OPC_ADD] = 0x58, [OPC_SUB] = 0x5C, [OPC_MUL] = 0x59, [OPC_DIV] = 0x5E
+    };
+    size_t sp = 0;
+
+    for(size_t pc = 0; pc < p->len; pc++){
+        const Instr in = p->code[pc];
+        int dst = sp < JIT_REGS ? (int)sp : X13;
+
+        switch ((OpCode)in.op){
+            case OPC_PUSH:
+                sse(g, arith(g), 0x10, dst, (Operand){OPR_CONST, (int32_t)in.arg});
+                store(g, sp++, dst);
+                break;
+            case OPC_LOAD:
+                put(g, "\x48\x8B\x83", 3);      //mov rax, [rbx + 8 * arg]
+                put32(g, in.arg * 8);
+                sse(g, arith(g), 0x10, dst, (Operand){OPR_COL, 0});
+                store(g, sp++, dst);
+                break;
+            case OPC_ADD:
+            case OPC_SUB:
+            case OPC_MUL:
+            case OPC_DIV:{
+                size_t a = sp - 2;
+                int r = a < JIT_REGS ? (int)a : X14;
+
+                load(g, r, position(g, a));
+                sse(g, arith(g), binary[in.op], r, position(g, sp - 1));
+                store(g, a, r);
+                sp--;
+                break;
+            }
+            case OPC_MOD:
+                call_libm(g, fmod, sp - 2, sp - 1);
+                sp--;
+                break;
+            case OPC_POW:
+                call_libm(g, pow, sp - 2, sp - 1);
+                sp--;
+                break;
+            case OPC_SELECT:
+                //mask = c != 0 (unordered: NaN selects a); result = (a & mask) | (b & ~mask)
+                load(g, X13, position(g, sp - 3));
+                sse(g, 0x66, 0x57, X14, reg(X14));          //xorpd
+                sse(g, arith(g), 0xC2, X13, reg(X14));      //cmpneq
+                put8(g, 4);
+                load(g, X14, position(g, sp - 2));
+                sse(g, 0x66, 0x54, X14, reg(X13));          //andpd
+                load(g, X15, position(g, sp - 1));
+                sse(g, 0x66, 0x55, X13, reg(X15));          //andnpd
+                sse(g, 0x66, 0x56, X13, reg(X14));          //orpd
+                store(g, sp - 3, X13);
+                sp -= 2;
+                break;
+            case OPC_STORE:{    //The temporaries have home slots after those of the stack
+                Operand top = position(g, sp - 1);
+                int r = top.kind == OPR_REG ? top.n : X13;
+
+                load(g, r, top);
+                sse(g, arith(g), 0x11, r, home(g, p->max_stack + in.arg, 0));
+                break;
+            }
+            case OPC_TEMP:
+                sse(g, arith(g), 0x10, dst, home(g, p->max_stack + in.arg, 0));
+                store(g, sp++, dst);
+                break;
+            case OPC_RET:
+                sse(g, arith(g), 0x11, 0, (Operand){OPR_OUT, 0});
+                break;
+            case OPC_JZ:
+            case OPC_JMP:
+                g->rc = -1;
+                break;
+        }
+    }
+}
+
+
+/**
+ * Emits a 32-bit relative jump (`opcode` is E9, or 0F 8x for the conditional forms)
+ * @return the offset of its displacement, to be patched with `patch_jump`
+ */
+static size_t jump(JitGen *g, const char *opcode, size_t n){
+    put(g, opcode, n);
+    put32(g, 0);
+
+    return g->code.len - 4;
+}
+
+static void patch_jump(JitGen *g, size_t at, size_t target){
+    int32_t rel = (int32_t)(target - (at + 4));
+
+    if(g->rc == 0){
+        memcpy(g->code.data + at, &rel, 4);
+    }
+}
+
+
+/**
+ * Generates the whole function (L is the number of lanes):
+ *
+ *     push rbx, r12, r13, r14; sub rsp, frame
+ *     rbx = vars, r12 = out, r13 = nrows, r14 = row = 0
+ *   packed:
+ *     if row + L > nrows goto rest
+ *     <packed body>; row += L; goto packed
+ *   rest:
+ *     if row >= nrows goto done
+ *     <scalar body>; row++; goto rest
+ *   done:
+ *     add rsp, frame; [vzeroupper]; pop r14, r13, r12, rbx; ret
+ *     <constant pool: every constant repeated L times, aligned>
+ */
+static void gen_function(JitGen *g, const Program *p){
+    //After the return address and 4 pushes, an odd multiple of 8 realigns rsp to 16
+    uint32_t frame = (uint32_t)((p->max_stack + p->ntemps) * g->lanes * 8 + 8);
+
+    put(g, "\x53\x41\x54\x41\x55\x41\x56", 7);         //push rbx, r12, r13, r14
+    put(g, "\x48\x81\xEC", 3);                          //sub rsp, frame
+    put32(g, frame);
+    put(g, "\x48\x89\xFB\x49\x89\xF4\x49\x89\xD5", 9);  //mov rbx, rdi; mov r12, rsi; mov r13, rdx
+    put(g, "\x45\x31\xF6", 3);                          //xor r14d, r14d
+
+    size_t packed = g->code.len;
+    put(g, "\x49\x8D\x46", 3);                          //lea rax, [r14 + L]
+    put8(g, g->lanes);
+    put(g, "\x4C\x39\xE8", 3);                          //cmp rax, r13
+    size_t to_rest = jump(g, "\x0F\x87", 2);            //ja rest
+
+    g->packed = 1;
+    gen_body(g, p);
+    put(g, "\x49\x83\xC6", 3);                          //add r14, L
+    put8(g, g->lanes);
+    patch_jump(g, jump(g, "\xE9", 1), packed);          //jmp packed
+
+    size_t rest = g->code.len;
+    patch_jump(g, to_rest, rest);
+    put(g, "\x4D\x39\xEE", 3);                          //cmp r14, r13
+    size_t to_done = jump(g, "\x0F\x83", 2);            //jae done
+
+    g->packed = 0;
+    gen_body(g, p);
+    put(g, "\x49\xFF\xC6", 3);                          //inc r14
+    patch_jump(g, jump(g, "\xE9", 1), rest);            //jmp rest
+
+    patch_jump(g, to_done, g->code.len);
+    put(g, "\x48\x81\xC4", 3);                          //add rsp, frame
+    put32(g, frame);
+
+    if(g->vex){
+        put(g, "\xC5\xF8\x77", 3);                     //vzeroupper
+    }
+
+    put(g, "\x41\x5E\x41\x5D\x41\x5C\x5B\xC3", 8);     //pop r14, r13, r12, rbx; ret
+
+    while(g->code.len % 32 != 0){
+        put8(g, 0xCC);
+    }
+
+    size_t pool = g->code.len;
+    size_t width = g->lanes * 8;
+
+    for(size_t k = 0; k < p->nconsts; k++){
+        for(int lane = 0; lane < g->lanes; lane++){
+            put(g, (const char *)&p->consts[k], 8);
+        }
+    }
+
+    for(size_t i = 0; i < g->nfixups && g->rc == 0; i++){
+        int32_t rel = (int32_t)(pool + width * g->fixup_const[i] - (g->fixups[i] + 4));
+        memcpy(g->code.data + g->fixups[i], &rel, 4);
+    }
+}
+
+#endif
+
+
+/**
+ * Translates a straight-line program into native code
+ * @param p: a program from `program_compile_select`
+ * @return the function, or null if the JIT is not available here, the program contains
+ *         jumps or memory allocation fails
+ */
+JitFunction *jit_compile(const Program *p){
+#ifdef JIT_X86
+    JitGen g;
+    JitFunction *f = NULL;
+
+    buffer_init(&g.code);
+    g.rc = 0;
+    __builtin_cpu_init();
+    g.vex = getenv("EXPR_JIT_SSE2") == NULL && __builtin_cpu_supports("avx");
+    g.lanes = g.vex ? 4 : 2;
+    g.packed = 0;
+    g.nfixups = 0;
+    g.fixups = malloc(2 * p->len * sizeof(size_t) + 1);    //At most one per PUSH in each body
+    g.fixup_const = malloc(2 * p->len * sizeof(uint32_t) + 1);
+
+    if(g.fixups && g.fixup_const){
+        gen_function(&g, p);
+    }
+    else{
+        g.rc = -1;
+    }
+
+    if(g.rc == 0 && (f = malloc(sizeof(JitFunction)))){
+        f->map_len = g.code.len;
+        f->map = mmap(NULL, f->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if(f->map == MAP_FAILED){
+            free(f);
+            f = NULL;
+        }
+        else{
+            memcpy(f->map, g.code.data, g.code.len);
+
+            if(mprotect(f->map, f->map_len, PROT_READ | PROT_EXEC) != 0){
+                munmap(f->map, f->map_len);
+                free(f);
+                f = NULL;
+            }
+            else{
+                f->entry = (JitEntry)f->map;
+            }
+        }
+    }
+
+    free(g.fixups);
+    free(g.fixup_const);
+    buffer_free(&g.code);
+
+    return f;
+#else
+    (void)p;
+    return NULL;
+#endif
+}
+
+
+/**
+ * Evaluates the compiled expression for every row
+ * @param f: the generated function
+ * @param vars: one column per variable of the program, indexed like `Program.vars`
+ * @param nrows: number of values in each column
+ * @param out: receives one result per row
+ */
+void jit_run(const JitFunction *f, const double *const *vars, size_t nrows, double *out){
+    f->entry(vars, out, nrows);
+}
+
+
+/**
+ * Releases the generated code
+ */
+void jit_free(JitFunction *f){
+#ifdef JIT_X86
+    if(f){
+        munmap(f->map, f->map_len);
+        free(f);
+    }
+#else
+    (void)f;
+#endif
+}
@@ -0,0 +1,35 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "eval.h"
+#include <stddef.h>
+
+
+/**
+ * @file jit.h
+ * @brief Native x86-64 code for column evaluation
+ *
+ * A straight-line program (see `program_compile_select`) is translated into a loop over
+ * the rows that evaluates four rows per iteration with packed AVX instructions, or two
+ * with SSE2 on CPUs without AVX (or when EXPR_JIT_SSE2 is set in the environment); the
+ * last rows are done one at a time with scalar instructions. The operand stack lives in
+ * the xmm/ymm registers and spills to the machine stack when it is deeper than the
+ * register file, like the temporaries of shared subexpressions; `add`, `sub`, `mul`, `div`
+ * and `tern` are inlined and `pow`/`mod` call libm
+ *
+ * The results are the same as `column_eval`, with the same IEEE semantics. On other
+ * machines, or if the code cannot be mapped executable, `jit_compile` returns null and
+ * the caller keeps using the interpreter
+ */
+
+
+/**
+ * Opaque structure that holds the generated code
+ */
+typedef struct JitFunction JitFunction;
+
+JitFunction *jit_compile(const Program *p);    //Null if the JIT is not available or the program has jumps
+void jit_run(const JitFunction *f, const double *const *vars, size_t nrows, double *out);
+void jit_free(JitFunction *f);
+
+#endif
@@ -1,31 +1,78 @@
 #include "lexer.h"
+#include "stats.h"
+#include "scan.h"
 #include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <unistd.h>
 
 /**
  * Internal structure of the lexer
  */
 struct Lexer{
     const char *input;
+    size_t len;
     size_t pos;
+    const char *error;  //Description of the last TOK_ERROR
+    LexError code;
+
+    //Offsets of the newlines of the input, built the first time a location is requested
+    size_t *lines;
+    size_t line_count;
+    int lines_ready;
+
+    //Streamed input (see `lexer_create_reader`): `input` is then `window`, which holds the
+    //`len` bytes from offset `base` of the whole input; positions in `input` are relative
+    //to it, the positions of tokens are not. `base` is 0 for an input in memory
+    LexerRead read;     //NULL for an input in memory
+    void *ctx;
+    int fd;             //Source of `lexer_create_fd`
+    char *window;
+    size_t cap;
+    size_t base;
+    int at_end;         //The source has nothing more to give
+    const char *failure;    //Why it ended early: NULL, or the message of the error
+
+    //Lexeme of the last token returned, when it had to be dropped from the window
+    size_t last_pos;
+    size_t last_len;
+    char *held;
+    size_t held_cap;
+
+    //Location of the text already dropped: newlines in it, and offset after the last one
+    size_t dropped_lines;
+    size_t line_start;
+
+    //Comment left open at the end of the window, with the location of its start
+    int in_comment;
+    size_t comment_pos;
+    size_t comment_line;
+    size_t comment_col;
 };
 
 
 /**
- * Creates a new lexer for the `input` string
- * The function does not copy the string, it just ensures that the string
- * remains valid while the lexer is being used
- * 
- * @param input: string to be tokenized
+ * Creates a new lexer for the first `len` bytes of `input`
+ * The function does not copy the input, it just ensures that it remains valid while the
+ * lexer is being used. The input does not need to be NUL-terminated, so it can be a
+ * memory-mapped file
+ *
+ * @param input: text to be tokenized
+ * @param len: its length in bytes
  * @return a pointer to a new lexer structure or null if memory allocation fails
  */
-Lexer *lexer_create(const char *input){
+Lexer *lexer_create(const char *input, size_t len){
+    stats_note_alloc(sizeof(Lexer));
     Lexer *l = malloc(sizeof(Lexer));
 
     if(l){
-        l->input = input;
-        l->pos = 0;
+        l->lines = NULL;
+        l->window = NULL;
+        l->held = NULL;
+        l->held_cap = 0;
+        lexer_reset(l, input, len);
     }
 
     return l;
@@ -33,191 +80,723 @@ Lexer *lexer_create(const char *input){
 
 
 /**
- * Increases the lexer position while there are spaces
+ * Creates a lexer that reads its input from `read` as it goes, instead of needing it all
+ * in memory: the text is kept in a window of `window` bytes, refilled when a token (or
+ * the whitespace or comment before it) reaches its end. A token that does not fit is
+ * scanned again once more text is in, so tokens may cross any number of refills;
+ * whitespace and comments are dropped as they are skipped. Memory is the window, grown
+ * only for a single token longer than it, plus a copy of the last token
+ *
+ * @param read: the source; it is called from `lexer_next`
+ * @param ctx: passed to `read`
+ * @param window: size of the window in bytes
+ * @return a pointer to a new lexer structure or null if memory allocation fails
  */
-static void skip_whitespace(Lexer *l){
-    while(isspace((unsigned char)l->input[l->pos])){
-        l->pos++;
+Lexer *lexer_create_reader(LexerRead read, void *ctx, size_t window){
+    Lexer *l = lexer_create("", 0);
+    window = window > 0 ? window : 1;
+
+    if(l){
+        stats_note_alloc(window);
+        l->window = malloc(window);
+
+        if(!l->window){
+            lexer_destroy(l);
+            return NULL;
+        }
+
+        l->input = l->window;
+        l->read = read;
+        l->ctx = ctx;
+        l->cap = window;
+        l->at_end = 0;
     }
+
+    return l;
 }
 
 
 /**
- * Skip any C-style comment block
- * If a open comment C-style comment block is found the position advances to the final 
- * part of the comment or to the end of the input
- * If the comment block does not close, it leaves `pos` in the end of the string
+ * Reads a descriptor for `lexer_create_fd`, retrying interrupted reads
  */
-static void skip_comment(Lexer *l){
-    if(l->input[l->pos] == '/' && l->input[l->pos + 1] == '*'){
-        l->pos += 2;    //Skips "/*"
+static ptrdiff_t read_fd(void *ctx, char *buf, size_t size){
+    ssize_t n;
+
+    do{
+        n = read(*(int *)ctx, buf, size);
+    } while(n < 0 && errno == EINTR);
+
+    return n;
+}
+
+
+/**
+ * Creates a lexer that streams its input from the descriptor `fd`, such as a pipe or a
+ * socket, which it reads but does not close (see `lexer_create_reader`)
+ */
+Lexer *lexer_create_fd(int fd, size_t window){
+    Lexer *l = lexer_create_reader(read_fd, NULL, window);
+
+    if(l){
+        l->fd = fd;
+        l->ctx = &l->fd;
+    }
+
+    return l;
+}
+
+
+/**
+ * Points an existing lexer at a new input in memory and rewinds it
+ * Allows a single lexer to be reused for many expressions without reallocating it
+ */
+void lexer_reset(Lexer *l, const char *input, size_t len){
+    l->input = input;
+    l->len = len;
+    l->pos = 0;
+    l->error = NULL;
+    l->code = LEX_OK;
+    l->line_count = 0;
+    l->lines_ready = 0;
+    l->read = NULL;
+    l->base = 0;
+    l->at_end = 1;
+    l->failure = NULL;
+    l->comment_pos = 0;
+    l->last_pos = 0;
+    l->last_len = 0;
+    l->dropped_lines = 0;
+    l->line_start = 0;
+    l->in_comment = 0;
+}
+
+
+/**
+ * Moves the lexer to offset `pos` of its input, which must be the start of a token or of
+ * the whitespace before one; token positions stay offsets of the whole input
+ */
+void lexer_seek(Lexer *l, size_t pos){
+    l->pos = pos < l->len ? pos : l->len;
+}
+
+
+/**
+ * Character classes: the kind of token that a byte can start
+ * Only the C locale matters, so the classes are fixed and independent of `setlocale`
+ */
+enum{
+    CC_INVALID = 0, //Any byte not listed below
+    CC_SPACE,       //' ', '\t', '\n', '\v', '\f', '\r'
+    CC_ALPHA,       //'a'-'z', 'A'-'Z', '_'
+    CC_NUM,         //Digits, '+', '-', '.'
+    CC_LPAREN,
+    CC_RPAREN,
+    CC_COMMA,
+    CC_SLASH,       //Start of a comment
+    CC_END          //'\0' ends the input, as in a C string
+};
+
+#define LETTERS(c) [c] = CC_ALPHA
+#define DIGIT(c) [c] = CC_NUM
+
+/**
+ * Class of every byte value
+ */
+static const unsigned char char_class[256] = {
+    ['\0'] = CC_END,
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\n'] = CC_SPACE, ['\v'] = CC_SPACE, ['\f'] = CC_SPACE, ['\r'] = CC_SPACE,
+    DIGIT('0'), DIGIT('1'), DIGIT('2'), DIGIT('3'), DIGIT('4'), DIGIT('5'), DIGIT('6'), DIGIT('7'), DIGIT('8'), DIGIT('9'),
+    ['+'] = CC_NUM, ['-'] = CC_NUM, ['.'] = CC_NUM,
+    ['('] = CC_LPAREN, [')'] = CC_RPAREN, [','] = CC_COMMA, ['/'] = CC_SLASH, ['_'] = CC_ALPHA,
+    LETTERS('a'), LETTERS('b'), LETTERS('c'), LETTERS('d'), LETTERS('e'), LETTERS('f'), LETTERS('g'),
+    LETTERS('h'), LETTERS('i'), LETTERS('j'), LETTERS('k'), LETTERS('l'), LETTERS('m'), LETTERS('n'),
+    LETTERS('o'), LETTERS('p'), LETTERS('q'), LETTERS('r'), LETTERS('s'), LETTERS('t'), LETTERS('u'),
+    LETTERS('v'), LETTERS('w'), LETTERS('x'), LETTERS('y'), LETTERS('z'),
+    LETTERS('A'), LETTERS('B'), LETTERS('C'), LETTERS('D'), LETTERS('E'), LETTERS('F'), LETTERS('G'),
+    LETTERS('H'), LETTERS('I'), LETTERS('J'), LETTERS('K'), LETTERS('L'), LETTERS('M'), LETTERS('N'),
+    LETTERS('O'), LETTERS('P'), LETTERS('Q'), LETTERS('R'), LETTERS('S'), LETTERS('T'), LETTERS('U'),
+    LETTERS('V'), LETTERS('W'), LETTERS('X'), LETTERS('Y'), LETTERS('Z')
+};
+
+#undef LETTERS
+#undef DIGIT
+
+
+/**
+ * States of the number recognizer
+ * Grammar: [+-]? digits* ('.' digits*)? ([eE] [+-]? digits+)? with at least one digit
+ * before the exponent
+ */
+enum{
+    NS_START,       //Nothing read
+    NS_SIGN,        //Sign read, no digits yet
+    NS_INT,         //Integer digits (accepting)
+    NS_DOT,         //'.' without digits before it
+    NS_FRAC,        //Digits after the '.', or "digits." (accepting)
+    NS_EXP,         //'e' read
+    NS_EXP_SIGN,    //Sign of the exponent read
+    NS_EXP_DIGITS,  //Exponent digits (accepting)
+    NS_STOP         //No transition: the number ends before this character
+};
+
+/**
+ * Input classes of the number recognizer
+ */
+enum{
+    NC_OTHER,
+    NC_DIGIT,
+    NC_SIGN,
+    NC_DOT,
+    NC_EXP,
+    NC_COUNT
+};
+
+/**
+ * Transition table of the number recognizer: next state for [state][input class]
+ */
+static const unsigned char num_next[NS_STOP][NC_COUNT] = {
+    //                 OTHER     DIGIT          SIGN         DOT       EXP
+    [NS_START]      = {NS_STOP, NS_INT,        NS_SIGN,     NS_DOT,   NS_STOP},
+    [NS_SIGN]       = {NS_STOP, NS_INT,        NS_STOP,     NS_DOT,   NS_STOP},
+    [NS_INT]        = {NS_STOP, NS_INT,        NS_STOP,     NS_FRAC,  NS_EXP},
+    [NS_DOT]        = {NS_STOP, NS_FRAC,       NS_STOP,     NS_STOP,  NS_STOP},
+    [NS_FRAC]       = {NS_STOP, NS_FRAC,       NS_STOP,     NS_STOP,  NS_EXP},
+    [NS_EXP]        = {NS_STOP, NS_EXP_DIGITS, NS_EXP_SIGN, NS_STOP,  NS_STOP},
+    [NS_EXP_SIGN]   = {NS_STOP, NS_EXP_DIGITS, NS_STOP,     NS_STOP,  NS_STOP},
+    [NS_EXP_DIGITS] = {NS_STOP, NS_EXP_DIGITS, NS_STOP,     NS_STOP,  NS_STOP}
+};
+
+/**
+ * Input class of every byte for the number recognizer (NC_OTHER by default)
+ */
+static const unsigned char num_class[256] = {
+    ['0'] = NC_DIGIT, ['1'] = NC_DIGIT, ['2'] = NC_DIGIT, ['3'] = NC_DIGIT, ['4'] = NC_DIGIT,
+    ['5'] = NC_DIGIT, ['6'] = NC_DIGIT, ['7'] = NC_DIGIT, ['8'] = NC_DIGIT, ['9'] = NC_DIGIT,
+    ['+'] = NC_SIGN, ['-'] = NC_SIGN, ['.'] = NC_DOT, ['e'] = NC_EXP, ['E'] = NC_EXP
+};
 
-        //Advances to "*/" or until '\0'
-        while(l->input[l->pos] && !(l->input[l->pos] == '*' && l->input[l->pos + 1] == '/')){
-            l->pos++;
-        }
 
-        //If "*/" is foudn it skips these two characters
-        if(l->input[l->pos]){
-            l->pos += 2;
+/**
+ * Recognizes a known function name and returns its operator
+ * The length and the first byte select the candidate, so at most one comparison is made
+ * @return the operator, or (OpType)-1 if the name is not a known function
+ */
+static OpType keyword(const char *s, size_t len){
+    if(len == 3){
+        switch (s[0]){
+            case 'a':
+                return s[1] == 'd' && s[2] == 'd' ? OP_ADD : (OpType)-1;
+            case 's':
+                return s[1] == 'u' && s[2] == 'b' ? OP_SUB : (OpType)-1;
+            case 'd':
+                return s[1] == 'i' && s[2] == 'v' ? OP_DIV : (OpType)-1;
+            case 'p':
+                return s[1] == 'o' && s[2] == 'w' ? OP_POW : (OpType)-1;
+            case 'm':
+                if(s[1] == 'u' && s[2] == 'l'){
+                    return OP_MUL;
+                }
+
+                return s[1] == 'o' && s[2] == 'd' ? OP_MOD : (OpType)-1;
         }
     }
+    else if(len == 4 && memcmp(s, "tern", 4) == 0){
+        return OP_TERN;
+    }
+
+    return -1;
 }
 
 
 /**
- * Returns the next token from the input
+ * Advances `pos` past any whitespace (see scan.h for the vectorized versions)
+ */
+static size_t skip_whitespace(const unsigned char *in, size_t pos, size_t len){
+    return scan_whitespace((const char *)in, pos, len);
+}
+
+
+/**
+ * Skips the C-style comment block that starts at `pos` (its opening was already checked)
+ * @return the position after the closing delimiter, or `len` + 1 if the comment does not close
+ */
+static size_t skip_comment(const unsigned char *in, size_t pos, size_t len){
+    //Advances to "*/", a NUL byte or the end of the input
+    pos = scan_comment_end((const char *)in, pos + 2, len);
+
+    if(pos < len && in[pos] == '*'){
+        return pos + 2;
+    }
+
+    return len + 1;
+}
+
+
+/**
+ * Scans the next token of the text in memory (for a streamed input, of the window);
+ * positions are relative to `input`
  * 
  * Process:
  * 1. Skip spaces and comments
- * 2. Determine the token type
- * 3. For tokens tat require a lexeme a substring is assigned and copied
+ * 2. Determine the token type from the class of its first character (one table lookup
+ *    and one switch): names are matched against the known functions right away, numbers
+ *    run through a small DFA
+ * 3. Record where the lexeme starts and how long it is (the text is never copied)
  * 
  * @param l: a pointer to the lexer
  * @return the next token or TOK_EOF when the end is reached
  */
-Token lexer_next(Lexer *l){
-    Token t = {.type = TOK_ERROR, .lexeme = NULL, .pos = l->pos};
+static inline Token scan_token(Lexer *l){
+    const unsigned char *in = (const unsigned char *)l->input;
+    size_t len = l->len;
+    size_t pos = l->pos;
+    Token t = {.type = TOK_ERROR, .pos = pos, .len = 0, .op = (OpType)-1};
 
     while(1){
-        skip_whitespace(l);
-        if(l->input[l->pos] == '\0'){
-            t.type = TOK_EOF;
-            return t;
+        unsigned cls = pos < len ? char_class[in[pos]] : CC_END;
+        t.pos = pos;
+
+        switch (cls){
+            case CC_SPACE:
+                pos = skip_whitespace(in, pos + 1, len);
+                continue;
+
+            case CC_SLASH:
+                if(pos + 1 < len && in[pos + 1] == '*'){
+                    pos = skip_comment(in, pos, len);
+
+                    if(pos > len){
+                        l->pos = len;
+                        l->error = "Unclosed comment";
+                        l->code = LEX_UNCLOSED_COMMENT;
+                        return t;
+                    }
+
+                    continue;
+                }
+
+                break;  //A lone '/' is an invalid character
+
+            case CC_END:
+                l->pos = pos;
+                t.type = TOK_EOF;
+                return t;
+
+            //Single char tokens
+            case CC_LPAREN:
+                t.type = TOK_LPAREN;
+                t.len = 1;
+                l->pos = pos + 1;
+                return t;
+
+            case CC_RPAREN:
+                t.type = TOK_RPAREN;
+                t.len = 1;
+                l->pos = pos + 1;
+                return t;
+
+            case CC_COMMA:
+                t.type = TOK_COMMA;
+                t.len = 1;
+                l->pos = pos + 1;
+                return t;
+
+            //Identifier or function name
+            case CC_ALPHA:{
+                size_t start = pos;
+
+                //Names (of functions or variables) may contain digits after the first letter
+                do{
+                    pos++;
+                } while(pos < len && (char_class[in[pos]] == CC_ALPHA || (unsigned)(in[pos] - '0') < 10));
+
+                t.len = pos - start;
+                t.op = keyword(l->input + start, t.len);
+                t.type = t.op != (OpType)-1 ? TOK_OP : TOK_IDENT;
+                l->pos = pos;
+
+                return t;
+            }
+
+            //Number
+            case CC_NUM:{
+                size_t start = pos;
+                unsigned state = NS_START;
+
+                while(pos < len){
+                    unsigned next = num_next[state][num_class[in[pos]]];
+
+                    if(next == NS_STOP){
+                        break;
+                    }
+
+                    state = next;
+                    pos++;
+                }
+
+                l->pos = pos;
+
+                if(state != NS_INT && state != NS_FRAC && state != NS_EXP_DIGITS){
+                    l->error = "Invalid number";
+                    l->code = LEX_INVALID_NUMBER;
+                    return t;
+                }
+
+                t.type = TOK_NUMBER;
+                t.len = pos - start;
+
+                return t;
+            }
         }
 
-        skip_comment(l);
-        if(l->input[l->pos] == '\0'){
-            t.type = TOK_EOF;
-            return t;
+        //Invalid character
+        l->pos = pos + 1;
+        l->error = "Invalid character";
+        l->code = LEX_INVALID_CHARACTER;
+
+        return t;
+    }
+}
+
+
+/**
+ * Drops the first `keep` bytes of the window and reads more text after the rest
+ * The lexeme of the last token returned is copied aside first if it is among the dropped
+ * bytes; the window doubles if nothing can be dropped and it is full. One read is made,
+ * so the text that is available is lexed without waiting for more
+ */
+static void refill(Lexer *l, size_t keep){
+    if(l->last_len > 0 && l->last_pos >= l->base && l->last_pos - l->base < keep){
+        if(l->last_len > l->held_cap){
+            stats_note_alloc(l->last_len);
+            char *held = realloc(l->held, l->last_len);
+
+            if(held){
+                l->held = held;
+                l->held_cap = l->last_len;
+            }
+            else{
+                keep = l->last_pos - l->base;   //Keeps it in the window instead
+            }
         }
 
-        if(!isspace((unsigned char)l->input[l->pos]) && !(l->input[l->pos] == '/' && l->input[l->pos + 1] == '*')){
-            break;
+        if(l->last_len <= l->held_cap){
+            memcpy(l->held, l->input + (l->last_pos - l->base), l->last_len);
         }
     }
 
-    t.pos = l->pos;
+    //Newlines of the dropped text, for the location of errors
+    const char *p = l->window;
+    const char *end = l->window + keep;
 
-    //Identifier
-    if(isalpha((unsigned char)l->input[l->pos])){
-        size_t start = l->pos;
-        
-        while(isalpha((unsigned char)l->input[l->pos])){
-            l->pos++;
-        }
+    while(p < end && (p = memchr(p, '\n', end - p)) != NULL){
+        l->dropped_lines++;
+        l->line_start = l->base + (size_t)(p - l->window) + 1;
+        p++;
+    }
 
-        size_t len = l->pos - start;
-        t.lexeme = malloc(len + 1);
+    memmove(l->window, l->window + keep, l->len - keep);
+    l->base += keep;
+    l->len -= keep;
+    l->pos -= keep;
 
-        if(t.lexeme){
-            strncpy(t.lexeme, l->input + start, len);
-            t.lexeme[len] = '\0';
-            t.type = TOK_IDENT;
+    if(l->len == l->cap){
+        size_t cap = l->cap * 2;
+        stats_note_alloc(cap);
+        char *window = realloc(l->window, cap);
+
+        if(!window){
+            l->at_end = 1;
+            l->failure = "Out of memory";
+            return;
         }
 
-        return t;
+        l->window = window;
+        l->input = window;
+        l->cap = cap;
     }
 
-    //Number
-    if(isdigit((unsigned char)l->input[l->pos]) || l->input[l->pos] == '+' || l->input[l->pos] == '-' || l->input[l->pos] == '.'){
-        size_t start = l->pos;
+    ptrdiff_t n = l->read(l->ctx, l->window + l->len, l->cap - l->len);
+
+    if(n > 0){
+        l->len += (size_t)n;
+    }
+    else{
+        l->at_end = 1;
+        l->failure = n < 0 ? "Read error" : NULL;
+    }
+}
+
 
-        if(l->input[l->pos] == '+' || l->input[l->pos] == '-'){
-            l->pos++;
+/**
+ * Continues a comment left open at the end of the window
+ * @return 0 once it is closed (`pos` is after it), -1 if the input ends inside it
+ */
+static int skip_open_comment(Lexer *l){
+    while(1){
+        size_t end = scan_comment_end(l->input, l->pos, l->len);
+
+        if(end < l->len && l->input[end] == '*'){
+            l->in_comment = 0;
+            l->pos = end + 2;
+            return 0;
         }
 
-        //Digit sequence
-        int has_digits = 0;
-        
-        while(isdigit((unsigned char)l->input[l->pos])){
-            l->pos++;
-            has_digits = 1;
+        //A NUL byte ends the input, as it does in memory
+        if(end < l->len || l->at_end){
+            l->in_comment = 0;
+            l->pos = l->len;
+            l->at_end = 1;
+            return -1;
         }
 
-        //Fraction
-        if(l->input[l->pos] == '.'){
-            l->pos++;
+        //Only a '*' at the very end may still be part of the closing delimiter
+        size_t keep = l->len > l->pos ? l->len - 1 : l->pos;
+        l->pos = keep;
+        refill(l, keep);
+    }
+}
 
-            while((unsigned char)isdigit(l->input[l->pos])){
-                l->pos++;
-                has_digits = 1;
-            }
-        }
 
-        //Exponent
-        if(tolower((unsigned char)l->input[l->pos]) == 'e'){
-            l->pos++;
-            
-            if(l->input[l->pos] == '+' || l->input[l->pos] == '-'){
-                l->pos++;
-            }
+/**
+ * Returns the next token of a streamed input
+ *
+ * A token is scanned in the window as in memory. If the scan reached the end of the
+ * window before the end of the input, the token may continue after it: the window is
+ * refilled, keeping the text from the start of the token, and the token is scanned again
+ * (whitespace and complete comments before it are not kept). A comment still open at the
+ * end of the window is followed across refills without being kept
+ */
+static Token next_streamed(Lexer *l){
+    Token t;
 
-            int exp_digits = 0;
+    while(1){
+        if(l->in_comment && skip_open_comment(l) != 0){
+            t = (Token){.type = TOK_ERROR, .pos = l->comment_pos, .len = 0, .op = (OpType)-1};
+            l->error = "Unclosed comment";
+            l->code = LEX_UNCLOSED_COMMENT;
+            break;
+        }
 
-            while(isdigit((unsigned char)l->input[l->pos])){
-                l->pos++;
-                exp_digits = 1;
-            }
+        const char *error = l->error;
+        LexError code = l->code;
+        t = scan_token(l);
 
-            if(!exp_digits){
-                t.type = TOK_ERROR;
-                return t;
-            }
+        int open_comment = t.type == TOK_ERROR && l->code == LEX_UNCLOSED_COMMENT;
+
+        //A comment that ends at a NUL byte is unclosed whatever follows
+        if(open_comment && scan_comment_end(l->input, t.pos + 2, l->len) < l->len){
+            open_comment = 0;
+            l->at_end = 1;
         }
 
-        if(!has_digits){
-            t.type = TOK_ERROR;
-            return t;
+        if(l->at_end || (l->pos < l->len && !open_comment)){
+            t.pos += l->base;
+            break;
         }
 
-        size_t len = l->pos - start;
-        t.lexeme = malloc(len + 1);
+        //Cut by the end of the window: scanned again with more text
+        l->error = error;
+        l->code = code;
 
-        if(t.lexeme){
-            strncpy(t.lexeme, l->input + start, len);
-            t.lexeme[len] = '\0';
-            t.type = TOK_NUMBER;
+        if(open_comment){
+            l->in_comment = 1;
+            l->comment_pos = l->base + t.pos;
+            lexer_location(l, l->comment_pos, &l->comment_line, &l->comment_col);
+            l->pos = t.pos + 2;     //After "/*"
         }
         else{
-            t.type = TOK_ERROR;
+            l->pos = t.type == TOK_EOF ? l->len : t.pos;
         }
 
-        return t;
+        refill(l, l->pos);
     }
 
-    //Single char tokens
-    switch (l->input[l->pos]){
-        case '(':
-            t.type = TOK_LPAREN;
-            l->pos++;
-            break;
-        case ')':
-            t.type = TOK_RPAREN;
-            l->pos++;
-            break;
-        case ',':
-            t.type = TOK_COMMA;
-            l->pos++;
-            break;
-        default:
-            t.type = TOK_ERROR;
-            l->pos++;
-            break;
+    if(t.type == TOK_EOF && l->failure){
+        t.type = TOK_ERROR;
+        l->error = l->failure;
+        l->code = LEX_READ_ERROR;
     }
 
+    l->last_pos = t.pos;
+    l->last_len = t.len;
+
     return t;
 }
 
 
 /**
- * Frees the memory associated with the token's lexeme
- * This must be called every time we stop using a token that contains a lexeme
+ * Returns the next token from the input
+ *
+ * @param l: a pointer to the lexer
+ * @return the next token or TOK_EOF when the end is reached
+ */
+Token lexer_next(Lexer *l){
+    if(!l->read){
+        return scan_token(l);
+    }
+
+    return next_streamed(l);
+}
+
+
+/**
+ * Returns a pointer to the first character of the token's lexeme inside the input
+ * The lexeme is not NUL-terminated: it is exactly `t->len` bytes long
  */
-void token_free(Token *t){
-    if(t->lexeme){
-        free(t->lexeme);
-        t->lexeme = NULL;
+const char *lexer_text(const Lexer *l, const Token *t){
+    if(t->pos < l->base){
+        return l->held;     //The last token, dropped from the window
+    }
+
+    return l->input + (t->pos - l->base);
+}
+
+
+/**
+ * Returns the description of the last TOK_ERROR returned by `lexer_next`
+ */
+const char *lexer_error(const Lexer *l){
+    return l->error ? l->error : "Invalid token";
+}
+
+
+/**
+ * Returns the kind of the last TOK_ERROR returned by `lexer_next`, LEX_OK if there was none
+ */
+LexError lexer_error_code(const Lexer *l){
+    return l->code;
+}
+
+
+/**
+ * Records the offset of every newline of the input
+ * Only done once per input, and only when a location is actually requested
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int build_line_index(Lexer *l){
+    size_t cap = 0;
+    const char *p = l->input;
+    const char *end = l->input + l->len;
+
+    l->line_count = 0;
+
+    while(p < end && (p = memchr(p, '\n', end - p)) != NULL){
+        if(l->line_count == cap){
+            size_t ncap = cap ? cap * 2 : 64;
+            stats_note_alloc(ncap * sizeof(size_t));
+            size_t *lines = realloc(l->lines, ncap * sizeof(size_t));
+
+            if(!lines){
+                return -1;
+            }
+
+            l->lines = lines;
+            cap = ncap;
+        }
+
+        l->lines[l->line_count++] = p - l->input;
+        p++;
+    }
+
+    l->lines_ready = 1;
+
+    return 0;
+}
+
+
+/**
+ * `lexer_location` for a streamed input, whose newlines are counted as the window moves:
+ * only offsets in the window, and the start of an open comment, are still known
+ */
+static void stream_location(Lexer *l, size_t pos, size_t *line, size_t *col){
+    if(pos < l->base && pos == l->comment_pos){
+        *line = l->comment_line;
+        *col = l->comment_col;
+        return;
+    }
+
+    pos = pos < l->base ? l->base : pos;
+
+    size_t at = pos - l->base < l->len ? pos - l->base : l->len;
+    size_t lines = l->dropped_lines;
+    size_t start = l->line_start;
+    const char *p = l->input;
+    const char *end = l->input + at;
+
+    while(p < end && (p = memchr(p, '\n', end - p)) != NULL){
+        lines++;
+        start = l->base + (size_t)(p - l->input) + 1;
+        p++;
+    }
+
+    *line = lines + 1;
+    *col = pos - start + 1;
+}
+
+
+/**
+ * Converts an offset of the input into a line and a column, both starting at 1
+ * The line is found with a binary search over the newline index
+ *
+ * @param l: the lexer
+ * @param pos: offset in the input (e.g. `Token.pos`)
+ * @param line: receives the line
+ * @param col: receives the column, counted in bytes
+ */
+void lexer_location(Lexer *l, size_t pos, size_t *line, size_t *col){
+    if(l->read){
+        stream_location(l, pos, line, col);
+        return;
+    }
+
+    if(!l->lines_ready && build_line_index(l) != 0){
+        *line = 1;
+        *col = pos + 1;
+        return;
+    }
+
+    //Number of newlines before `pos`
+    size_t lo = 0;
+    size_t hi = l->line_count;
+
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+
+        if(l->lines[mid] < pos){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+
+    *line = lo + 1;
+    *col = lo > 0 ? pos - l->lines[lo - 1] : pos + 1;
+}
+
+
+/**
+ * Writes a complete message for an error token into `buf`, including its location,
+ * e.g. "Invalid character '#' at line 2, column 7"
+ *
+ * @param l: the lexer that returned the token
+ * @param t: the TOK_ERROR token
+ * @param buf: destination of the message
+ * @param size: size of `buf`
+ */
+void lexer_describe_error(Lexer *l, const Token *t, char *buf, size_t size){
+    size_t line, col;
+    lexer_location(l, t->pos, &line, &col);
+
+    const char *msg = lexer_error(l);
+    char c = t->pos >= l->base && t->pos - l->base < l->len ? l->input[t->pos - l->base] : '\0';
+
+    if(strcmp(msg, "Invalid character") == 0 && isprint((unsigned char)c)){
+        snprintf(buf, size, "%s '%c' at line %zu, column %zu", msg, c, line, col);
+    }
+    else{
+        snprintf(buf, size, "%s at line %zu, column %zu", msg, line, col);
     }
 }
 
@@ -226,5 +805,8 @@ void token_free(Token *t){
  * Frees the lexer
  */
 void lexer_destroy(Lexer *l){
+    free(l->lines);
+    free(l->window);
+    free(l->held);
     free(l);
 }
\ No newline at end of file
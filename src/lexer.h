@@ -2,6 +2,7 @@
 #define LEXER_H
 
 #include <stddef.h>
+#include "ast.h"    //OpType
 
 
 /**
@@ -9,7 +10,8 @@
  * 
  * TOK_EOF -> End of File
  * TOK_NUMBER -> A number
- * TOK_IDENT -> Identifier
+ * TOK_IDENT -> Identifier that is not a known function
+ * TOK_OP -> Name of a known function (`add`, `sub`, ..., `tern`), its operator is in `Token.op`
  * TOK_LPAREN -> Left parenthesis '('
  * TOK_RPAREN -> Right parenthesis ')'
  * TOK_COMMA -> Comma ','
@@ -19,6 +21,7 @@ typedef enum{
     TOK_EOF,
     TOK_NUMBER,
     TOK_IDENT,
+    TOK_OP,
     TOK_LPAREN, //We divided the parentheses '('
     TOK_RPAREN, // ')' into two separate tokens
     TOK_COMMA,
@@ -28,22 +31,55 @@ typedef enum{
 
 /**
  * Structure that represents an individual token
+ *
+ * Tokens do not own their text: the lexeme is the view `len` bytes long that starts at
+ * offset `pos` of the input (see `lexer_text`), so no token is ever copied or freed
+ * With a streamed input only a window of the text is resident: the lexeme of a token
+ * stays valid until the second call to `lexer_next` after the one that returned it
  */
 typedef struct{
     TokenType type;
-    char *lexeme;   //NULL for EOF and single-character tokens
     size_t pos;
+    size_t len;     //0 for EOF and errors, 1 for single-character tokens
+    OpType op;      //Operator of a TOK_OP token
 } Token;
 
 
+/**
+ * Kind of the last TOK_ERROR, see `lexer_error_code`
+ */
+typedef enum{
+    LEX_OK,
+    LEX_INVALID_CHARACTER,
+    LEX_INVALID_NUMBER,
+    LEX_UNCLOSED_COMMENT,
+    LEX_READ_ERROR      //A streamed input could not be read (see `lexer_create_reader`)
+} LexError;
+
+
+/**
+ * Source of a streamed input: reads up to `size` bytes into `buf`
+ * @return the number of bytes read, 0 at the end of the input, -1 on error
+ */
+typedef ptrdiff_t (*LexerRead)(void *ctx, char *buf, size_t size);
+
+
 /**
  * Opaque structure that represents the state of the lexical analyzer
  */
 typedef struct Lexer Lexer;
 
-Lexer *lexer_create(const char *input);
+Lexer *lexer_create(const char *input, size_t len);
+Lexer *lexer_create_reader(LexerRead read, void *ctx, size_t window);   //Streams the input through a window of `window` bytes
+Lexer *lexer_create_fd(int fd, size_t window);  //The same, reading the descriptor `fd`
+void lexer_reset(Lexer *l, const char *input, size_t len);  //Reuses the lexer for a new input in memory
+void lexer_seek(Lexer *l, size_t pos);     //Continues from offset `pos` (between tokens) of an input in memory
 Token lexer_next(Lexer *l); //Gets the next token
-void token_free(Token *t);   //Frees the lexeme
+const char *lexer_text(const Lexer *l, const Token *t);  //Start of the token's lexeme in the input
+const char *lexer_error(const Lexer *l); //Description of the last TOK_ERROR
+LexError lexer_error_code(const Lexer *l);  //Kind of the last TOK_ERROR
+void lexer_location(Lexer *l, size_t pos, size_t *line, size_t *col);  //1-based line and column of an offset
+void lexer_describe_error(Lexer *l, const Token *t, char *buf, size_t size);   //Message with line and column
 void lexer_destroy(Lexer *l);
 
 #endif
\ No newline at end of file
@@ -4,57 +4,655 @@
  */
 #define _POSIX_C_SOURCE 200809L
 
-#include <sys/types.h>   // ssize_t
 #include "parser.h"
 #include "printer.h"
+#include "buffer.h"
+#include "stream.h"
+#include "input.h"
+#include "batch.h"
+#include "expr.h"
+#include "server.h"
+#include "eval.h"
+#include "table.h"
+#include "column.h"
+#include "jit.h"
+#include "passes.h"
+#include "flat.h"
+#include "stats.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 
 /**
- * Main function of the program
- * Reads an expression from standard input, analyzes it, and transforms it into infix notation
+ * Size of the output buffer; it is written to stdout whenever it fills up
  */
-int main(){
-    char *input = NULL;
-    size_t len = 0;
-    ssize_t read;
+#define OUTPUT_CHUNK (64 * 1024)
 
-    read = getline(&input, &len, stdin);
-    if(read == -1){
-        fprintf(stderr, "No input or read error\n");
-        free(input);
+
+/**
+ * Prints the command line usage
+ */
+static void usage(const char *prog){
+    fprintf(stderr,
+        "Usage: %s [options] [file]\n"
+        "Reads the expression from `file` (memory-mapped) or from stdin\n"
+        "  -b, --batch   transform every line of the input as an independent expression\n"
+        "  -j, --jobs N  batch mode with N worker threads (0: one per CPU)\n"
+        "  --parse-jobs N\n"
+        "                parse one large expression with N threads (0: one per CPU)\n"
+        "  --print-jobs N\n"
+        "                print one large expression with N threads (0: one per CPU)\n"
+        "  --pipeline    lex a large expression on its own thread, ahead of the parser\n"
+        "  -s, --stream  write the result while reading the input, without building a tree\n"
+        "  -e, --eval    write the numeric value of the expression instead of its infix form\n"
+        "  --csv FILE    evaluate the expression for every row of a CSV file whose header\n"
+        "                names the columns (variables of the expression)\n"
+        "  --doubles FILE --names a,b,...\n"
+        "                the same over raw native doubles, one row after the other\n"
+        "  --jit         evaluate the columns with native code generated for the expression\n"
+        "  -d, --dag     share repeated subtrees: each one is printed or evaluated once\n"
+        "  -p, --passes LIST\n"
+        "                simplify the expression first; LIST is \"all\", \"none\" or a\n"
+        "                comma-separated list of fold, identity and tern\n"
+        "  --serve PATH  run as a server on the Unix socket PATH (\"-\": length-prefixed\n"
+        "                frames on stdin and stdout) with -j worker threads; see server.h\n"
+        "  --connect PATH\n"
+        "                batch mode through the server listening on PATH\n"
+        "  --stats       write the time, allocations and sizes of every phase to stderr as\n"
+        "                JSON (with a latency histogram of the records in batch mode)\n"
+        "  --stats-file FILE\n"
+        "                the same, written to FILE\n"
+        "  -h, --help    show this help\n", prog);
+}
+
+
+/**
+ * Ends the phase of a measured run that has just finished and starts timing the next one
+ * Does nothing when `stats` is NULL, so the unmeasured paths only pay for the test
+ */
+static void checkpoint(Stats *stats, StatsPhase phase, StatsMark *mark){
+    if(stats){
+        stats_phase(stats, phase, mark);
+        stats_mark(mark);
+    }
+}
+
+
+/**
+ * Lex phase of a measured run: a separate pass of the lexer over the input, which also
+ * gives the sizes of the expression (see `stats_scan`)
+ */
+static void measure_lex(const Input *in, Stats *stats, StatsMark *mark){
+    if(!stats){
+        return;
+    }
+
+    stats_mark(mark);
+    Lexer *lexer = lexer_create(in->data, in->len);
+
+    if(lexer){
+        stats_scan(stats, lexer);
+        lexer_destroy(lexer);
+    }
+
+    stats->records = 1;
+    stats->input_bytes = in->len;
+    checkpoint(stats, STATS_LEX, mark);
+}
+
+
+/**
+ * Batch mode: transforms every line of the input independently (see batch.h)
+ * A line that fails produces an "Error: ..." record in its place and the run carries on
+ *
+ * @return 0 if every record was transformed, 1 otherwise
+ */
+static int run_batch(const Input *in, int jobs, int eval, unsigned passes, int dag, Stats *stats){
+    BatchOptions opts = {.jobs = jobs, .eval = eval, .passes = passes, .dag = dag, .stats = stats};
+    int rc = batch_run(in->data, in->len, &opts, stdout);
+
+    if(rc < 0){
+        fprintf(stderr, "Error: out of memory or write error\n");
+        return 1;
+    }
+
+    return rc;
+}
+
+
+/**
+ * Flags of the library (expr.h) that match the options of the command line
+ */
+static unsigned expr_flags(int eval, unsigned passes, int dag){
+    return (eval ? EXPR_EVAL : 0) | (dag ? EXPR_DAG : 0) | (passes & PASS_FOLD ? EXPR_FOLD : 0)
+           | (passes & PASS_IDENTITY ? EXPR_IDENTITY : 0) | (passes & PASS_TERN ? EXPR_TERN : 0);
+}
+
+
+/**
+ * Server mode: serves requests on a Unix socket until killed, or the frames of stdin
+ * until it ends (see server.h)
+ *
+ * @return 1 if the server cannot start or fails, 0 when the frames of stdin end cleanly
+ */
+static int run_server(const char *path, int jobs, unsigned flags){
+    ServerOptions opts = {.jobs = jobs, .flags = flags};
+
+    if(strcmp(path, "-") == 0){
+        if(server_run_pipe(STDIN_FILENO, STDOUT_FILENO, &opts) != 0){
+            fprintf(stderr, "Error: malformed request, out of memory or write error\n");
+            return 1;
+        }
+
+        return 0;
+    }
+
+    server_run_socket(path, &opts);
+    fprintf(stderr, "Error: cannot serve on %s: %s\n", path, strerror(errno));
+
+    return 1;
+}
+
+
+/**
+ * Client mode: batch mode where the records are transformed by a server
+ * @return 0 if every record was transformed, 1 otherwise
+ */
+static int run_client(const Input *in, const char *path, unsigned flags){
+    int rc = client_run(path, in->data, in->len, flags, stdout);
+
+    if(rc < 0){
+        fprintf(stderr, "Error: cannot talk to the server on %s\n", path);
+        return 1;
+    }
+
+    return rc;
+}
+
+
+/**
+ * Streaming mode: transforms the input without building an AST and writes the result to
+ * stdout as it is produced, so memory is bounded by the nesting depth; a pipe is read as
+ * it goes as well (see `streamer_create_fd`), so the input never has to fit in memory
+ * On error the part of the output that was already written is followed by no newline
+ *
+ * @return 0 on success, 1 on error
+ */
+static int run_stream(const Input *in){
+    Streamer *s = in->fd >= 0 ? streamer_create_fd(in->fd) : streamer_create(in->data, in->len);
+    Buffer out;
+
+    if(!s || buffer_init_sink(&out, stdout, OUTPUT_CHUNK) != 0){
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    int rc = 0;
+
+    if(streamer_run(s, &out) != 0){
+        const char *err = streamer_error(s);
+        fprintf(stderr, "Error: %s\n", err ? err : "Unknown error");
+        buffer_clear(&out);     //Drops the pending part of an incomplete result
+        rc = 1;
+    }
+    else{
+        buffer_putc(&out, '\n');
+    }
+
+    if(buffer_flush(&out, stdout) != 0){
+        rc = 1;
+    }
+
+    buffer_free(&out);
+    streamer_destroy(s);
+
+    return rc;
+}
+
+
+/**
+ * Evaluation: compiles the tree to bytecode (see eval.h), runs it and appends the value
+ * to `out`
+ * @return 0 on success, 1 on error
+ */
+static int run_eval(const AST *ast, Buffer *out){
+    Program prog;
+    double value;
+    EvalError err = EVAL_NO_MEMORY;
+
+    program_init(&prog);
+
+    if(program_compile(&prog, ast) == 0){
+        err = program_run(&prog, NULL, &value);
+    }
+
+    program_free(&prog);
+
+    if(err != EVAL_OK){
+        fprintf(stderr, "Error: %s\n", program_strerror(err));
+        return 1;
+    }
+
+    return buffer_put_double(out, value) == 0 && buffer_putc(out, '\n') == 0 ? 0 : 1;
+}
+
+
+/**
+ * Column mode: evaluates the expression once per row of a table, whose columns supply the
+ * values of the variables, and appends one value per line to `out` (see column.h)
+ *
+ * @param ast: the expression
+ * @param path: the CSV file, or the raw doubles when `names` is set
+ * @param names: comma-separated column names of a file of raw doubles, NULL for CSV
+ * @param jit: generate native code (see jit.h), falling back to the interpreter
+ * @param out: destination of the values
+ * @return 0 on success, 1 on error
+ */
+static int run_columns(const AST *ast, const char *path, const char *names, int jit, Buffer *out){
+    Input data;
+    Table table;
+    Program prog;
+    char err[128];
+
+    if(input_open(&data, path) != 0){
+        fprintf(stderr, "Error: cannot read %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    int rc = names ? table_load_doubles(&table, data.data, data.len, names, err, sizeof(err))
+                   : table_load_csv(&table, data.data, data.len, err, sizeof(err));
+
+    input_close(&data);
+
+    if(rc != 0){
+        fprintf(stderr, "Error: %s: %s\n", path, err);
         return 1;
     }
 
-    //Removes the newline character if it exists
-    if(read > 0 && input[read - 1] == '\n'){
-        input[read - 1] = '\0';
+    program_init(&prog);
+
+    const double **vars = NULL;
+    double *values = malloc((table.nrows ? table.nrows : 1) * sizeof(double));
+
+    if(!values || program_compile_select(&prog, ast) != 0
+       || !(vars = malloc((prog.nvars ? prog.nvars : 1) * sizeof(double *)))){
+        fprintf(stderr, "Error: out of memory\n");
+        rc = 1;
+    }
+
+    //Binds every variable to the column with the same name
+    for(size_t i = 0; rc == 0 && i < prog.nvars; i++){
+        int c = table_find(&table, prog.vars[i].name, prog.vars[i].len);
+
+        if(c < 0){
+            fprintf(stderr, "Error: no column named '%.*s' in %s\n", (int)prog.vars[i].len, prog.vars[i].name, path);
+            rc = 1;
+        }
+        else{
+            vars[i] = table.cols[c];
+        }
+    }
+
+    JitFunction *fn = rc == 0 && jit ? jit_compile(&prog) : NULL;
+
+    if(fn){
+        jit_run(fn, vars, table.nrows, values);
+        jit_free(fn);
+    }
+    else if(rc == 0 && column_eval(&prog, vars, table.nrows, values) != 0){
+        fprintf(stderr, "Error: out of memory\n");
+        rc = 1;
     }
 
+    for(size_t r = 0; rc == 0 && r < table.nrows; r++){
+        if(buffer_put_double(out, values[r]) != 0 || buffer_putc(out, '\n') != 0){
+            rc = 1;
+        }
+    }
+
+    free(vars);
+    free(values);
+    program_free(&prog);
+    table_free(&table);
+
+    return rc;
+}
+
+
+/**
+ * Compact mode, used when the expression is only printed or evaluated: it is analyzed
+ * into a flat tree (see flat.h), which takes about a third of the memory of an `AST` and
+ * no longer needs the parser once it is built
+ *
+ * @param pipeline: lexes a large input on a thread of its own (see tokring.h)
+ * @param stats: receives the measurements of the phases, NULL to not measure
+ * @return 0 on success, 1 on error
+ */
+static int run_flat(const Input *in, int eval, int pipeline, Stats *stats){
+    StatsMark mark;
+
+    measure_lex(in, stats, &mark);
+
+    Parser *parser = parser_create(in->data, in->len);
+    FlatTree tree;
+    Buffer out;
+
+    flat_init(&tree);
+
+    if(parser){
+        parser_set_pipeline(parser, pipeline);
+    }
+
+    if(!parser || buffer_init_sink(&out, stdout, OUTPUT_CHUNK) != 0){
+        fprintf(stderr, "Error: out of memory\n");
+
+        if(parser){
+            parser_destroy(parser);
+        }
+
+        return 1;
+    }
+
+    int rc = 0;
+
+    if(parser_parse_flat(parser, &tree) != 0){
+        const char *err = parser_error(parser);
+        fprintf(stderr, "Error: %s\n", err ? err : "Unknown error");
+        rc = 1;
+    }
+
+    parser_destroy(parser);
+    checkpoint(stats, STATS_PARSE, &mark);
+
+    if(rc == 0 && eval){
+        double value;
+        EvalError err = flat_eval(&tree, &value);
+
+        if(err != EVAL_OK){
+            fprintf(stderr, "Error: %s\n", program_strerror(err));
+            rc = 1;
+        }
+        else{
+            rc = buffer_put_double(&out, value) == 0 && buffer_putc(&out, '\n') == 0 ? 0 : 1;
+        }
+    }
+    else if(rc == 0){
+        rc = flat_print(&tree, &out) == 0 ? 0 : 1;
+        buffer_putc(&out, '\n');
+    }
+
+    if(buffer_flush(&out, stdout) != 0){
+        rc = 1;
+    }
+
+    checkpoint(stats, STATS_OUTPUT, &mark);
+
+    if(stats){
+        stats->output_bytes = out.flushed;
+        stats->failed = rc != 0;
+    }
+
+    buffer_free(&out);
+    flat_free(&tree);
+    checkpoint(stats, STATS_FREE, &mark);
+
+    return rc;
+}
+
+
+/**
+ * Default mode: the whole input is one expression, which may span several lines
+ *
+ * @param parse_jobs: threads of the analysis of a large input (see pparse.h)
+ * @param print_jobs: threads of the printing of a large tree (see `ast_print_parallel`)
+ * @param pipeline: lexes a large input on a thread of its own (see tokring.h)
+ * @param stats: receives the measurements of the phases, NULL to not measure
+ * @return 0 on success, 1 on error
+ */
+static int run_single(const Input *in, int eval, const char *columns, const char *names, int jit, unsigned passes, int dag,
+                      int parse_jobs, int print_jobs, int pipeline, Stats *stats){
+    StatsMark mark;
+    Buffer out;
+
+    measure_lex(in, stats, &mark);
+
     //Creates a parser with the read text
-    Parser *parser = parser_create(input);
+    Parser *parser = parser_create(in->data, in->len);
+
+    if(!parser || buffer_init_sink(&out, stdout, OUTPUT_CHUNK) != 0){
+        fprintf(stderr, "Error: out of memory\n");
+
+        if(parser){
+            parser_destroy(parser);
+        }
+
+        return 1;
+    }
+
+    parser_set_dag(parser, dag);
+    parser_set_jobs(parser, parse_jobs);
+    parser_set_pipeline(parser, pipeline);
     AST *ast = parser_parse(parser);
+    int rc = 0;
+
+    checkpoint(stats, STATS_PARSE, &mark);
 
     //Sends an error if the syntax analysis fails
     if(!ast){
         const char *err = parser_error(parser);
         fprintf(stderr, "Error: %s\n", err ? err : "Unknown error");
-        parser_destroy(parser);
-        free(input);
-        return 1;
+        rc = 1;
+    }
+    //The simplified tree shares the parser's arena
+    else if(!(ast = passes_run(ast, passes, parser_arena(parser)))){
+        fprintf(stderr, "Error: out of memory\n");
+        rc = 1;
+    }
+
+    checkpoint(stats, STATS_PASSES, &mark);
+
+    if(rc == 0 && columns){
+        rc = run_columns(ast, columns, names, jit, &out);
+    }
+    else if(rc == 0 && eval){
+        rc = run_eval(ast, &out);
+    }
+    else if(rc == 0){
+        //Writes the AST to stdout in infix notation
+        rc = ast_print_parallel(ast, print_jobs, &out) == 0 && buffer_putc(&out, '\n') == 0 ? 0 : 1;
     }
 
-    //Transforms the AST into an output string
-    char *output = ast_to_string(ast);
-    printf("%s\n", output);
+    if(buffer_flush(&out, stdout) != 0){
+        rc = 1;
+    }
+
+    checkpoint(stats, STATS_OUTPUT, &mark);
+
+    if(stats){
+        stats->output_bytes = out.flushed;
+        stats->failed = rc != 0;
+    }
 
     //Free all the allocated resources
-    free(output);
-    ast_free(ast);
-    parser_destroy(parser);
-    free(input);
+    buffer_free(&out);
+    parser_destroy(parser);   //Also releases the AST
+    checkpoint(stats, STATS_FREE, &mark);
+
+    return rc;
+}
+
+
+/**
+ * Main function of the program
+ * Reads an expression from a file or standard input, analyzes it, and transforms it into infix notation
+ */
+int main(int argc, char **argv){
+    int batch = 0;
+    int stream = 0;
+    int eval = 0;
+    const char *columns = NULL;     //Data file of the column mode
+    const char *names = NULL;       //Column names of a file of raw doubles
+    int doubles = 0;
+    int jit = 0;
+    unsigned passes = 0;
+    int dag = 0;
+    int jobs = 1;
+    int parse_jobs = 1;
+    int print_jobs = 1;
+    int pipeline = 0;
+    int measure = 0;
+    const char *serve = NULL;           //Socket of the server mode
+    const char *connect_path = NULL;    //Socket of the client mode
+    const char *stats_path = NULL;  //NULL writes the stats to stderr
+    const char *path = NULL;
+
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0){
+            batch = 1;
+        }
+        else if((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) && i + 1 < argc){
+            char *end;
+            long n = strtol(argv[++i], &end, 10);
+
+            if(*end != '\0' || n < 0 || n > 1024){
+                usage(argv[0]);
+                return 1;
+            }
+
+            jobs = n > 0 ? (int)n : (int)sysconf(_SC_NPROCESSORS_ONLN);
+            batch = 1;
+        }
+        else if((strcmp(argv[i], "--parse-jobs") == 0 || strcmp(argv[i], "--print-jobs") == 0) && i + 1 < argc){
+            int *threads = strcmp(argv[i], "--parse-jobs") == 0 ? &parse_jobs : &print_jobs;
+            char *end;
+            long n = strtol(argv[++i], &end, 10);
+
+            if(*end != '\0' || n < 0 || n > 1024){
+                usage(argv[0]);
+                return 1;
+            }
+
+            *threads = n > 0 ? (int)n : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        else if(strcmp(argv[i], "--pipeline") == 0){
+            pipeline = 1;
+        }
+        else if(strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--stream") == 0){
+            stream = 1;
+        }
+        else if(strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--eval") == 0){
+            eval = 1;
+        }
+        else if((strcmp(argv[i], "--csv") == 0 || strcmp(argv[i], "--doubles") == 0) && i + 1 < argc){
+            doubles = strcmp(argv[i], "--doubles") == 0;
+            columns = argv[++i];
+        }
+        else if(strcmp(argv[i], "--names") == 0 && i + 1 < argc){
+            names = argv[++i];
+        }
+        else if(strcmp(argv[i], "--jit") == 0){
+            jit = 1;
+        }
+        else if(strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--dag") == 0){
+            dag = 1;
+        }
+        else if((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--passes") == 0) && i + 1 < argc){
+            if(passes_parse(argv[++i], &passes) != 0){
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--serve") == 0 && i + 1 < argc){
+            serve = argv[++i];
+        }
+        else if(strcmp(argv[i], "--connect") == 0 && i + 1 < argc){
+            connect_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "--stats") == 0){
+            measure = 1;
+        }
+        else if(strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc){
+            measure = 1;
+            stats_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0){
+            usage(argv[0]);
+            return 0;
+        }
+        else if((argv[i][0] != '-' || strcmp(argv[i], "-") == 0) && !path){
+            path = argv[i];
+        }
+        else{
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    //Raw doubles need the names of their columns, a CSV file has them in its header
+    if(doubles != (names != NULL)){
+        usage(argv[0]);
+        return 1;
+    }
+
+    //The server reads requests, not an input file
+    if(serve){
+        return run_server(serve, jobs > 0 ? jobs : 1, expr_flags(eval, passes, dag));
+    }
+
+    //The streaming mode reads a pipe as it goes instead of loading it first
+    int streaming = stream && !batch && !connect_path && !eval && !columns && !passes && !measure;
+    Input in;
+
+    if((streaming ? input_open_fd(&in, path) : input_open(&in, path)) != 0){
+        fprintf(stderr, "Error: cannot read %s: %s\n", path ? path : "stdin", strerror(errno));
+        return 1;
+    }
+
+    Stats totals;
+    Stats *stats = measure ? &totals : NULL;
+    StatsMark start;
+    int rc;
+
+    stats_init(&totals);
+    stats_mark(&start);
+
+    if(connect_path){
+        rc = run_client(&in, connect_path, expr_flags(eval, passes, dag));
+    }
+    else if(batch){
+        rc = run_batch(&in, jobs > 0 ? jobs : 1, eval, passes, dag, stats);
+    }
+    else if(in.len == 0 && in.fd < 0){
+        fprintf(stderr, "No input or read error\n");
+        rc = 1;
+    }
+    else if(streaming){
+        rc = run_stream(&in);
+    }
+    else if(!columns && !passes && !dag && parse_jobs <= 1 && print_jobs <= 1){
+        rc = run_flat(&in, eval, pipeline, stats);
+    }
+    else{
+        rc = run_single(&in, eval, columns, names, jit, passes, dag, parse_jobs, print_jobs, pipeline, stats);
+    }
+
+    input_close(&in);
+
+    if(stats){
+        FILE *f = stats_path ? fopen(stats_path, "w") : stderr;
+        StatsMark end;
+
+        stats_mark(&end);
+
+        if(!f || stats_write(stats, batch ? "batch" : "single", end.t - start.t, f) != 0
+           || (f != stderr && fclose(f) != 0)){
+            fprintf(stderr, "Error: cannot write the stats to %s\n", stats_path ? stats_path : "stderr");
+            rc = 1;
+        }
+    }
 
-    return 0;
-}
\ No newline at end of file
+    return rc;
+}
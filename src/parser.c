@@ -1,41 +1,112 @@
 #include "parser.h"
+#include "stats.h"
 #include "lexer.h"
 #include "ast.h"
+#include "flat.h"
+#include "pparse.h"
+#include "tokring.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 
+/**
+ * Smallest rest of the input lexed on a thread of its own: below it, starting the thread
+ * costs more than it saves
+ */
+#define PIPELINE_MIN_INPUT (64 * 1024)
+
+
+/**
+ * A function call whose arguments are being analyzed
+ */
+typedef struct{
+    OpType op;
+    int arg_count;
+    AST *args[3];
+    uint32_t starts[3]; //Flat trees: index of the first node of each argument
+    size_t pos;         //Offset of the name of the function, where arity errors are reported
+} ParseFrame;
+
+
 /**
  * Principal structure of the parser (syntax analyzer)
  */
 struct Parser{
     Lexer *lexer;
     Token current;
-    char *error_msg;
+    const char *input;
+    size_t len;
+
+    //First error of the current input: NULL, or `error_text`
+    const char *error_msg;
+    char error_text[128];
+    ParseError error_code;
+    size_t error_pos;
+    Arena arena;    //Owns the nodes of the trees returned by `parser_parse`
+    AstCons cons;   //Shared nodes of the current tree, when `dag` is set
+    int dag;
+
+    //Stack of open calls, reused between parses
+    ParseFrame *frames;
+    size_t depth;
+    size_t frame_cap;
+
+    //Parallel analysis of large inputs (see pparse.h): one parser per thread, created on
+    //first use, whose arenas hold the pieces of the tree
+    int jobs;
+    Parser **helpers;
+
+    //Pipelined analysis (see tokring.h): the lexer runs ahead on its own thread while
+    //`piping`; the ring is created on first use
+    int pipeline;
+    int piping;
+    TokenRing *ring;
 };
 
 static void advance(Parser *p);
 static AST *parse_expr(Parser *p);
-static AST *parse_primary(Parser *p);
-static OpType get_op_from_ident(const char *ident);
+static int parse_flat(Parser *p, FlatTree *t);
+static AST *fail(Parser *p, ParseError code, const char *msg);
+static AST *parse_parallel(Parser *p);
+static void drop_helpers(Parser *p);
+static void start_pipeline(Parser *p);
+static void stop_pipeline(Parser *p);
 
 
 /**
  * Creates and initializes the new parser
  * 
- * @param input: the string of text that contains the expression to be analyzed
+ * @param input: the text that contains the expression to be analyzed; it is not copied
+ *               and does not need to be NUL-terminated
+ * @param len: its length in bytes
  * @return a pointer to the initializes parser structure
  */
-Parser *parser_create(const char *input){
+Parser *parser_create(const char *input, size_t len){
+    stats_note_alloc(sizeof(Parser));
     Parser *p = malloc(sizeof(Parser));
 
     if(p){
-        p->lexer = lexer_create(input);
+        p->lexer = lexer_create(input, len);
+        p->input = input;
+        p->len = len;
         p->error_msg = NULL;
+        p->error_code = PARSE_OK;
+        p->error_pos = 0;
+        arena_init(&p->arena, 0);
+        ast_cons_init(&p->cons);
+        p->dag = 0;
+        p->frames = NULL;
+        p->depth = 0;
+        p->frame_cap = 0;
+        p->jobs = 1;
+        p->helpers = NULL;
+        p->pipeline = 0;
+        p->piping = 0;
+        p->ring = NULL;
         p->current.type = TOK_ERROR;
-        p->current.lexeme = NULL;
         p->current.pos = 0;
+        p->current.len = 0;
         advance(p); //Loads the first token
     }
 
@@ -43,28 +114,107 @@ Parser *parser_create(const char *input){
 }
 
 
+/**
+ * Prepares an existing parser to analyze a new input
+ * The previous error message and pending token are discarded, the lexer is reused and
+ * the arena is rewound, which releases the tree returned by the previous `parser_parse`
+ *
+ * @param p: the parser
+ * @param input: the text that contains the next expression (not necessarily NUL-terminated)
+ * @param len: its length in bytes
+ */
+void parser_reset(Parser *p, const char *input, size_t len){
+    arena_reset(&p->arena);
+    ast_cons_clear(&p->cons);
+
+    for(int i = 0; p->helpers && i < p->jobs; i++){
+        arena_reset(&p->helpers[i]->arena);
+    }
+
+    parser_reset_range(p, input, 0, len);
+}
+
+
+/**
+ * Prepares the parser to analyze only the bytes `start` to `end` of `input`, as one
+ * expression; offsets (of nodes and errors) stay those of the whole input
+ * Unlike `parser_reset`, the arena is kept, so the trees of several ranges of one input
+ * can be built with the same parser and used together
+ */
+void parser_reset_range(Parser *p, const char *input, size_t start, size_t end){
+    lexer_reset(p->lexer, input, end);
+    lexer_seek(p->lexer, start);
+    p->input = input;
+    p->len = end;
+    p->depth = 0;
+    p->error_msg = NULL;
+    p->error_code = PARSE_OK;
+    p->error_pos = 0;
+    advance(p); //Loads the first token
+}
+
+
 /**
  * The main entry point of the parser
  * 
  * Calls to the `parse_expr` to build the AST
  * If tokens remain after analysis, it is considered a syntax error
+ * The returned tree belongs to the parser's arena: it stays valid until the next
+ * `parser_reset` or `parser_destroy` and must not be passed to `ast_free`
  */
 AST *parser_parse(Parser *p){
-    AST *ast = parse_expr(p);
+    p->depth = 0;
 
-    if(p->current.type != TOK_EOF){
-        if(!p->error_msg){
-            p->error_msg = strdup("Unexpected token after expression");
+    //A failed parallel analysis leaves the parser untouched: the sequential one then
+    //finds the first error, as it would have without threads
+    if(p->jobs > 1 && !p->dag && !p->error_msg){
+        AST *ast = parse_parallel(p);
+
+        if(ast){
+            return ast;
         }
+    }
 
-        ast_free(ast);
-        return NULL;
+    start_pipeline(p);
+    AST *ast = parse_expr(p);
+    stop_pipeline(p);
+
+    if(p->current.type != TOK_EOF){
+        return fail(p, PARSE_ERR_TRAILING_TOKEN, "Unexpected token after expression");
     }
 
     return ast;
 }
 
 
+/**
+ * Analyzes the whole input into a compact flat tree instead of an `AST` (see flat.h)
+ * The tree does not depend on the parser or on the input once it is built
+ *
+ * @param p: the parser
+ * @param t: receives the tree; its previous contents are discarded
+ * @return 0 on success, -1 on error (see `parser_error`)
+ */
+int parser_parse_flat(Parser *p, FlatTree *t){
+    p->depth = 0;
+    flat_clear(t);
+    start_pipeline(p);
+    int rc = parse_flat(p, t);
+    stop_pipeline(p);
+
+    if(rc != 0){
+        return -1;
+    }
+
+    if(p->current.type != TOK_EOF){
+        fail(p, PARSE_ERR_TRAILING_TOKEN, "Unexpected token after expression");
+        return -1;
+    }
+
+    return 0;
+}
+
+
 /**
  * Returns the error message from the current parser
  */
@@ -73,200 +223,556 @@ const char *parser_error(Parser *p){
 }
 
 
+/**
+ * Returns the kind of the first error of the last analysis, without a message to format
+ * or free
+ *
+ * @param p: the parser
+ * @param offset: receives the byte offset in the input where the error was found (the
+ *                start of the offending token, or of the name of the function for
+ *                PARSE_ERR_ARITY and PARSE_ERR_UNKNOWN_FUNCTION); may be NULL
+ * @return PARSE_OK if the last analysis succeeded
+ */
+ParseError parser_error_code(const Parser *p, size_t *offset){
+    if(offset){
+        *offset = p->error_pos;
+    }
+
+    return p->error_code;
+}
+
+
+/**
+ * Chooses whether the next trees are built with the hash-consing constructors (see ast.h):
+ * repeated subtrees are then stored once and the result is a DAG
+ */
+void parser_set_dag(Parser *p, int dag){
+    p->dag = dag;
+}
+
+
+/**
+ * Sets the number of threads of the next analyses with `parser_parse`: large inputs are
+ * then split into pieces parsed concurrently (see pparse.h). Ignored for DAGs, whose
+ * subtrees are shared across the whole tree
+ */
+void parser_set_jobs(Parser *p, int jobs){
+    jobs = jobs > 1 ? jobs : 1;
+
+    if(jobs != p->jobs){
+        drop_helpers(p);
+        p->jobs = jobs;
+    }
+}
+
+
+/**
+ * Chooses whether the next sequential analyses of large inputs run the lexer on its own
+ * thread, ahead of the parser (see tokring.h). Results and errors are the same either way
+ */
+void parser_set_pipeline(Parser *p, int on){
+    p->pipeline = on;
+}
+
+
+/**
+ * Sizes the stack of open calls for `depth` nested calls at once, instead of doubling it
+ * as the analysis goes deeper
+ * @return 0 on success, -1 if memory allocation fails
+ */
+int parser_reserve(Parser *p, size_t depth){
+    if(depth <= p->frame_cap){
+        return 0;
+    }
+
+    stats_note_alloc(depth * sizeof(ParseFrame));
+    ParseFrame *frames = realloc(p->frames, depth * sizeof(ParseFrame));
+
+    if(!frames){
+        return -1;
+    }
+
+    p->frames = frames;
+    p->frame_cap = depth;
+
+    return 0;
+}
+
+
+/**
+ * Returns the arena that owns the parsed trees
+ * Nodes allocated there by a rewrite of the tree (see passes.h) share its lifetime
+ */
+Arena *parser_arena(Parser *p){
+    return &p->arena;
+}
+
+
 /**
  * Frees all the resources associated to the parser
  */
 void parser_destroy(Parser *p){
-    lexer_destroy(p->lexer);
-    if(p->error_msg){
-        free(p->error_msg);
+    drop_helpers(p);
+
+    if(p->ring){
+        tokring_free(p->ring);
+        free(p->ring);
     }
 
+    lexer_destroy(p->lexer);
+    arena_free(&p->arena);
+    ast_cons_free(&p->cons);
+    free(p->frames);
+
     free(p);
 }
 
 
+/**
+ * Parallel analysis of the whole input with the helper parsers, created the first time
+ * @return the tree, which lives in the arenas of the helpers, or null if the input was
+ *         not split or a piece failed
+ */
+static AST *parse_parallel(Parser *p){
+    if(!p->helpers){
+        stats_note_alloc(p->jobs * sizeof(Parser *));
+
+        if(!(p->helpers = calloc((size_t)p->jobs, sizeof(Parser *)))){
+            return NULL;
+        }
+
+        for(int i = 0; i < p->jobs; i++){
+            if(!(p->helpers[i] = parser_create(p->input, 0))){
+                drop_helpers(p);
+                return NULL;
+            }
+        }
+    }
+
+    AST *ast = pparse_parse(p->helpers, p->jobs, p->input, p->len);
+
+    //Drops the pieces of a failed attempt
+    for(int i = 0; !ast && i < p->jobs; i++){
+        arena_reset(&p->helpers[i]->arena);
+    }
+
+    return ast;
+}
+
+
+/**
+ * Destroys the helper parsers, and the pieces of trees they hold
+ */
+static void drop_helpers(Parser *p){
+    for(int i = 0; p->helpers && i < p->jobs && p->helpers[i]; i++){
+        parser_destroy(p->helpers[i]);
+    }
+
+    free(p->helpers);
+    p->helpers = NULL;
+}
+
+
+/**
+ * Hands the rest of the input to the lexer thread, when the pipeline is enabled and the
+ * input is large enough to repay the thread; otherwise the parser keeps calling the lexer
+ * Any failure (memory, thread) silently leaves the analysis sequential
+ */
+static void start_pipeline(Parser *p){
+    if(!p->pipeline || p->error_msg || p->current.type == TOK_EOF || p->len - p->current.pos < PIPELINE_MIN_INPUT){
+        return;
+    }
+
+    if(!p->ring){
+        stats_note_alloc(sizeof(TokenRing));
+        p->ring = aligned_alloc(_Alignof(TokenRing), sizeof(TokenRing));
+
+        if(p->ring && tokring_init(p->ring) != 0){
+            free(p->ring);
+            p->ring = NULL;
+        }
+    }
+
+    p->piping = p->ring && tokring_start(p->ring, p->lexer) == 0;
+}
+
+
+/**
+ * Stops the lexer thread, if any; the tokens it lexed ahead are discarded
+ */
+static void stop_pipeline(Parser *p){
+    if(p->piping){
+        tokring_stop(p->ring);
+        p->piping = 0;
+    }
+}
+
+
 /**
  * Advances to the next token in the input stream
- * Frees the previous token before getting the next one
  */
 static void advance(Parser *p){
-    token_free(&p->current);
-    p->current = lexer_next(p->lexer);
+    p->current = p->piping ? tokring_next(p->ring) : lexer_next(p->lexer);
+
+    //A lexical error is reported as such, with its location, before any syntax error
+    if(p->current.type == TOK_ERROR && !p->error_msg){
+        stop_pipeline(p);   //The lexer is ours again to describe the error
+
+        static const ParseError codes[] = {
+            [LEX_OK] = PARSE_ERR_INVALID_CHARACTER,
+            [LEX_INVALID_CHARACTER] = PARSE_ERR_INVALID_CHARACTER,
+            [LEX_INVALID_NUMBER] = PARSE_ERR_INVALID_NUMBER,
+            [LEX_UNCLOSED_COMMENT] = PARSE_ERR_UNCLOSED_COMMENT,
+            [LEX_READ_ERROR] = PARSE_ERR_INVALID_CHARACTER     //Parsers read from memory
+        };
+
+        lexer_describe_error(p->lexer, &p->current, p->error_text, sizeof(p->error_text));
+        p->error_msg = p->error_text;
+        p->error_code = codes[lexer_error_code(p->lexer)];
+        p->error_pos = p->current.pos;
+    }
 }
 
 
 /**
- * Analyzes a generic expression
+ * Records the first syntax error found, at offset `pos`; later errors are consequences of it
+ * The message is kept in the parser, so failing never allocates
+ * @return always null
  */
-static AST *parse_expr(Parser *p){
-    return parse_primary(p);
+static AST *fail_at(Parser *p, ParseError code, const char *msg, size_t pos){
+    if(!p->error_msg){
+        snprintf(p->error_text, sizeof(p->error_text), "%s", msg);
+        p->error_msg = p->error_text;
+        p->error_code = code;
+        p->error_pos = pos;
+    }
+
+    return NULL;
 }
 
 
 /**
- * Analyzes a "primary" element: a literal number or a function call
+ * `fail_at` the current token
+ * @return always null, so it can be used as `return fail(p, code, msg);`
  */
-static AST *parse_primary(Parser *p){
-    //Literal number
-    if(p->current.type == TOK_NUMBER){
-        AST *num = ast_make_number(p->current.lexeme);
-        advance(p);
-        return num;
-    }
-    else if(p->current.type == TOK_IDENT){  //Identifier
-        char *ident = strdup(p->current.lexeme);
-        advance(p);
+static AST *fail(Parser *p, ParseError code, const char *msg){
+    return fail_at(p, code, msg, p->current.pos);
+}
 
-        if(p->current.type != TOK_LPAREN){
-            if(!p->error_msg){
-                p->error_msg = strdup("Expected '(' after identifier");
-            }
 
-            free(ident);
+/**
+ * Pushes a frame for a function call whose '(' has just been consumed
+ * The frame stack lives on the heap and is kept between parses, so the nesting depth
+ * is limited only by memory
+ * @param pos: offset of the name of the function
+ * @return the new frame, or null if memory allocation fails
+ */
+static ParseFrame *push_frame(Parser *p, OpType op, size_t pos){
+    if(p->depth == p->frame_cap){
+        size_t cap = p->frame_cap ? p->frame_cap * 2 : 64;
+        stats_note_alloc(cap * sizeof(ParseFrame));
+        ParseFrame *frames = realloc(p->frames, cap * sizeof(ParseFrame));
+
+        if(!frames){
             return NULL;
         }
 
-        advance(p); //Consume '('
+        p->frames = frames;
+        p->frame_cap = cap;
+    }
 
-        AST *args[3] = {NULL, NULL, NULL};
-        int arg_count = 0;
+    ParseFrame *f = &p->frames[p->depth++];
+    f->op = op;
+    f->arg_count = 0;
+    f->pos = pos;
 
-        while(p->current.type != TOK_RPAREN && arg_count < 3){
-            AST *arg = parse_expr(p);
+    return f;
+}
 
-            if(!arg){
-                free(ident);
-                for(int i = 0; i < arg_count; i++){
-                    ast_free(args[i]);
-                }
-                
-                return NULL;
-            }
 
-            args[arg_count++] = arg;
+/**
+ * Builds the node of a function call once its ')' has been consumed
+ * Checks the number of arguments against the operator
+ */
+static AST *reduce_call(Parser *p, const ParseFrame *f){
+    //Special case: ternary operator
+    if(f->op == OP_TERN){
+        if(f->arg_count != 3){
+            return fail_at(p, PARSE_ERR_ARITY, "Ternaty operator requires 3 arguments", f->pos);
+        }
 
-            if(p->current.type == TOK_COMMA){
-                advance(p);
-            }
-            else if(p->current.type != TOK_RPAREN){
-                if(!p->error_msg){
-                    p->error_msg = strdup("Expected ',' or ')'");
-                }
+        return p->dag ? ast_cons_ternary(&p->cons, &p->arena, f->args[0], f->args[1], f->args[2])
+                      : ast_make_ternary(&p->arena, f->args[0], f->args[1], f->args[2]);
+    }
+    else if(f->op != (OpType)-1){  //Binary operators
+        if(f->arg_count != 2){
+            return fail_at(p, PARSE_ERR_ARITY, "Binary opertor requres 2 arguments", f->pos);
+        }
 
-                free(ident);
-                
-                for(int i = 0; i < arg_count; i++){
-                    ast_free(args[i]);
-                }
+        //Chains of `add`/`mul` are flattened, except in a DAG, whose nodes never change
+        return p->dag ? ast_cons_binary(&p->cons, &p->arena, f->op, f->args[0], f->args[1])
+                      : ast_chain(&p->arena, f->op, f->args[0], f->args[1]);
+    }
+    else{
+        return fail_at(p, PARSE_ERR_UNKNOWN_FUNCTION, "Unknown function", f->pos);
+    }
+}
 
-                return NULL;
+
+/**
+ * Analyzes a generic expression: a literal number, a variable or a function call
+ * `<expr> ::= <number> | <ident> | <ident> '(' <expr> [',' <expr>]* ')'`
+ * A name is a variable unless it is followed by '('; the names of the functions are
+ * reserved
+ *
+ * The analysis is iterative: every open call is a `ParseFrame` on an explicit stack that
+ * collects its arguments, instead of a level of recursion, so deep inputs cannot
+ * overflow the machine stack
+ */
+static AST *parse_expr(Parser *p){
+    AST *node;
+
+    while(1){
+        //A "primary" element: a literal number, a variable or a function call
+        if(p->current.type == TOK_NUMBER){
+            const char *text = lexer_text(p->lexer, &p->current);
+
+            node = p->dag ? ast_cons_number(&p->cons, &p->arena, text, p->current.len)
+                          : ast_make_number(&p->arena, text, p->current.len);
+            advance(p);
+
+            if(!node){
+                return fail(p, PARSE_ERR_NO_MEMORY, "Out of memory");
             }
         }
+        else if(p->current.type == TOK_OP || p->current.type == TOK_IDENT){  //Function call or variable
+            Token name = p->current;
+            OpType op = name.op;    //(OpType)-1 for an unknown name
+            advance(p);
 
-        if(p->current.type != TOK_RPAREN){
-            if(!p->error_msg){
-                p->error_msg = strdup("Expected ')'");
-            }
+            if(p->current.type != TOK_LPAREN && name.type == TOK_IDENT){
+                const char *text = lexer_text(p->lexer, &name);
 
-            free(ident);
+                node = p->dag ? ast_cons_var(&p->cons, &p->arena, text, name.len)
+                              : ast_make_var(&p->arena, text, name.len);
 
-            for(int i = 0; i < arg_count; i++){
-                ast_free(args[i]);
+                if(!node){
+                    return fail(p, PARSE_ERR_NO_MEMORY, "Out of memory");
+                }
             }
+            else if(p->current.type != TOK_LPAREN){
+                return fail(p, PARSE_ERR_EXPECTED_LPAREN, "Expected '(' after identifier");
+            }
+            else{
 
-            return NULL;
-        }
-
-        advance(p); //Consume ')'
+                advance(p); //Consume '('
 
-        OpType op = get_op_from_ident(ident);
-        free(ident);
-        
-        //Special case: ternary operator
-        if(op == OP_TERN){
-            if(arg_count != 3){
-                if(!p->error_msg){
-                    p->error_msg = strdup("Ternaty operator requires 3 arguments");
+                if(!push_frame(p, op, name.pos)){
+                    return fail(p, PARSE_ERR_NO_MEMORY, "Out of memory");
                 }
 
-                for(int i = 0; i < arg_count; i++){
-                    ast_free(args[i]);
+                //A call without arguments is closed right away
+                if(p->current.type != TOK_RPAREN){
+                    continue;
                 }
 
-                return NULL;
+                node = NULL;
             }
-
-            return ast_make_ternary(args[0], args[1], args[2]);
         }
-        else if(op != (OpType)-1){  //Binary operators
-            if(arg_count != 2){
-                if(!p->error_msg){
-                    p->error_msg = strdup("Binary opertor requres 2 arguments");
+        else{   //Neither a number nor identifier
+            return fail(p, PARSE_ERR_EXPECTED_OPERAND, "Expected number or function call");
+        }
+
+        //Hands the finished node to the enclosing calls, closing the ones that end here
+        while(1){
+            ParseFrame *f;
+
+            if(node){
+                if(p->depth == 0){
+                    return node;
                 }
 
-                for(int i = 0; i < arg_count; i++){
-                    ast_free(args[i]);
+                f = &p->frames[p->depth - 1];
+                f->args[f->arg_count++] = node;
+
+                if(p->current.type == TOK_COMMA){
+                    advance(p);
+                }
+                else if(p->current.type != TOK_RPAREN){
+                    return fail(p, PARSE_ERR_EXPECTED_SEPARATOR, "Expected ',' or ')'");
                 }
+            }
+            else{
+                f = &p->frames[p->depth - 1];
+            }
 
-                return NULL;
+            //Up to three arguments are read before the call must be closed
+            if(p->current.type != TOK_RPAREN && f->arg_count < 3){
+                break;
             }
 
-            return ast_make_binary(op, args[0], args[1]);
-        }
-        else{
-            if(!p->error_msg){
-                p->error_msg = strdup("Unknown function");
+            if(p->current.type != TOK_RPAREN){
+                return fail(p, PARSE_ERR_EXPECTED_RPAREN, "Expected ')'");
             }
 
-            for(int i = 0; i < arg_count; i++){
-                ast_free(args[i]);
+            advance(p); //Consume ')'
+
+            node = reduce_call(p, f);
+            p->depth--;
+
+            if(!node){
+                return NULL;
             }
+        }
+    }
+}
 
-            return NULL;
+
+/**
+ * Flat counterpart of `reduce_call`: checks the arguments of the call whose node is just
+ * before its first argument and stores the indices of its other operands
+ * @return 0 on success, -1 on error
+ */
+static int reduce_flat(Parser *p, const ParseFrame *f, FlatTree *t){
+    FlatNode *n = &t->nodes[f->starts[0] - 1];
+
+    if(f->op == OP_TERN){
+        if(f->arg_count != 3){
+            fail_at(p, PARSE_ERR_ARITY, "Ternaty operator requires 3 arguments", f->pos);
+            return -1;
         }
+
+        n->a = f->starts[1];
+        n->b = f->starts[2];
     }
-    else{   //Neither a number nor identifier
-        if(!p->error_msg){
-            p->error_msg = strdup("Expected number or function call");
+    else if(f->op != (OpType)-1){
+        if(f->arg_count != 2){
+            fail_at(p, PARSE_ERR_ARITY, "Binary opertor requres 2 arguments", f->pos);
+            return -1;
         }
 
-        return NULL;
+        n->b = f->starts[1];
+    }
+    else{
+        fail_at(p, PARSE_ERR_UNKNOWN_FUNCTION, "Unknown function", f->pos);
+        return -1;
     }
+
+    return 0;
 }
 
 
 /**
- * Translates a function name into its corresponding operation type
+ * Analyzes the expression into a flat tree (see flat.h)
+ *
+ * Same grammar, same iteration and same errors as `parse_expr`, but in preorder: the node
+ * of a call is appended when its name is read, before its arguments, and the indices of
+ * its operands are filled in when it is closed
+ *
+ * @return 0 on success, -1 on error
  */
-static OpType get_op_from_ident(const char *ident){
-    if(strcmp(ident, "add") == 0){
-        return OP_ADD;
-    }
+static int parse_flat(Parser *p, FlatTree *t){
+    while(1){
+        ParseFrame *top = p->depth > 0 ? &p->frames[p->depth - 1] : NULL;
+        int done;   //A whole argument has just been appended
 
-    if(strcmp(ident, "sub") == 0){
-        return OP_SUB;
-    }
+        if(top && top->arg_count < 3){
+            top->starts[top->arg_count] = (uint32_t)t->len;
+        }
 
-    if(strcmp(ident, "mul") == 0){
-        return OP_MUL;
-    }
+        if(p->current.type == TOK_NUMBER){
+            int rc = flat_add_number(t, lexer_text(p->lexer, &p->current), p->current.len);
+            advance(p);
 
-    if(strcmp(ident, "div") == 0){
-        return OP_DIV;
-    }
+            if(rc != 0){
+                fail(p, PARSE_ERR_NO_MEMORY, "Out of memory");
+                return -1;
+            }
 
-    if(strcmp(ident, "mod") == 0){
-        return OP_MOD;
-    }
+            done = 1;
+        }
+        else if(p->current.type == TOK_OP || p->current.type == TOK_IDENT){
+            Token name = p->current;
+            OpType op = name.op;
+            advance(p);
+
+            if(p->current.type != TOK_LPAREN && name.type == TOK_IDENT){
+                if(flat_add_var(t, lexer_text(p->lexer, &name), name.len) != 0){
+                    fail(p, PARSE_ERR_NO_MEMORY, "Out of memory");
+                    return -1;
+                }
 
-    if(strcmp(ident, "pow") == 0){
-        return OP_POW;
-    }
+                done = 1;
+            }
+            else if(p->current.type != TOK_LPAREN){
+                fail(p, PARSE_ERR_EXPECTED_LPAREN, "Expected '(' after identifier");
+                return -1;
+            }
+            else{
+                ParseFrame *f;
 
-    if(strcmp(ident, "tern") == 0){
-        return OP_TERN;
-    }
+                advance(p); //Consume '('
 
-    return -1;
-}
\ No newline at end of file
+                if(flat_add_op(t, op == (OpType)-1 ? OP_ADD : op) != 0 || !(f = push_frame(p, op, name.pos))){
+                    fail(p, PARSE_ERR_NO_MEMORY, "Out of memory");
+                    return -1;
+                }
+
+                f->starts[0] = (uint32_t)t->len;
+
+                if(p->current.type != TOK_RPAREN){
+                    continue;
+                }
+
+                done = 0;
+            }
+        }
+        else{
+            fail(p, PARSE_ERR_EXPECTED_OPERAND, "Expected number or function call");
+            return -1;
+        }
+
+        //Closes the calls that end here, as `parse_expr` does
+        while(1){
+            ParseFrame *f;
+
+            if(done){
+                if(p->depth == 0){
+                    return 0;
+                }
+
+                f = &p->frames[p->depth - 1];
+                f->arg_count++;
+
+                if(p->current.type == TOK_COMMA){
+                    advance(p);
+                }
+                else if(p->current.type != TOK_RPAREN){
+                    fail(p, PARSE_ERR_EXPECTED_SEPARATOR, "Expected ',' or ')'");
+                    return -1;
+                }
+            }
+            else{
+                f = &p->frames[p->depth - 1];
+            }
+
+            if(p->current.type != TOK_RPAREN && f->arg_count < 3){
+                break;
+            }
+
+            if(p->current.type != TOK_RPAREN){
+                fail(p, PARSE_ERR_EXPECTED_RPAREN, "Expected ')'");
+                return -1;
+            }
+
+            advance(p); //Consume ')'
+
+            if(reduce_flat(p, f, t) != 0){
+                return -1;
+            }
+
+            p->depth--;
+            done = 1;
+        }
+    }
+}
@@ -3,6 +3,8 @@
 
 #include "ast.h"
 #include "lexer.h"
+#include "arena.h"
+#include "flat.h"
 
 
 /**
@@ -13,9 +15,38 @@
  */
 typedef struct Parser Parser;
 
-Parser *parser_create(const char *input);   //We create a parser from the input with an internal lexer
-AST *parser_parse(Parser *p);   //NULL in any case of error
+
+/**
+ * Kind of the first error of an analysis, see `parser_error_code`
+ */
+typedef enum{
+    PARSE_OK,
+    PARSE_ERR_INVALID_CHARACTER,
+    PARSE_ERR_INVALID_NUMBER,
+    PARSE_ERR_UNCLOSED_COMMENT,
+    PARSE_ERR_EXPECTED_OPERAND,     //Expected number or function call
+    PARSE_ERR_EXPECTED_LPAREN,      //Expected '(' after identifier
+    PARSE_ERR_EXPECTED_SEPARATOR,   //Expected ',' or ')'
+    PARSE_ERR_EXPECTED_RPAREN,      //Expected ')' (too many arguments)
+    PARSE_ERR_TRAILING_TOKEN,       //Unexpected token after expression
+    PARSE_ERR_ARITY,                //Wrong number of arguments, at the name of the function
+    PARSE_ERR_UNKNOWN_FUNCTION,     //At the name of the function
+    PARSE_ERR_NO_MEMORY
+} ParseError;
+
+
+Parser *parser_create(const char *input, size_t len);   //We create a parser from the input with an internal lexer. The input must outlive the parsed tree
+void parser_reset(Parser *p, const char *input, size_t len);    //Reuses the parser (and its lexer) for a new input
+void parser_reset_range(Parser *p, const char *input, size_t start, size_t end);   //Analyzes input[start, end) next, keeping the arena
+AST *parser_parse(Parser *p);   //NULL in any case of error. The tree lives in the parser's arena until the next reset
+int parser_parse_flat(Parser *p, FlatTree *t);  //The same analysis into a compact tree: 0 on success, -1 on error
 const char *parser_error(Parser *p);
+ParseError parser_error_code(const Parser *p, size_t *offset);  //Kind and byte offset of the error of the last analysis
+void parser_set_dag(Parser *p, int dag);    //Shares repeated subtrees of the next trees (see ast.h)
+void parser_set_jobs(Parser *p, int jobs);  //Threads of the next `parser_parse` calls on large inputs (see pparse.h)
+void parser_set_pipeline(Parser *p, int on);    //Lexes the next inputs on a thread ahead of the parser (see tokring.h)
+int parser_reserve(Parser *p, size_t depth); //Sizes the stack for `depth` nested calls: 0, -1 if memory allocation fails
+Arena *parser_arena(Parser *p); //The arena of the parsed trees, for nodes added by rewrites
 void parser_destroy(Parser *p);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,460 @@
+#include "passes.h"
+#include "stats.h"
+#include "buffer.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * A pass rewrites one node whose operands were already rewritten
+ * @return the node that replaces `a` (`a` itself if nothing changes), or null if memory
+ *         allocation fails
+ */
+typedef AST *(*PassFn)(AST *a, Arena *arena);
+
+typedef struct{
+    const char *name;
+    unsigned flag;
+    PassFn apply;
+} Pass;
+
+
+/**
+ * Whether `a` is the number `v`
+ */
+static int is_value(const AST *a, double v){
+    return a->type == NODE_NUMBER && a->num_value == v;
+}
+
+
+/**
+ * Whether an annihilator may drop the operand `a`: only a finite literal or a variable.
+ * Any other operand may hold a division or modulo by zero, or produce an infinity or a
+ * NaN, which are left for the evaluation to report
+ */
+static int droppable(const AST *a){
+    return (a->type == NODE_NUMBER && isfinite(a->num_value)) || a->type == NODE_VAR;
+}
+
+
+/**
+ * Creates a number node whose text is the shortest form of `v` (see `buffer_put_double`)
+ */
+static AST *make_literal(Arena *arena, double v){
+    Buffer b;
+    AST *a = NULL;
+
+    buffer_init(&b);
+
+    if(buffer_put_double(&b, v) == 0){
+        char *text = arena_strndup(arena, b.data, b.len);
+        a = text ? ast_make_number(arena, text, b.len) : NULL;
+    }
+
+    buffer_free(&b);
+
+    return a;
+}
+
+
+/**
+ * Constant folding of the binary operations
+ */
+static AST *pass_fold(AST *a, Arena *arena){
+    if(a->op == OP_TERN || a->left->type != NODE_NUMBER || a->right->type != NODE_NUMBER){
+        return a;
+    }
+
+    double l = a->left->num_value;
+    double r = a->right->num_value;
+    double v;
+
+    switch (a->op){
+        case OP_ADD:
+            v = l + r;
+            break;
+        case OP_SUB:
+            v = l - r;
+            break;
+        case OP_MUL:
+            v = l * r;
+            break;
+        case OP_DIV:
+            v = l / r;
+            break;
+        case OP_MOD:
+            v = fmod(l, r);
+            break;
+        case OP_POW:
+            v = pow(l, r);
+            break;
+        default:
+            return a;
+    }
+
+    //Errors are left for the evaluation to report
+    if((a->op == OP_DIV || a->op == OP_MOD) && r == 0.0){
+        return a;
+    }
+
+    if(!isfinite(v)){
+        return a;
+    }
+
+    return make_literal(arena, v);
+}
+
+
+/**
+ * Identities and annihilators; the surviving operand is reused, so its text is kept
+ */
+static AST *pass_identity(AST *a, Arena *arena){
+    AST *l = a->left;
+    AST *r = a->right;
+
+    switch (a->op){
+        case OP_ADD:
+            return is_value(r, 0) ? l : is_value(l, 0) ? r : a;
+        case OP_SUB:
+            return is_value(r, 0) ? l : a;
+        case OP_MUL:
+            if((is_value(l, 0) && droppable(r)) || is_value(r, 1)){
+                return l;
+            }
+
+            return (is_value(r, 0) && droppable(l)) || is_value(l, 1) ? r : a;
+        case OP_DIV:
+            return is_value(r, 1) ? l : a;
+        case OP_POW:
+            if(is_value(r, 1) || (is_value(l, 1) && droppable(r))){
+                return l;
+            }
+
+            return is_value(r, 0) && droppable(l) ? ast_make_number(arena, "1", 1) : a;
+        case OP_MOD:
+        case OP_TERN:
+            break;
+    }
+
+    return a;
+}
+
+
+/**
+ * A ternary operator with a numeric condition becomes the selected branch
+ */
+static AST *pass_tern(AST *a, Arena *arena){
+    (void)arena;
+
+    if(a->op != OP_TERN || a->left->type != NODE_NUMBER){
+        return a;
+    }
+
+    return a->left->num_value != 0.0 ? a->middle : a->right;
+}
+
+
+/**
+ * The passes in the order they are applied to every node
+ */
+static const Pass passes[] = {
+    {"fold", PASS_FOLD, pass_fold},
+    {"identity", PASS_IDENTITY, pass_identity},
+    {"tern", PASS_TERN, pass_tern},
+};
+
+#define NPASSES (sizeof(passes) / sizeof(passes[0]))
+
+
+/**
+ * Parses a comma-separated list of pass names
+ * @param list: e.g. "fold,tern"; "all" enables every pass and "none" none of them
+ * @param flags: receives the PASS_* flags
+ * @return 0 on success, -1 if a name is unknown
+ */
+int passes_parse(const char *list, unsigned *flags){
+    *flags = 0;
+
+    while(*list){
+        size_t len = strcspn(list, ",");
+        size_t i;
+
+        if(len == 3 && strncmp(list, "all", 3) == 0){
+            *flags |= PASS_ALL;
+        }
+        else if(!(len == 4 && strncmp(list, "none", 4) == 0)){
+            for(i = 0; i < NPASSES; i++){
+                if(strlen(passes[i].name) == len && strncmp(list, passes[i].name, len) == 0){
+                    *flags |= passes[i].flag;
+                    break;
+                }
+            }
+
+            if(i == NPASSES){
+                return -1;
+            }
+        }
+
+        list += len;
+        list += *list == ',';
+    }
+
+    return 0;
+}
+
+
+/**
+ * Runs the enabled passes on one operation whose operands were already rewritten
+ * @return what replaces `a` (`a` itself if nothing changes), or null if memory
+ *         allocation fails
+ */
+static AST *rewrite(AST *a, unsigned flags, Arena *arena){
+    for(size_t i = 0; i < NPASSES; i++){
+        if(flags & passes[i].flag){
+            AST *b = passes[i].apply(a, arena);
+
+            //A replaced node is not given to the following passes
+            if(b != a){
+                return b;
+            }
+        }
+    }
+
+    return a;
+}
+
+
+/**
+ * Rewrites a chain (see ast.h) as the binary links it stands for, innermost first: each
+ * link is given to the passes with its operand from the chain and, on the other side, the
+ * operands kept so far, which a stand-in node represents while there are several of them.
+ * An operand whose link is left alone stays in the chain; a link replaced by its inner
+ * side drops the operand, and one replaced by anything else leaves only the replacement
+ *
+ * @return what replaces the chain (itself, shortened, or the only operand left), or null
+ *         if memory allocation fails
+ */
+static AST *rewrite_chain(AST *a, unsigned flags, Arena *arena){
+    AST inner = *a;     //The inner links, while more than one operand is kept
+    AST link = {.type = NODE_OP, .op = a->op};
+    AST **args = a->args;
+    size_t n = a->count;
+    size_t kept = 1;    //Operands kept: args[0, kept) left-nested, args[n - kept, n) right-nested
+
+    for(size_t k = 1; k < n; k++){
+        AST **first = a->right_nested ? &args[n - 1] : &args[0];
+        AST *acc = kept == 1 ? *first : &inner;
+        AST *x = a->right_nested ? args[n - 1 - k] : args[k];
+
+        link.left = a->right_nested ? x : acc;
+        link.right = a->right_nested ? acc : x;
+
+        AST *b = rewrite(&link, flags, arena);
+
+        if(!b){
+            return NULL;
+        }
+
+        if(b == &link){
+            args[a->right_nested ? n - 1 - kept : kept] = x;
+            kept++;
+        }
+        else if(b != acc){
+            *first = b;
+            kept = 1;
+        }
+    }
+
+    if(kept == 1){
+        return a->right_nested ? args[n - 1] : args[0];
+    }
+
+    //The dropped slots become free room on the side of the chain that grows
+    a->args += a->right_nested ? n - kept : 0;
+    a->count = kept;
+    a->room += (uint32_t)(n - kept);
+
+    return a;
+}
+
+
+/**
+ * Whether `a` is a literal with a minus sign
+ * The base of a `pow` is printed without parentheses when it is a literal, so an operation
+ * there that becomes a negative literal is put back if the `pow` stays: `(0 - 3)^x` must
+ * not turn into `-3^x`, which reads as `-(3^x)`
+ */
+static int negative_literal(const AST *a){
+    return a->type == NODE_NUMBER && a->num_text[0] == '-';
+}
+
+
+/**
+ * A subtree waiting to be rewritten: `slot` is the pointer to it in its parent
+ * Its operands are pushed above it the first time it is seen
+ */
+typedef struct{
+    AST **slot;
+    int expanded;
+    int pow_base;   //The slot is the left operand of a `pow`
+    AST *base;      //For a `pow`: its left operand before it became a negative literal
+} PassTask;
+
+typedef struct{
+    PassTask *items;
+    size_t len;
+    size_t cap;
+    PassTask local[64];
+} PassStack;
+
+
+/**
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int push_task(PassStack *st, AST **slot, int pow_base){
+    if(st->len == st->cap){
+        size_t cap = st->cap * 2;
+        stats_note_alloc(cap * sizeof(PassTask));
+        PassTask *items = st->items == st->local ? malloc(cap * sizeof(PassTask))
+                                                 : realloc(st->items, cap * sizeof(PassTask));
+
+        if(!items){
+            return -1;
+        }
+
+        if(st->items == st->local){
+            memcpy(items, st->local, sizeof(st->local));
+        }
+
+        st->items = items;
+        st->cap = cap;
+    }
+
+    st->items[st->len].slot = slot;
+    st->items[st->len].expanded = 0;
+    st->items[st->len].pow_base = pow_base;
+    st->items[st->len].base = NULL;
+    st->len++;
+
+    return 0;
+}
+
+
+/**
+ * Remembers, in the task of a `pow` (the top of the stack once its left operand is done,
+ * the right one being done first), the operation `a` of its base that became the negative
+ * literal `b`, so that the `pow` can restore it if it is not itself rewritten
+ */
+static void note_base(PassStack *st, int pow_base, AST *a, AST *b){
+    if(pow_base && negative_literal(b)){
+        st->items[st->len - 1].base = a;
+    }
+}
+
+
+/**
+ * Runs the enabled passes over the whole tree
+ *
+ * The walk is post-order and iterative: a node is rewritten after its operands, so each
+ * pass sees simplified operands, and a node that a pass replaces is not given to the
+ * following passes (the replacement is an operand or a literal, already simplified)
+ * In a DAG (see ast.h), a shared node is rewritten once, however many parents it has
+ *
+ * @param root: the tree; it is modified in place
+ * @param flags: PASS_* flags of the passes to run
+ * @param arena: where new nodes and literal texts are allocated
+ * @return the new root, or null if memory allocation fails
+ */
+AST *passes_run(AST *root, unsigned flags, Arena *arena){
+    PassStack st;
+    AstMap rewritten;   //Shared node -> what replaces it
+    int rc = 0;
+
+    if(flags == 0){
+        return root;
+    }
+
+    ast_map_init(&rewritten);
+
+    st.items = st.local;
+    st.len = 0;
+    st.cap = sizeof(st.local) / sizeof(st.local[0]);
+
+    rc = push_task(&st, &root, 0);
+
+    while(st.len > 0 && rc == 0){
+        PassTask *t = &st.items[st.len - 1];
+        AST **slot = t->slot;
+        AST *a = *slot;
+
+        if(a->type == NODE_NUMBER || a->type == NODE_VAR){
+            st.len--;
+            continue;
+        }
+
+        AST *done = a->shared ? ast_map_get(&rewritten, a) : NULL;
+
+        //A shared node is rewritten once; its other parents get the same result
+        if(done){
+            *slot = done;
+            st.len--;
+            note_base(&st, t->pow_base, a, done);
+            continue;
+        }
+
+        if(!t->expanded && a->type == NODE_CHAIN){
+            t->expanded = 1;
+
+            for(size_t i = 0; i < a->count && rc == 0; i++){
+                rc = push_task(&st, &a->args[i], 0);
+            }
+
+            continue;
+        }
+
+        if(!t->expanded){
+            t->expanded = 1;
+            rc |= push_task(&st, &a->left, a->op == OP_POW);
+
+            if(a->middle){
+                rc |= push_task(&st, &a->middle, 0);
+            }
+
+            rc |= push_task(&st, &a->right, 0);
+            continue;
+        }
+
+        int pow_base = t->pow_base;
+        AST *base = t->base;
+
+        st.len--;
+
+        AST *b = a->type == NODE_CHAIN ? rewrite_chain(a, flags, arena) : rewrite(a, flags, arena);
+
+        //A `pow` that stays must not print a negative literal as its base
+        if(b == a && base && negative_literal(a->left)){
+            a->left = base;
+        }
+
+        if(!b){
+            rc = -1;
+        }
+        else{
+            *slot = b;
+            note_base(&st, pow_base, a, b);
+        }
+
+        if(a->shared && rc == 0){
+            rc = ast_map_put(&rewritten, a, *slot);
+        }
+    }
+
+    ast_map_free(&rewritten);
+
+    if(st.items != st.local){
+        free(st.items);
+    }
+
+    return rc == 0 ? root : NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef PASSES_H
+#define PASSES_H
+
+#include "ast.h"
+#include "arena.h"
+
+
+/**
+ * @file passes.h
+ * @brief Simplification passes over the AST, each of which can be enabled separately
+ *
+ * - fold: an operation whose operands are all numbers becomes a number (a division or
+ *   modulo by zero, or a result that is not finite, is left as it is)
+ * - identity: `x + 0`, `0 + x`, `x - 0`, `x * 1`, `1 * x`, `x / 1`, `x ^ 1` become `x`;
+ *   the annihilators `x * 0`, `0 * x`, `x ^ 0`, `1 ^ x` become a number, but only when `x`
+ *   is a finite literal or a variable: any other `x` is kept, since its evaluation may
+ *   fail (division or modulo by zero) or not be finite
+ * - tern: `tern(c, a, b)` with a numeric condition becomes the selected branch
+ *
+ * The passes rewrite the tree in place, bottom-up, in one iterative walk. New literals
+ * are formatted into the arena of the tree; every literal that is not folded keeps its
+ * original text. A DAG built by hash-consing is handled once per shared node, but the
+ * rewritten nodes are not shared again
+ */
+
+
+/**
+ * Flags of the passes, for `passes_run`
+ */
+enum{
+    PASS_FOLD = 1 << 0,
+    PASS_IDENTITY = 1 << 1,
+    PASS_TERN = 1 << 2,
+    PASS_ALL = PASS_FOLD | PASS_IDENTITY | PASS_TERN
+};
+
+int passes_parse(const char *list, unsigned *flags);   //"fold,tern", "all" or "none". 0 on success, -1 for an unknown name
+AST *passes_run(AST *root, unsigned flags, Arena *arena); //The new root; null if memory allocation fails
+
+#endif
@@ -0,0 +1,514 @@
+#include "pparse.h"
+#include "parser.h"
+#include "lexer.h"
+#include "scan.h"
+#include "stats.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+
+/**
+ * Pieces per thread: more pieces balance the load better, fewer cost less to join
+ */
+#define PPARSE_PIECES_PER_JOB 8
+
+/**
+ * Smallest piece: calls shorter than this are always parsed whole
+ */
+#define PPARSE_MIN_PIECE (64 * 1024)
+
+/**
+ * Only the calls at most this deep are split, which bounds the pre-scan to a fixed stack
+ * and the planning to as many levels of recursion
+ */
+#define PPARSE_MAX_SPLIT_DEPTH 48
+
+#define NONE ((size_t)-1)
+
+
+/**
+ * A call found by the pre-scan that is large enough to be split
+ */
+typedef struct{
+    size_t open, close;     //Offsets of its parentheses
+    size_t commas[2];       //Offsets of the commas between its arguments
+    int ncommas;            //3 means three or more: too many arguments
+    size_t depth;           //1 for the outermost call
+    size_t deepest;         //Depth of the deepest call nested in it
+    size_t child;           //First of its arguments that is a recorded call, NONE
+    size_t sibling;         //Next recorded argument of the same call, NONE
+} Call;
+
+
+/**
+ * A call that is still open during the pre-scan
+ */
+typedef struct{
+    size_t open;
+    size_t commas[2];
+    int ncommas;
+    size_t deepest;
+    size_t child;
+} OpenCall;
+
+
+/**
+ * Result of the pre-scan
+ */
+typedef struct{
+    Call *calls;
+    size_t len;
+    size_t cap;
+    size_t root;        //The outermost call, NONE if it is too small to be split
+    size_t max_depth;
+} Index;
+
+
+/**
+ * One node of the plan: a range of the input that holds one expression, which is either
+ * parsed whole or, if it is a split call, built from its arguments
+ */
+typedef struct Task{
+    size_t start, end;
+    const Call *call;       //Null for a piece parsed whole
+    size_t need;            //Nested calls a whole parse may have to keep open
+    struct Task *parent;
+    int slot;               //Index of this argument in `parent`
+    atomic_int pending;     //Arguments not built yet
+    AST *args[3];
+} Task;
+
+
+typedef struct{
+    const Index *index;
+    Task *tasks;
+    size_t ntasks;
+    Task **leaves;      //The pieces parsed whole
+    size_t nleaves;
+    int invalid;        //A call has too many arguments
+} Plan;
+
+
+/**
+ * State shared by the threads of one analysis
+ */
+typedef struct{
+    const Plan *plan;
+    const char *input;
+    size_t len;
+    Parser **parsers;
+    atomic_size_t next;     //Next leaf to parse
+    atomic_int failed;
+    AST *root;
+} Shared;
+
+
+typedef struct{
+    Shared *shared;
+    Parser *parser;     //Parses the pieces and owns the nodes this thread builds
+    Lexer *lexer;       //Checks the names of the split calls
+    pthread_t thread;
+} Worker;
+
+
+/**
+ * Appends a call to the index
+ * @return its index, or NONE if memory allocation fails
+ */
+static size_t add_call(Index *ix, const OpenCall *o, size_t close, size_t depth){
+    if(ix->len == ix->cap){
+        size_t cap = ix->cap ? ix->cap * 2 : 256;
+        stats_note_alloc(cap * sizeof(Call));
+        Call *calls = realloc(ix->calls, cap * sizeof(Call));
+
+        if(!calls){
+            return NONE;
+        }
+
+        ix->calls = calls;
+        ix->cap = cap;
+    }
+
+    Call *c = &ix->calls[ix->len];
+
+    c->open = o->open;
+    c->close = close;
+    c->commas[0] = o->commas[0];
+    c->commas[1] = o->commas[1];
+    c->ncommas = o->ncommas;
+    c->depth = depth;
+    c->deepest = o->deepest;
+    c->child = o->child;
+    c->sibling = NONE;
+
+    return ix->len++;
+}
+
+
+/**
+ * Pre-scan: follows the parentheses and commas outside comments and records the calls of
+ * at least `grain` bytes in the outer PPARSE_MAX_SPLIT_DEPTH levels, each one linked to
+ * the recorded calls among its arguments. Deeper calls only update the nesting depth
+ *
+ * @return 0 on success, -1 if the input cannot be one valid call (unbalanced parentheses,
+ *         a comma outside any call, an unclosed comment, a NUL byte, several outermost
+ *         calls) or if memory allocation fails
+ */
+static int prescan(const char *s, size_t len, size_t grain, Index *ix){
+    OpenCall open[PPARSE_MAX_SPLIT_DEPTH];
+    size_t depth = 0;
+    size_t outer = 0;
+    size_t pos = 0;
+
+    while((pos = scan_structural(s, pos, len)) < len){
+        switch(s[pos]){
+            case '(':
+                depth++;
+
+                if(depth > ix->max_depth){
+                    ix->max_depth = depth;
+                }
+
+                if(depth <= PPARSE_MAX_SPLIT_DEPTH){
+                    OpenCall *o = &open[depth - 1];
+
+                    o->open = pos;
+                    o->ncommas = 0;
+                    o->deepest = depth;
+                    o->child = NONE;
+                }
+                else if(open[PPARSE_MAX_SPLIT_DEPTH - 1].deepest < depth){
+                    open[PPARSE_MAX_SPLIT_DEPTH - 1].deepest = depth;
+                }
+
+                break;
+
+            case ',':
+                if(depth == 0){
+                    return -1;
+                }
+
+                if(depth <= PPARSE_MAX_SPLIT_DEPTH && open[depth - 1].ncommas < 3){
+                    OpenCall *o = &open[depth - 1];
+
+                    if(o->ncommas < 2){
+                        o->commas[o->ncommas] = pos;
+                    }
+
+                    o->ncommas++;
+                }
+
+                break;
+
+            case ')':
+                if(depth == 0){
+                    return -1;
+                }
+
+                if(depth <= PPARSE_MAX_SPLIT_DEPTH){
+                    OpenCall *o = &open[depth - 1];
+                    size_t id = NONE;
+
+                    if(pos - o->open >= grain && (id = add_call(ix, o, pos, depth)) == NONE){
+                        return -1;
+                    }
+
+                    if(depth > 1){
+                        OpenCall *parent = &open[depth - 2];
+
+                        if(parent->deepest < o->deepest){
+                            parent->deepest = o->deepest;
+                        }
+
+                        if(id != NONE){
+                            ix->calls[id].sibling = parent->child;
+                            parent->child = id;
+                        }
+                    }
+                    else{
+                        outer++;
+                        ix->root = id;
+                    }
+                }
+
+                depth--;
+                break;
+
+            case '/':
+                if(pos + 1 < len && s[pos + 1] == '*'){
+                    pos = scan_comment_end(s, pos + 2, len);
+
+                    if(pos >= len || s[pos] != '*'){
+                        return -1;
+                    }
+
+                    pos += 2;
+                    continue;
+                }
+
+                break;
+
+            default:    //NUL, where the lexer ends the input
+                return -1;
+        }
+
+        pos++;
+    }
+
+    return depth == 0 && outer == 1 ? 0 : -1;
+}
+
+
+/**
+ * Adds the task of the expression input[start, end) and, if it is a recorded call,
+ * the tasks of its arguments
+ * The recursion follows the recorded calls, so it is at most PPARSE_MAX_SPLIT_DEPTH deep
+ */
+static void plan(Plan *pl, size_t start, size_t end, size_t id, Task *parent, int slot, size_t need){
+    const Index *ix = pl->index;
+    Task *t = &pl->tasks[pl->ntasks++];
+
+    t->start = start;
+    t->end = end;
+    t->need = need;
+    t->parent = parent;
+    t->slot = slot;
+    t->call = NULL;
+
+    if(id == NONE){
+        pl->leaves[pl->nleaves++] = t;
+        return;
+    }
+
+    const Call *c = &ix->calls[id];
+
+    if(c->ncommas > 2){
+        pl->invalid = 1;
+        return;
+    }
+
+    size_t bounds[4] = {c->open, c->commas[0], c->commas[1], 0};
+
+    bounds[c->ncommas + 1] = c->close;
+    t->call = c;
+    atomic_init(&t->pending, c->ncommas + 1);
+
+    for(int i = 0; i <= c->ncommas && !pl->invalid; i++){
+        size_t a = bounds[i] + 1;
+        size_t b = bounds[i + 1];
+        size_t child = NONE;
+
+        for(size_t k = c->child; k != NONE; k = ix->calls[k].sibling){
+            if(ix->calls[k].open >= a && ix->calls[k].open < b){
+                child = k;
+            }
+        }
+
+        plan(pl, a, b, child, t, i, c->deepest - c->depth);
+    }
+}
+
+
+/**
+ * Builds the node of a split call from its arguments, after checking that its range
+ * holds only the name of a known function before the '(' and nothing after the ')'
+ * @return the node, or null on any error
+ */
+static AST *join(Worker *w, Task *t){
+    const Shared *sh = w->shared;
+    const Call *c = t->call;
+
+    lexer_reset(w->lexer, sh->input, c->open);
+    lexer_seek(w->lexer, t->start);
+
+    Token name = lexer_next(w->lexer);
+
+    if(name.type != TOK_OP || lexer_next(w->lexer).type != TOK_EOF){
+        return NULL;
+    }
+
+    lexer_reset(w->lexer, sh->input, t->end);
+    lexer_seek(w->lexer, c->close + 1);
+
+    if(lexer_next(w->lexer).type != TOK_EOF){
+        return NULL;
+    }
+
+    Arena *arena = parser_arena(w->parser);
+    int n = c->ncommas + 1;
+
+    if(name.op == OP_TERN){
+        return n == 3 ? ast_make_ternary(arena, t->args[0], t->args[1], t->args[2]) : NULL;
+    }
+
+    return n == 2 ? ast_chain(arena, name.op, t->args[0], t->args[1]) : NULL;
+}
+
+
+/**
+ * Hands a finished subtree to its call; the thread that delivers the last argument of a
+ * call joins it, and so on up the plan
+ * @return 0 on success, -1 if a join fails
+ */
+static int finish(Worker *w, Task *t, AST *ast){
+    while(t->parent){
+        Task *up = t->parent;
+
+        up->args[t->slot] = ast;
+
+        //The other arguments are still being built
+        if(atomic_fetch_sub(&up->pending, 1) != 1){
+            return 0;
+        }
+
+        if(!(ast = join(w, up))){
+            return -1;
+        }
+
+        t = up;
+    }
+
+    w->shared->root = ast;
+
+    return 0;
+}
+
+
+/**
+ * Thread body: parses the leaves in order of decreasing size until none is left
+ */
+static void *worker_main(void *arg){
+    Worker *w = arg;
+    Shared *sh = w->shared;
+    const Plan *pl = sh->plan;
+
+    while(!atomic_load(&sh->failed)){
+        size_t i = atomic_fetch_add(&sh->next, 1);
+
+        if(i >= pl->nleaves){
+            break;
+        }
+
+        Task *t = pl->leaves[i];
+        AST *ast = NULL;
+
+        if(parser_reserve(w->parser, t->need + 1) == 0){
+            parser_reset_range(w->parser, sh->input, t->start, t->end);
+            ast = parser_parse(w->parser);
+        }
+
+        if(!ast || finish(w, t, ast) != 0){
+            atomic_store(&sh->failed, 1);
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Orders the leaves by decreasing size, so that the largest ones start first
+ */
+static int larger_first(const void *a, const void *b){
+    const Task *x = *(Task *const *)a;
+    const Task *y = *(Task *const *)b;
+    size_t nx = x->end - x->start;
+    size_t ny = y->end - y->start;
+
+    return nx < ny ? 1 : nx > ny ? -1 : 0;
+}
+
+
+/**
+ * Analyzes `input` with `jobs` threads: the calling one and `jobs` - 1 new ones
+ *
+ * @param parsers: one parser per thread, whose arenas receive the nodes; they are left
+ *                 holding the tree (or the pieces of a failed attempt)
+ * @param jobs: number of threads
+ * @param input: the expression
+ * @param len: its length in bytes
+ * @return the tree, or null if the input is too small to be split, does not split, or
+ *         has any error; the caller then parses it sequentially
+ */
+AST *pparse_parse(Parser **parsers, int jobs, const char *input, size_t len){
+    if(jobs < 2 || len < PPARSE_MIN_INPUT){
+        return NULL;
+    }
+
+    size_t grain = len / ((size_t)jobs * PPARSE_PIECES_PER_JOB);
+    Index ix = {NULL, 0, 0, NONE, 0};
+    Plan pl = {&ix, NULL, 0, NULL, 0, 0};
+    Worker *workers = NULL;
+    AST *root = NULL;
+
+    if(grain < PPARSE_MIN_PIECE){
+        grain = PPARSE_MIN_PIECE;
+    }
+
+    if(prescan(input, len, grain, &ix) != 0 || ix.root == NONE){
+        free(ix.calls);
+        return NULL;
+    }
+
+    //Every recorded call has at most three arguments
+    size_t max_tasks = 1 + 3 * ix.len;
+
+    stats_note_alloc(max_tasks * sizeof(Task));
+    pl.tasks = malloc(max_tasks * sizeof(Task));
+    stats_note_alloc(max_tasks * sizeof(Task *));
+    pl.leaves = malloc(max_tasks * sizeof(Task *));
+    stats_note_alloc(jobs * sizeof(Worker));
+    workers = calloc((size_t)jobs, sizeof(Worker));
+
+    if(pl.tasks && pl.leaves && workers){
+        plan(&pl, 0, len, ix.root, NULL, 0, ix.max_depth);
+    }
+
+    if(pl.tasks && pl.leaves && workers && !pl.invalid && pl.nleaves > 1){
+        Shared sh = {.plan = &pl, .input = input, .len = len, .parsers = parsers, .root = NULL};
+        int started = 1;
+
+        atomic_init(&sh.next, 0);
+        atomic_init(&sh.failed, 0);
+        qsort(pl.leaves, pl.nleaves, sizeof(Task *), larger_first);
+
+        for(int i = 0; i < jobs; i++){
+            workers[i].shared = &sh;
+            workers[i].parser = parsers[i];
+
+            if(!(workers[i].lexer = lexer_create(input, len))){
+                atomic_store(&sh.failed, 1);
+            }
+        }
+
+        //Fewer threads than asked for only make the analysis slower
+        while(!atomic_load(&sh.failed) && started < jobs
+              && pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]) == 0){
+            started++;
+        }
+
+        worker_main(&workers[0]);
+
+        for(int i = 1; i < started; i++){
+            pthread_join(workers[i].thread, NULL);
+        }
+
+        if(!atomic_load(&sh.failed)){
+            root = sh.root;
+        }
+    }
+
+    for(int i = 0; workers && i < jobs; i++){
+        if(workers[i].lexer){
+            lexer_destroy(workers[i].lexer);
+        }
+    }
+
+    free(workers);
+    free(pl.leaves);
+    free(pl.tasks);
+    free(ix.calls);
+
+    return root;
+}
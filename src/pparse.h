@@ -0,0 +1,36 @@
+#ifndef PPARSE_H
+#define PPARSE_H
+
+#include "ast.h"
+#include "parser.h"
+#include <stddef.h>
+
+
+/**
+ * @file pparse.h
+ * @brief Parallel analysis of one large expression
+ *
+ * 1. A pre-scan (see `scan_structural`) follows the parentheses and commas of the input,
+ *    skipping comments, and records the calls that are large enough to be worth
+ *    splitting, with the commas that separate their arguments and the depth of their
+ *    deepest nested call. Unbalanced parentheses end the attempt before any parsing
+ * 2. Those calls are split into their arguments, down to pieces of about
+ *    len / (jobs * PPARSE_PIECES_PER_JOB) bytes, which are parsed concurrently, each
+ *    by the parser of one thread into that parser's arena, largest first
+ * 3. When the last argument of a split call is built, the thread that built it checks the
+ *    name of the call and its number of arguments and joins them under its `OpType`
+ *
+ * The tree is the one the sequential parser builds. Any error (of a piece, a name or the
+ * number of arguments) abandons the attempt: the caller then parses the input
+ * sequentially, which finds the same first error as without threads
+ */
+
+
+/**
+ * Inputs shorter than this are not split: threads would not pay for themselves
+ */
+#define PPARSE_MIN_INPUT (1 << 20)
+
+AST *pparse_parse(Parser **parsers, int jobs, const char *input, size_t len);   //Null if not split or on any error
+
+#endif
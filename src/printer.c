@@ -1,174 +1,850 @@
 #include "printer.h"
+#include "stats.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 
 /**
- * Recursive function to convert an AST subtree into a string.
- * It manages operator precedence and associativity to determine parentheses placement.
- * @param a: the current AST node
- * @param parent_prec: the precedence level of the parent operator
- * @param is_right_child: flag indicating if the current node is the right child of its parent
- * @return a dynamically allocated string representing the expression
+ * Size of the chunks in which `ast_fprint` writes the expression
  */
-static char *ast_to_string_rec(const AST *a, int parent_prec, int is_right_child);
+#define PRINT_CHUNK (64 * 1024)
 
+/**
+ * Pieces per thread of the parallel printer: more pieces balance the load better
+ */
+#define PRINT_PIECES_PER_JOB 8
 
 /**
- * Main entry function to convert the AST root into an infix string.
- * Starts the recursive process with the lowest parent precedence (0)
- * @param a: the root of the AST
- * @return a dynamically allocated string representing the full expression
+ * Results shorter than this are printed by one thread
  */
-char *ast_to_string(const AST *a){
-    return ast_to_string_rec(a, 0, 0);
-}
+#define PRINT_MIN_PARALLEL (1 << 20)
+
 
-static char *ast_to_string_rec(const AST *a, int parent_prec, int is_right_child){
-    
-    if(!a){
-        return strdup("");
+/**
+ * One pending piece of output of the iterative printer: either a subtree that still has
+ * to be printed in the context given by `parent_prec`/`is_right_child`, or a fixed text,
+ * or the end of the text of a shared node, which then goes into the memo, or the rest of
+ * a chain from its operand `next`
+ */
+typedef struct{
+    const AST *node;    //NULL for a fixed text
+    const char *text;
+    int parent_prec;
+    int is_right_child;
+    int memo_end;       //Set for the end of a shared node whose text starts at `start`
+    size_t start;
+    size_t next;        //Chains: operand to print next, `count` to close the inner links
+} PrintTask;
+
+
+/**
+ * Text of a shared node, printed once and then copied (see ast.h)
+ */
+typedef struct{
+    const char *text;
+    size_t len;
+} PrintMemo;
+
+
+/**
+ * State of the memo of shared nodes
+ * While the text of a shared node is being printed, the output buffer must keep it, so
+ * the streaming of the buffer is suspended (`sink` holds its sink)
+ */
+typedef struct{
+    AstMap texts;   //PrintMemo for every shared node already printed
+    Arena arena;    //Owns the PrintMemo and their texts
+    size_t open;    //Shared nodes being printed
+    FILE *sink;
+} PrintShared;
+
+
+/**
+ * Growable stack of pending print tasks
+ * It starts in a small array on the machine stack, enough for shallow trees, and moves
+ * to the heap the first time it has to grow
+ */
+typedef struct{
+    PrintTask *items;
+    size_t len;
+    size_t cap;
+    PrintTask local[64];
+} PrintStack;
+
+
+/**
+ * Pushes a pending subtree or text
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int push_task(PrintStack *st, const AST *node, const char *text, int parent_prec, int is_right_child){
+    if(st->len == st->cap){
+        size_t cap = st->cap * 2;
+        stats_note_alloc(cap * sizeof(PrintTask));
+        PrintTask *items = st->items == st->local ? malloc(cap * sizeof(PrintTask))
+                                                  : realloc(st->items, cap * sizeof(PrintTask));
+
+        if(!items){
+            return -1;
+        }
+
+        if(st->items == st->local){
+            memcpy(items, st->local, sizeof(st->local));
+        }
+
+        st->items = items;
+        st->cap = cap;
     }
 
-    if(a->type == NODE_NUMBER){
-        return strdup(a->num_text);
+    PrintTask *t = &st->items[st->len++];
+    t->node = node;
+    t->text = text;
+    t->parent_prec = parent_prec;
+    t->is_right_child = is_right_child;
+    t->memo_end = 0;
+    t->start = 0;
+    t->next = 0;
+
+    return 0;
+}
+
+
+/**
+ * Pushes the continuation of the chain `a` at its operand `next`, which prints the
+ * operator before that operand, the operand, and pushes the continuation after it, so
+ * that a chain takes one task whatever its length
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int push_chain(PrintStack *st, const AST *a, size_t next){
+    if(push_task(st, a, NULL, 0, 0) != 0){
+        return -1;
     }
 
-    const char *op_str = NULL;
-    int spaces = 1; //Flag to indicate if spaces should be place around the operator
+    st->items[st->len - 1].next = next;
+
+    return 0;
+}
+
+
+/**
+ * Whether operand `i` of a chain is printed where a right operand of the binary links it
+ * stands for would be (see ast.h): all but the first of a left-nested chain, only the
+ * last of a right-nested one
+ */
+static int chain_right(const AST *a, size_t i){
+    return a->right_nested ? i + 1 == a->count : i > 0;
+}
+
 
-    switch (a->op){
+/**
+ * Returns the operator symbol placed between the two operands, with its spacing
+ * (null for the ternary operator, which is printed as `?` and `:`)
+ */
+const char *ast_op_symbol(OpType op){
+    switch (op){
         case OP_ADD:
-            op_str = "+";
-            spaces = 1;
-            break;
+            return " + ";
         case OP_SUB:
-            op_str = "-";
-            spaces = 1;
-            break;
+            return " - ";
         case OP_MUL:
-            op_str = "*";
-            spaces = 1;
-            break;
+            return " * ";
         case OP_DIV:
-            op_str = "/";
-            spaces = 1;
-            break;
+            return " / ";
         case OP_MOD:
-            op_str = "%";
-            spaces = 1;
-            break;
-        case OP_POW:
-            op_str = "^";
-            spaces = 0;
-            break; 
-        case OP_TERN:   //Create a special handling
-            op_str = NULL;
+            return " % ";
+        case OP_POW:    //No spaces around the power operator
+            return "^";
+        case OP_TERN:   //Handled separately
             break;
     }
 
-    int my_prec = ast_prec(a);
-    int needs_parens = 0;
+    return NULL;
+}
+
+
+/**
+ * Decides whether an operator node must be wrapped in parentheses.
+ * It manages operator precedence and associativity to determine parentheses placement.
+ * Only the operator and its position are needed, so it can be decided before the
+ * operands are known
+ * @param op: the operator of the node
+ * @param parent_prec: the precedence level of the parent operator
+ * @param is_right_child: flag indicating if the current node is the right child of its parent
+ */
+int ast_op_needs_parens(OpType op, int parent_prec, int is_right_child){
+    int my_prec = ast_op_prec(op);
 
     //Precedence check
     if(my_prec < parent_prec){
-        needs_parens = 1;
+        return 1;
     }
+
     //Associativity check
-    else if(my_prec == parent_prec){
-        //Right-associative operators
-        if(ast_is_right_assoc(a->op)){
-            if(!is_right_child){
-                needs_parens = 1;
+    if(my_prec == parent_prec){
+        //Right-associative operators need them on the left, left-associative ones on the right
+        return ast_is_right_assoc(op) ? !is_right_child : is_right_child;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Length of the text that an operation writes around its operands: its parentheses, its
+ * operators and, in a right-nested chain, the parentheses of the inner links
+ */
+static size_t own_len(const AST *a, int parens){
+    size_t n = 2 * (size_t)parens;
+
+    if(a->op == OP_TERN){
+        return n + 2;   //'?' and ':'
+    }
+
+    size_t symbol = strlen(ast_op_symbol(a->op));
+
+    if(a->type != NODE_CHAIN){
+        return n + symbol;
+    }
+
+    return n + (a->count - 1) * symbol + (a->right_nested ? 2 * (a->count - 2) : 0);
+}
+
+
+/**
+ * Starts recording the text of a shared node: the output is kept in the buffer until the
+ * matching `memo_end`
+ */
+static void memo_begin(PrintShared *sh, Buffer *out){
+    if(sh->open++ == 0){
+        sh->sink = out->sink;
+        out->sink = NULL;
+    }
+}
+
+
+/**
+ * Stores the text of `node`, written to `out` from `start`, in the memo
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int memo_end(PrintShared *sh, const AST *node, Buffer *out, size_t start){
+    PrintMemo *memo = arena_alloc(&sh->arena, sizeof(PrintMemo));
+    char *text = memo ? arena_strndup(&sh->arena, out->data + start, out->len - start) : NULL;
+
+    if(--sh->open == 0){
+        out->sink = sh->sink;
+    }
+
+    if(!text){
+        return -1;
+    }
+
+    memo->text = text;
+    memo->len = out->len - start;
+
+    return ast_map_put(&sh->texts, node, memo);
+}
+
+
+/**
+ * Appends the infix form of an AST subtree to `out`.
+ * Every character of the result is written exactly once, so the total work is linear in
+ * the size of the output.
+ *
+ * The walk is iterative: the pieces that follow the current one (closing parenthesis,
+ * operator, right operand...) are pushed in reverse order on a heap stack, so the nesting
+ * depth is limited only by memory
+ *
+ * In a DAG (see ast.h), a shared node is printed once and its text is then copied, so
+ * the work is linear in the size of the output rather than in the number of paths
+ * @param root_prec, root_right: context of `root` (the precedence of its parent and
+ *                               whether it is a right operand; 0 and 0 for a whole tree)
+ * @return 0 on success, -1 if memory allocation (or the write of a streaming buffer) fails
+ */
+static int print_tree(const AST *root, int root_prec, int root_right, Buffer *out){
+    PrintStack st;
+    PrintShared sh;
+    int rc = 0;
+
+    ast_map_init(&sh.texts);
+    arena_init(&sh.arena, 0);
+    sh.open = 0;
+    sh.sink = NULL;
+
+    st.items = st.local;
+    st.len = 0;
+    st.cap = sizeof(st.local) / sizeof(st.local[0]);
+
+    if(root && push_task(&st, root, NULL, root_prec, root_right) != 0){
+        return -1;
+    }
+
+    while(st.len > 0 && rc == 0){
+        PrintTask t = st.items[--st.len];
+
+        if(t.memo_end){
+            rc = memo_end(&sh, t.node, out, t.start);
+            continue;
+        }
+
+        if(!t.node){
+            rc = buffer_puts(out, t.text);
+            continue;
+        }
+
+        const AST *a = t.node;
+        int parent_prec = t.parent_prec;
+        int is_right_child = t.is_right_child;
+
+        //The next operand of a chain, after its operator; the inner links of a right-nested
+        //chain open before their first operand and all close after its last one
+        if(t.next){
+            if(t.next == a->count){
+                for(size_t i = 2; i < a->count && rc == 0; i++){
+                    rc = buffer_putc(out, ')');
+                }
+
+                continue;
             }
+
+            rc |= buffer_puts(out, ast_op_symbol(a->op));
+
+            if(t.next + 1 < a->count){
+                rc |= push_chain(&st, a, t.next + 1);
+                rc |= a->right_nested ? buffer_putc(out, '(') : 0;
+            }
+
+            parent_prec = ast_op_prec(a->op);
+            is_right_child = chain_right(a, t.next);
+            a = a->args[t.next];
         }
-        //Left-associative operators
-        else{
-            if(is_right_child){
-                needs_parens = 1;
+
+        //Descends along the left operands, which are printed first
+        while((a->type == NODE_OP || a->type == NODE_CHAIN) && rc == 0){
+            int my_prec = ast_prec(a);
+            int parens = ast_op_needs_parens(a->op, parent_prec, is_right_child);
+            const PrintMemo *memo = a->shared ? ast_map_get(&sh.texts, a) : NULL;
+
+            //A shared node already printed: its text is copied, inside its own parentheses
+            if(memo){
+                rc |= parens ? buffer_putc(out, '(') : 0;
+                rc |= buffer_append(out, memo->text, memo->len);
+                rc |= parens ? buffer_putc(out, ')') : 0;
+                break;
+            }
+
+            if(parens){
+                rc |= push_task(&st, NULL, ")", 0, 0);
+            }
+
+            //The first time, its text is recorded when the task pushed here is reached
+            if(a->shared && (rc |= push_task(&st, a, NULL, 0, 0)) == 0){
+                st.items[st.len - 1].memo_end = 1;
+                st.items[st.len - 1].start = out->len + parens;
+                memo_begin(&sh, out);
+            }
+
+            //Special handling
+            if(a->type == NODE_CHAIN){
+                if(a->right_nested && a->count > 2){
+                    rc |= push_chain(&st, a, a->count);
+                }
+
+                rc |= push_chain(&st, a, 1);
+            }
+            else if(a->op == OP_TERN){
+                rc |= push_task(&st, a->right, NULL, my_prec, 1);
+                rc |= push_task(&st, NULL, ":", 0, 0);
+                rc |= push_task(&st, a->middle, NULL, my_prec, 0);
+                rc |= push_task(&st, NULL, "?", 0, 0);
+            }
+            else{
+                rc |= push_task(&st, a->right, NULL, my_prec, 1);
+                rc |= push_task(&st, NULL, ast_op_symbol(a->op), 0, 0);
+            }
+
+            if(parens){
+                rc |= buffer_putc(out, '(');
             }
+
+            a = a->type == NODE_CHAIN ? a->args[0] : a->left;
+            parent_prec = my_prec;
+            is_right_child = 0;
+        }
+
+        if(rc == 0 && (a->type == NODE_NUMBER || a->type == NODE_VAR)){
+            rc = buffer_append(out, a->num_text, a->num_len);
         }
     }
 
-    //Special handling
-    if(a->op == OP_TERN){
-        char *L = ast_to_string_rec(a->left, my_prec, 0);
-        char *M = ast_to_string_rec(a->middle, my_prec, 0);
-        char *R = ast_to_string_rec(a->right, my_prec, 1);
+    if(st.items != st.local){
+        free(st.items);
+    }
+
+    if(sh.open > 0){    //Stopped by an error: the buffer streams again
+        out->sink = sh.sink;
+    }
+
+    ast_map_free(&sh.texts);
+    arena_free(&sh.arena);
+
+    return rc == 0 ? 0 : -1;
+}
 
-        size_t len = strlen(L) + strlen(M) + strlen(R) + 2 + (needs_parens ? 2 : 0);    // '?' and ':' plus parentheses
-        char *res = malloc(len + 1);
 
-        if(!res){
-            free(L);
-            free(M);
-            free(R);
+/**
+ * Appends the infix form of the whole tree to `out`
+ * Starts with the lowest parent precedence (0)
+ * @param a: the root of the AST
+ * @param out: the buffer that receives the text (a streaming buffer writes as it goes)
+ * @return 0 on success, -1 on failure
+ */
+int ast_print(const AST *a, Buffer *out){
+    return print_tree(a, 0, 0, out);
+}
+
+
+/**
+ * One subtree of the parallel printer, with the context that decides its parentheses
+ * The top of the tree is split into pieces breadth-first: a split piece only writes its
+ * own parentheses and operators, its operands are the next pieces
+ */
+typedef struct{
+    const AST *node;
+    int parent_prec;
+    int is_right_child;
+    int split;          //Its operands are pieces of their own
+    size_t first;       //If split: index of its first operand, the others follow
+    size_t len;         //Length of its text
+    size_t offset;      //Where its text starts in the output
+} PrintPiece;
 
-            return strdup("");
+
+/**
+ * Work shared by the threads of one pass of the parallel printer
+ */
+typedef struct{
+    PrintPiece *pieces;
+    PrintPiece **order; //The pieces that are not split, in the order they are taken
+    size_t count;
+    char *base;         //Second pass: start of the output
+    int pass;           //1: measure, 2: print
+    atomic_size_t next;
+    atomic_int failed;
+} PrintJob;
+
+
+/**
+ * First pass: length of the text of a subtree, without writing it
+ * Walks the tree as `print_tree` does
+ * @return 0 on success, -1 if the tree has a shared node (whose text `print_tree`
+ *         memoizes instead) or if memory allocation fails
+ */
+static int measure_tree(const AST *root, int parent_prec, int is_right_child, size_t *len){
+    PrintStack st;
+    size_t n = 0;
+    int rc = 0;
+
+    st.items = st.local;
+    st.len = 0;
+    st.cap = sizeof(st.local) / sizeof(st.local[0]);
+
+    rc = push_task(&st, root, NULL, parent_prec, is_right_child);
+
+    while(st.len > 0 && rc == 0){
+        PrintTask t = st.items[--st.len];
+        const AST *a = t.node;
+
+        //The next operand of a chain, whose text was counted with the chain
+        if(t.next){
+            if(t.next + 1 < a->count){
+                rc |= push_chain(&st, a, t.next + 1);
+            }
+
+            t.parent_prec = ast_op_prec(a->op);
+            t.is_right_child = chain_right(a, t.next);
+            a = a->args[t.next];
+        }
+
+        //Descends along the left operands; the others are pushed
+        while((a->type == NODE_OP || a->type == NODE_CHAIN) && !a->shared && rc == 0){
+            int my_prec = ast_prec(a);
+
+            n += own_len(a, ast_op_needs_parens(a->op, t.parent_prec, t.is_right_child));
+
+            if(a->type == NODE_CHAIN){
+                rc |= push_chain(&st, a, 1);
+                a = a->args[0];
+            }
+            else{
+                if(a->op == OP_TERN){
+                    rc |= push_task(&st, a->middle, NULL, my_prec, 0);
+                }
+
+                rc |= push_task(&st, a->right, NULL, my_prec, 1);
+                a = a->left;
+            }
+
+            t.parent_prec = my_prec;
+            t.is_right_child = 0;
+        }
+
+        if(a->shared){
+            rc = -1;
+        }
+        else if(a->type == NODE_NUMBER || a->type == NODE_VAR){
+            n += a->num_len;
+        }
+    }
+
+    if(st.items != st.local){
+        free(st.items);
+    }
+
+    *len = n;
+
+    return rc == 0 ? 0 : -1;
+}
+
+
+/**
+ * Thread body of both passes: takes the pieces that are not split one at a time
+ */
+static void *print_worker(void *arg){
+    PrintJob *job = arg;
+
+    while(!atomic_load(&job->failed)){
+        size_t i = atomic_fetch_add(&job->next, 1);
+
+        if(i >= job->count){
+            break;
         }
 
-        if(needs_parens){
-            snprintf(res, len + 1, "(%s?%s:%s)", L, M, R);
+        PrintPiece *p = job->order[i];
+        int rc;
+
+        if(job->pass == 1){
+            rc = measure_tree(p->node, p->parent_prec, p->is_right_child, &p->len);
         }
         else{
-            snprintf(res, len + 1, "%s?%s:%s", L, M, R);
+            //Its exact slice of the output: the text can neither grow nor move
+            Buffer slice;
+
+            buffer_init_fixed(&slice, job->base + p->offset, p->len + 1);
+            rc = print_tree(p->node, p->parent_prec, p->is_right_child, &slice);
+            rc |= slice.len != p->len;
+        }
+
+        if(rc != 0){
+            atomic_store(&job->failed, 1);
         }
+    }
 
-        free(L);
-        free(M);
-        free(R);
+    return NULL;
+}
 
-        return res;
+
+/**
+ * Runs one pass on `jobs` threads, the calling one included
+ * @return 0 on success, -1 if a piece failed
+ */
+static int run_pass(PrintJob *job, int pass, int jobs){
+    stats_note_alloc(jobs * sizeof(pthread_t));
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    int started = 0;
+
+    job->pass = pass;
+    atomic_store(&job->next, 0);
+
+    //Fewer threads than asked for only make the pass slower
+    while(threads && started < jobs - 1 && pthread_create(&threads[started], NULL, print_worker, job) == 0){
+        started++;
     }
-    else{
-        char *L = ast_to_string_rec(a->left, my_prec, 0);
-        char *R = ast_to_string_rec(a->right, my_prec, 1);
 
-        size_t len;
-        char *res = NULL;
+    print_worker(job);
 
-        if(spaces){
-            len = strlen(L) + strlen(R) + strlen(op_str) + 2 + (needs_parens ? 2 : 0);  //Spaces around op, parenthese if needed
-            res = malloc(len + 1);
+    for(int i = 0; i < started; i++){
+        pthread_join(threads[i], NULL);
+    }
 
-            if(!res){
-                free(L);
-                free(R);
+    free(threads);
 
-                return strdup("");
-            }
+    return atomic_load(&job->failed) ? -1 : 0;
+}
 
-            if(needs_parens){
-                snprintf(res, len + 1, "(%s %s %s)", L, op_str, R);
-            }
-            else{
-                snprintf(res, len + 1, "%s %s %s", L, op_str, R);
+
+/**
+ * Orders pieces by decreasing length, so that the longest ones are printed first
+ */
+static int longer_first(const void *a, const void *b){
+    size_t x = (*(PrintPiece *const *)a)->len;
+    size_t y = (*(PrintPiece *const *)b)->len;
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+
+/**
+ * Number of operands of an operation
+ */
+static size_t operands(const AST *a){
+    return a->type == NODE_CHAIN ? a->count : a->op == OP_TERN ? 3 : 2;
+}
+
+
+/**
+ * Splits the top of the tree breadth-first into at least `want` pieces (fewer if the
+ * tree is smaller), and lists the ones that are not split in `order`
+ * A chain is split into its operands only if they fit in the `cap` pieces, so a long
+ * chain at the top stays one piece
+ * @return the number of pieces, 0 if the top of the tree has a shared node
+ */
+static size_t split_top(const AST *root, size_t want, size_t cap, PrintPiece *pieces, PrintPiece **order, size_t *count){
+    size_t n = 1;
+    size_t frontier = 1;
+
+    pieces[0] = (PrintPiece){.node = root};
+
+    for(size_t i = 0; i < n && frontier < want; i++){
+        PrintPiece *p = &pieces[i];
+        const AST *a = p->node;
+
+        if(a->shared){
+            return 0;
+        }
+
+        if((a->type != NODE_OP && a->type != NODE_CHAIN) || n + operands(a) > cap){
+            continue;
+        }
+
+        int my_prec = ast_prec(a);
+
+        p->split = 1;
+        p->first = n;
+
+        if(a->type == NODE_CHAIN){
+            for(size_t k = 0; k < a->count; k++){
+                pieces[n++] = (PrintPiece){.node = a->args[k], .parent_prec = my_prec, .is_right_child = chain_right(a, k)};
             }
+
+            frontier += a->count - 1;
+            continue;
         }
-        else{   //no spaces
-            len = strlen(L) + strlen(R) + strlen(op_str) + (needs_parens ? 2 : 0);
-            res = malloc(len + 1);
 
-            if(!res){
-                free(L);
-                free(R);
+        pieces[n++] = (PrintPiece){.node = a->left, .parent_prec = my_prec};
+
+        if(a->op == OP_TERN){
+            pieces[n++] = (PrintPiece){.node = a->middle, .parent_prec = my_prec};
+            frontier++;
+        }
+
+        pieces[n++] = (PrintPiece){.node = a->right, .parent_prec = my_prec, .is_right_child = 1};
+        frontier++;
+    }
 
-                return strdup("");
+    *count = 0;
+
+    for(size_t i = 0; i < n; i++){
+        if(!pieces[i].split){
+            order[(*count)++] = &pieces[i];
+        }
+    }
+
+    return n;
+}
+
+
+/**
+ * Appends the infix form of the whole tree to `out` with `jobs` threads
+ *
+ * Two passes over the pieces of the tree (see `split_top`): the first measures the text
+ * of every piece, from which the length and position of every split piece and of the
+ * whole result follow; the second prints every piece straight into its place in one
+ * buffer reserved for the whole result, so nothing is reallocated or copied
+ *
+ * The result is the one of `ast_print`, which is used instead for small results (under
+ * PRINT_MIN_PARALLEL bytes), for a single thread, and for DAGs, whose shared nodes it
+ * prints once. A tree shaped like a chain has few pieces of similar size, so it is
+ * printed mostly by one thread. A streaming buffer holds the whole result before it is
+ * written
+ *
+ * @param a: the root of the AST
+ * @param jobs: number of threads
+ * @param out: the buffer that receives the text
+ * @return 0 on success, -1 on failure
+ */
+int ast_print_parallel(const AST *a, int jobs, Buffer *out){
+    if(jobs < 2 || !a){
+        return print_tree(a, 0, 0, out);
+    }
+
+    size_t want = (size_t)jobs * PRINT_PIECES_PER_JOB;
+    size_t cap = 4 * want;     //Room for the operands of chains of a few operands
+    PrintJob job = {.count = 0};
+    size_t n = 0;
+    int rc = -1;
+
+    stats_note_alloc(cap * sizeof(PrintPiece));
+    job.pieces = malloc(cap * sizeof(PrintPiece));
+    stats_note_alloc(cap * sizeof(PrintPiece *));
+    job.order = malloc(cap * sizeof(PrintPiece *));
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, 0);
+
+    if(job.pieces && job.order){
+        n = split_top(a, want, cap, job.pieces, job.order, &job.count);
+    }
+
+    if(n > 1 && run_pass(&job, 1, jobs) == 0){
+        PrintPiece *pieces = job.pieces;
+
+        //Lengths of the split pieces: their operands come after them
+        for(size_t i = n; i-- > 0;){
+            PrintPiece *p = &pieces[i];
+
+            if(p->split){
+                const AST *node = p->node;
+
+                p->len = own_len(node, ast_op_needs_parens(node->op, p->parent_prec, p->is_right_child));
+
+                for(size_t k = 0; k < operands(node); k++){
+                    p->len += pieces[p->first + k].len;
+                }
             }
+        }
+
+        size_t total = pieces[0].len;
+
+        if(total < PRINT_MIN_PARALLEL){
+            rc = print_tree(a, 0, 0, out);
+        }
+        else if(buffer_reserve(out, total) == 0){
+            char *base = out->data + out->len;
+
+            //Places the pieces, and writes the text of the split ones, from the root down
+            pieces[0].offset = 0;
+
+            for(size_t i = 0; i < n; i++){
+                PrintPiece *p = &pieces[i];
+
+                if(!p->split){
+                    continue;
+                }
 
-            if(needs_parens){
-                snprintf(res, len + 1, "(%s^%s)", L, R);
+                const AST *node = p->node;
+                int parens = ast_op_needs_parens(node->op, p->parent_prec, p->is_right_child);
+                size_t pos = p->offset;
+
+                if(parens){
+                    base[pos++] = '(';
+                }
+
+                pieces[p->first].offset = pos;
+                pos += pieces[p->first].len;
+
+                if(node->type == NODE_CHAIN){
+                    const char *symbol = ast_op_symbol(node->op);
+                    size_t len = strlen(symbol);
+
+                    for(size_t k = 1; k < node->count; k++){
+                        memcpy(base + pos, symbol, len);
+                        pos += len;
+
+                        if(node->right_nested && k + 1 < node->count){
+                            base[pos++] = '(';
+                        }
+
+                        pieces[p->first + k].offset = pos;
+                        pos += pieces[p->first + k].len;
+                    }
+
+                    for(size_t k = 2; node->right_nested && k < node->count; k++){
+                        base[pos++] = ')';
+                    }
+                }
+                else if(node->op == OP_TERN){
+                    base[pos++] = '?';
+                    pieces[p->first + 1].offset = pos;
+                    pos += pieces[p->first + 1].len;
+                    base[pos++] = ':';
+                    pieces[p->first + 2].offset = pos;
+                    pos += pieces[p->first + 2].len;
+                }
+                else{
+                    const char *symbol = ast_op_symbol(node->op);
+                    size_t len = strlen(symbol);
+
+                    memcpy(base + pos, symbol, len);
+                    pos += len;
+                    pieces[p->first + 1].offset = pos;
+                    pos += pieces[p->first + 1].len;
+                }
+
+                if(parens){
+                    base[pos++] = ')';
+                }
             }
-            else{
-                snprintf(res, len + 1, "%s^%s", L, R);
+
+            qsort(job.order, job.count, sizeof(PrintPiece *), longer_first);
+            job.base = base;
+
+            if(run_pass(&job, 2, jobs) == 0){
+                out->len += total;
+                rc = 0;
             }
         }
+    }
+    else{
+        //Not split (a leaf, a shared node, no memory)
+        rc = print_tree(a, 0, 0, out);
+    }
+
+    free(job.pieces);
+    free(job.order);
+
+    return rc;
+}
 
-        free(L);
-        free(R);
 
-        return res;
+/**
+ * Writes the infix form of the whole tree to `f` in large chunks
+ * Only one chunk is held in memory, whatever the size of the expression
+ * @return 0 on success, -1 on failure
+ */
+int ast_fprint(const AST *a, FILE *f){
+    Buffer out;
+
+    if(buffer_init_sink(&out, f, PRINT_CHUNK) != 0){
+        return -1;
     }
+
+    int rc = ast_print(a, &out);
+
+    if(buffer_flush(&out, f) != 0){
+        rc = -1;
+    }
+
+    buffer_free(&out);
+
+    return rc;
 }
 
+
+/**
+ * Main entry function to convert the AST root into an infix string.
+ * @param a: the root of the AST
+ * @return a dynamically allocated string representing the full expression, or null
+ *         if memory allocation fails
+ */
+char *ast_to_string(const AST *a){
+    Buffer out;
+    buffer_init(&out);
+
+    if(ast_print(a, &out) != 0 || !buffer_cstr(&out)){
+        buffer_free(&out);
+        return NULL;
+    }
+
+    return out.data;    //The caller owns the buffer's memory
+}
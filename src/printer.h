@@ -2,14 +2,22 @@
 #define PRINTER_H
 
 #include "ast.h"
+#include "buffer.h"
+#include <stdio.h>
 
 
 /**
  * @file printer.h
- * @brief Defines the function to convert an AST back into a string representation 
+ * @brief Defines the functions to convert an AST back into a string representation
  */
 
 
-char *ast_to_string(const AST *a);
+int ast_print(const AST *a, Buffer *out);   //Appends the expression to `out`, 0 on success
+int ast_print_parallel(const AST *a, int jobs, Buffer *out);   //The same with `jobs` threads on large trees
+int ast_fprint(const AST *a, FILE *f);      //Streams the expression to `f`, 0 on success
+char *ast_to_string(const AST *a);          //Heap string owned by the caller, NULL on failure
 
-#endif
\ No newline at end of file
+const char *ast_op_symbol(OpType op);
+int ast_op_needs_parens(OpType op, int parent_prec, int is_right_child);
+
+#endif
@@ -0,0 +1,296 @@
+#include "scan.h"
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+
+/**
+ * Whitespace test shared by all the variants: ' ' or '\t'..'\r'
+ */
+static inline int is_space(unsigned char c){
+    return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+
+static size_t whitespace_scalar(const char *s, size_t pos, size_t len){
+    while(pos < len && is_space((unsigned char)s[pos])){
+        pos++;
+    }
+
+    return pos;
+}
+
+
+static size_t comment_end_scalar(const char *s, size_t pos, size_t len){
+    while(pos < len){
+        if(s[pos] == '\0' || (s[pos] == '*' && pos + 1 < len && s[pos + 1] == '/')){
+            return pos;
+        }
+
+        pos++;
+    }
+
+    return len;
+}
+
+
+/**
+ * Bytes that delimit the structure of an expression: calls, arguments and comments
+ */
+static inline int is_structural(unsigned char c){
+    return c == '(' || c == ')' || c == ',' || c == '/' || c == '\0';
+}
+
+
+static size_t structural_scalar(const char *s, size_t pos, size_t len){
+    while(pos < len && !is_structural((unsigned char)s[pos])){
+        pos++;
+    }
+
+    return pos;
+}
+
+
+#ifdef SCAN_X86
+
+/**
+ * SSE2 (always present on x86-64): 16 bytes per step
+ *
+ * Whitespace is `c == ' '` or `c - '\t' <= 4` (unsigned), which SSE2 expresses as
+ * `min(c - '\t', 4) == c - '\t'`
+ */
+static size_t whitespace_sse2(const char *s, size_t pos, size_t len){
+    //Most runs are a single space: do not pay for a vector load on them
+    if(pos < len && !is_space((unsigned char)s[pos])){
+        return pos;
+    }
+
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8('\r' - '\t');
+
+    while(pos + 16 <= len){
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + pos));
+        __m128i d = _mm_sub_epi8(v, tab);
+        __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(_mm_min_epu8(d, four), d));
+        unsigned other = ~(unsigned)_mm_movemask_epi8(ws) & 0xFFFF;
+
+        if(other){
+            return pos + __builtin_ctz(other);
+        }
+
+        pos += 16;
+    }
+
+    return whitespace_scalar(s, pos, len);
+}
+
+
+/**
+ * SSE2 search of the end of a comment: a byte is a candidate when it is '*' and the next
+ * one is '/', or when it is NUL
+ */
+static size_t comment_end_sse2(const char *s, size_t pos, size_t len){
+    const __m128i star = _mm_set1_epi8('*');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i zero = _mm_setzero_si128();
+
+    while(pos + 17 <= len){
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + pos));
+        __m128i next = _mm_loadu_si128((const __m128i *)(s + pos + 1));
+        __m128i hit = _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(v, star), _mm_cmpeq_epi8(next, slash)),
+                                   _mm_cmpeq_epi8(v, zero));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+
+        if(mask){
+            return pos + __builtin_ctz(mask);
+        }
+
+        pos += 16;
+    }
+
+    return comment_end_scalar(s, pos, len);
+}
+
+
+/**
+ * SSE2 search of the next structural byte: five comparisons per 16 bytes
+ */
+static size_t structural_sse2(const char *s, size_t pos, size_t len){
+    const __m128i lparen = _mm_set1_epi8('(');
+    const __m128i rparen = _mm_set1_epi8(')');
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i zero = _mm_setzero_si128();
+
+    while(pos + 16 <= len){
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + pos));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lparen), _mm_cmpeq_epi8(v, rparen)),
+                                   _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, slash)),
+                                                _mm_cmpeq_epi8(v, zero)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+
+        if(mask){
+            return pos + __builtin_ctz(mask);
+        }
+
+        pos += 16;
+    }
+
+    return structural_scalar(s, pos, len);
+}
+
+
+/**
+ * AVX2: the same tests as SSE2, 32 bytes per step
+ */
+__attribute__((target("avx2")))
+static size_t whitespace_avx2(const char *s, size_t pos, size_t len){
+    if(pos < len && !is_space((unsigned char)s[pos])){
+        return pos;
+    }
+
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i four = _mm256_set1_epi8('\r' - '\t');
+
+    while(pos + 32 <= len){
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + pos));
+        __m256i d = _mm256_sub_epi8(v, tab);
+        __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(_mm256_min_epu8(d, four), d));
+        unsigned other = ~(unsigned)_mm256_movemask_epi8(ws);
+
+        if(other){
+            return pos + __builtin_ctz(other);
+        }
+
+        pos += 32;
+    }
+
+    return whitespace_sse2(s, pos, len);
+}
+
+
+__attribute__((target("avx2")))
+static size_t comment_end_avx2(const char *s, size_t pos, size_t len){
+    const __m256i star = _mm256_set1_epi8('*');
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i zero = _mm256_setzero_si256();
+
+    while(pos + 33 <= len){
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + pos));
+        __m256i next = _mm256_loadu_si256((const __m256i *)(s + pos + 1));
+        __m256i hit = _mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi8(v, star), _mm256_cmpeq_epi8(next, slash)),
+                                      _mm256_cmpeq_epi8(v, zero));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+
+        if(mask){
+            return pos + __builtin_ctz(mask);
+        }
+
+        pos += 32;
+    }
+
+    return comment_end_sse2(s, pos, len);
+}
+
+
+__attribute__((target("avx2")))
+static size_t structural_avx2(const char *s, size_t pos, size_t len){
+    const __m256i lparen = _mm256_set1_epi8('(');
+    const __m256i rparen = _mm256_set1_epi8(')');
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i zero = _mm256_setzero_si256();
+
+    while(pos + 32 <= len){
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + pos));
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, lparen), _mm256_cmpeq_epi8(v, rparen)),
+                                      _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, comma), _mm256_cmpeq_epi8(v, slash)),
+                                                      _mm256_cmpeq_epi8(v, zero)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+
+        if(mask){
+            return pos + __builtin_ctz(mask);
+        }
+
+        pos += 32;
+    }
+
+    return structural_sse2(s, pos, len);
+}
+
+#endif
+
+
+size_t (*scan_whitespace)(const char *s, size_t pos, size_t len) = whitespace_scalar;
+size_t (*scan_comment_end)(const char *s, size_t pos, size_t len) = comment_end_scalar;
+size_t (*scan_structural)(const char *s, size_t pos, size_t len) = structural_scalar;
+
+static const char *selected = "scalar";
+
+
+/**
+ * Selects the implementation of the scans
+ * @param name: "scalar", "sse2" or "avx2"
+ * @return 0 on success, -1 if the variant is unknown or not supported by this CPU
+ */
+int scan_select(const char *name){
+    if(strcmp(name, "scalar") == 0){
+        scan_whitespace = whitespace_scalar;
+        scan_comment_end = comment_end_scalar;
+        scan_structural = structural_scalar;
+        selected = "scalar";
+
+        return 0;
+    }
+
+#ifdef SCAN_X86
+    if(strcmp(name, "sse2") == 0){
+        scan_whitespace = whitespace_sse2;
+        scan_comment_end = comment_end_sse2;
+        scan_structural = structural_sse2;
+        selected = "sse2";
+
+        return 0;
+    }
+
+    if(strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")){
+        scan_whitespace = whitespace_avx2;
+        scan_comment_end = comment_end_avx2;
+        scan_structural = structural_avx2;
+        selected = "avx2";
+
+        return 0;
+    }
+#endif
+
+    return -1;
+}
+
+
+/**
+ * Returns the name of the implementation in use
+ */
+const char *scan_selected(void){
+    return selected;
+}
+
+
+/**
+ * Picks the widest variant supported by the CPU before `main` runs, so the function
+ * pointers never change while threads are using them
+ */
+__attribute__((constructor))
+static void scan_init(void){
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+
+    if(scan_select("avx2") != 0){
+        scan_select("sse2");
+    }
+#endif
+}
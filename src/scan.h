@@ -0,0 +1,39 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+
+/**
+ * @file scan.h
+ * @brief Fast scanning of the parts of the input that produce no tokens (runs of
+ *        whitespace and the body of comments) and of the bytes that delimit calls
+ *
+ * On x86-64 the scans compare 16 (SSE2) or 32 (AVX2) bytes at a time; the widest
+ * variant supported by the CPU is picked when the program starts. The scalar code is
+ * the fallback for other machines
+ */
+
+
+/**
+ * Returns the first position >= `pos` that is not whitespace (' ', '\t', '\n', '\v', '\f',
+ * '\r'), or `len`
+ */
+extern size_t (*scan_whitespace)(const char *s, size_t pos, size_t len);
+
+/**
+ * Returns the position of the first "*\/" at or after `pos` (the index of its '*'), the
+ * position of the first NUL byte if that comes earlier, or `len` if there is neither
+ */
+extern size_t (*scan_comment_end)(const char *s, size_t pos, size_t len);
+
+/**
+ * Returns the position of the first '(', ')', ',', '/' or NUL byte at or after `pos`, or
+ * `len`; used to find the calls and arguments of an expression without lexing it
+ */
+extern size_t (*scan_structural)(const char *s, size_t pos, size_t len);
+
+int scan_select(const char *name);     //Forces "scalar", "sse2" or "avx2"; -1 if not available here
+const char *scan_selected(void);       //Name of the variant in use
+
+#endif
@@ -0,0 +1,836 @@
+#include "server.h"
+#include "expr.h"
+#include "buffer.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+
+/**
+ * Requests of one connection that may be in flight (read but not yet answered); the
+ * reader of a connection waits when it has this many
+ */
+#define SERVER_WINDOW 64
+
+/**
+ * Largest request accepted; a longer one closes the connection
+ */
+#define SERVER_MAX_FRAME (64u << 20)
+
+/**
+ * Size of the read buffer of a connection, which holds many small frames at once
+ */
+#define SERVER_READ_CHUNK (64 * 1024)
+
+/**
+ * Status byte and error offset at the start of the payload of a response
+ */
+#define RESPONSE_HEADER 5
+
+
+typedef struct Conn Conn;
+
+
+/**
+ * One request of a connection, from the moment it is read until its response is written
+ * A connection has SERVER_WINDOW slots, used in turn: request `seq` takes slot
+ * `seq % SERVER_WINDOW`, which is free because at most SERVER_WINDOW requests are in
+ * flight. Its buffers are kept, so a warm connection allocates nothing per request
+ */
+typedef struct Slot{
+    Conn *conn;
+    struct Slot *next;  //Queue of the workers
+    unsigned flags;
+    Buffer request;     //The expression
+    Buffer response;    //The whole response frame
+    char oom[4 + RESPONSE_HEADER + 1];  //Storage of the frame sent when the response cannot be built
+    int ready;          //The response can be written
+} Slot;
+
+
+/**
+ * Buffered reader of frames
+ */
+typedef struct{
+    int fd;
+    size_t start, end;
+    char buf[SERVER_READ_CHUNK];
+} Reader;
+
+
+/**
+ * The worker pool and its queue of requests, shared by all the connections
+ */
+typedef struct{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Slot *head, *tail;
+    int stop;
+    unsigned flags;
+} Server;
+
+
+struct Conn{
+    Server *server;
+    int out;
+    Reader reader;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;   //A response is ready, or the input ended
+    pthread_cond_t space;   //A response was written
+    size_t admitted;        //Requests read
+    size_t written;         //Responses written (or dropped after a write error)
+    int eof;
+    int broken;
+
+    Slot slots[SERVER_WINDOW];
+};
+
+
+/**
+ * One thread of the pool, with its own context
+ */
+typedef struct{
+    Server *server;
+    ExprContext *ctx;
+    pthread_t thread;
+} Worker;
+
+
+static void put_u32(char *p, uint32_t v){
+    p[0] = (char)(v & 0xFF);
+    p[1] = (char)((v >> 8) & 0xFF);
+    p[2] = (char)((v >> 16) & 0xFF);
+    p[3] = (char)(v >> 24);
+}
+
+
+static uint32_t get_u32(const char *p){
+    const unsigned char *u = (const unsigned char *)p;
+
+    return (uint32_t)u[0] | (uint32_t)u[1] << 8 | (uint32_t)u[2] << 16 | (uint32_t)u[3] << 24;
+}
+
+
+/**
+ * Reads exactly `n` bytes
+ * @return 0 on success, 1 if the input ends before the first byte, -1 on a read error or
+ *         if it ends in the middle
+ */
+static int read_exact(Reader *r, char *dst, size_t n){
+    size_t got = 0;
+
+    while(got < n){
+        if(r->start == r->end){
+            ssize_t k;
+
+            //A large remainder is read directly, without going through the buffer
+            if(n - got >= sizeof(r->buf)){
+                k = read(r->fd, dst + got, n - got);
+            }
+            else{
+                k = read(r->fd, r->buf, sizeof(r->buf));
+                r->start = 0;
+                r->end = k > 0 ? (size_t)k : 0;
+            }
+
+            if(k < 0 && errno == EINTR){
+                continue;
+            }
+
+            if(k <= 0){
+                return k == 0 && got == 0 ? 1 : -1;
+            }
+
+            if(n - got >= sizeof(r->buf)){
+                got += (size_t)k;
+            }
+
+            continue;
+        }
+
+        size_t take = r->end - r->start < n - got ? r->end - r->start : n - got;
+
+        memcpy(dst + got, r->buf + r->start, take);
+        r->start += take;
+        got += take;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Writes the whole of `iov[0..n)`
+ * @return 0 on success, -1 on a write error
+ */
+static int write_all(int fd, struct iovec *iov, int n){
+    while(n > 0){
+        ssize_t k = writev(fd, iov, n);
+
+        if(k < 0 && errno == EINTR){
+            continue;
+        }
+
+        if(k < 0){
+            return -1;
+        }
+
+        //Skips what was written
+        while(n > 0 && (size_t)k >= iov->iov_len){
+            k -= (ssize_t)iov->iov_len;
+            iov++;
+            n--;
+        }
+
+        if(n > 0){
+            iov->iov_base = (char *)iov->iov_base + k;
+            iov->iov_len -= (size_t)k;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Builds the response frame of a request in its slot
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int respond(ExprContext *ctx, Slot *s, unsigned flags){
+    Buffer *b = &s->response;
+    ExprError err;
+    size_t n = 0;
+    ExprStatus status;
+
+    buffer_clear(b);
+
+    if(buffer_reserve(b, RESPONSE_HEADER + 4 + 256) != 0){
+        return -1;
+    }
+
+    //The result goes straight after the header; a longer one is retried with room for it
+    while((status = expr_transform(ctx, s->request.data, s->request.len, flags, b->data + 4 + RESPONSE_HEADER,
+                                   b->cap - 4 - RESPONSE_HEADER, &n, &err)) == EXPR_ERR_NO_SPACE){
+        if(buffer_reserve(b, 4 + RESPONSE_HEADER + n + 1) != 0){
+            return -1;
+        }
+    }
+
+    if(status != EXPR_OK){
+        const char *msg = expr_describe(ctx, &err);
+
+        n = strlen(msg);
+
+        if(buffer_reserve(b, 4 + RESPONSE_HEADER + n) != 0){
+            return -1;
+        }
+
+        memcpy(b->data + 4 + RESPONSE_HEADER, msg, n);
+    }
+
+    put_u32(b->data, (uint32_t)(RESPONSE_HEADER + n));
+    b->data[4] = (char)status;
+    put_u32(b->data + 5, (uint32_t)err.offset);
+    b->len = 4 + RESPONSE_HEADER + n;
+
+    return 0;
+}
+
+
+/**
+ * Worker thread: transforms the queued requests of every connection
+ */
+static void *worker_main(void *arg){
+    Worker *w = arg;
+    Server *sv = w->server;
+
+    while(1){
+        pthread_mutex_lock(&sv->lock);
+
+        while(!sv->head && !sv->stop){
+            pthread_cond_wait(&sv->ready, &sv->lock);
+        }
+
+        Slot *s = sv->head;
+
+        if(!s){
+            pthread_mutex_unlock(&sv->lock);
+            break;
+        }
+
+        sv->head = s->next;
+
+        if(!sv->head){
+            sv->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&sv->lock);
+
+        //Out of memory: a frame that only carries the status, in the slot's own storage
+        if(respond(w->ctx, s, s->flags | sv->flags) != 0){
+            buffer_free(&s->response);
+            buffer_init_fixed(&s->response, s->oom, sizeof(s->oom));
+            put_u32(s->oom, RESPONSE_HEADER);
+            s->oom[4] = (char)EXPR_ERR_NO_MEMORY;
+            put_u32(s->oom + 5, 0);
+            s->response.len = 4 + RESPONSE_HEADER;
+        }
+
+        Conn *c = s->conn;
+
+        pthread_mutex_lock(&c->lock);
+        s->ready = 1;
+        pthread_cond_signal(&c->ready);
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Writer of a connection: writes the ready responses in request order, several frames per
+ * system call when they are ready together
+ */
+static void *writer_main(void *arg){
+    Conn *c = arg;
+    struct iovec iov[SERVER_WINDOW];
+
+    pthread_mutex_lock(&c->lock);
+
+    while(1){
+        Slot *first = &c->slots[c->written % SERVER_WINDOW];
+
+        while(!first->ready && !(c->eof && c->written == c->admitted)){
+            pthread_cond_wait(&c->ready, &c->lock);
+        }
+
+        if(!first->ready){
+            break;
+        }
+
+        int n = 0;
+
+        while(n < SERVER_WINDOW && c->slots[(c->written + n) % SERVER_WINDOW].ready
+              && c->written + n < c->admitted){
+            Slot *s = &c->slots[(c->written + n) % SERVER_WINDOW];
+
+            iov[n].iov_base = s->response.data;
+            iov[n].iov_len = s->response.len;
+            n++;
+        }
+
+        pthread_mutex_unlock(&c->lock);
+
+        //After a write error the responses are dropped, so that the reader can finish
+        int rc = c->broken ? -1 : write_all(c->out, iov, n);
+
+        pthread_mutex_lock(&c->lock);
+        c->broken |= rc != 0;
+
+        for(int i = 0; i < n; i++){
+            Slot *s = &c->slots[c->written % SERVER_WINDOW];
+
+            if(s->response.fixed){
+                buffer_init(&s->response);     //Drops the out-of-memory frame
+            }
+
+            s->ready = 0;
+            c->written++;
+        }
+
+        pthread_cond_signal(&c->space);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    return NULL;
+}
+
+
+/**
+ * Reads the requests of one connection and queues them for the workers until the input
+ * ends, then waits for the last responses
+ * @return 0 if the stream ended cleanly, -1 on a read, write or protocol error
+ */
+static int serve_conn(Server *sv, int in, int out){
+    Conn *c = malloc(sizeof(Conn));
+    pthread_t writer;
+    int rc = 0;
+
+    if(!c){
+        return -1;
+    }
+
+    c->server = sv;
+    c->out = out;
+    c->reader.fd = in;
+    c->reader.start = c->reader.end = 0;
+    c->admitted = c->written = 0;
+    c->eof = c->broken = 0;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->ready, NULL);
+    pthread_cond_init(&c->space, NULL);
+
+    for(int i = 0; i < SERVER_WINDOW; i++){
+        c->slots[i].conn = c;
+        c->slots[i].ready = 0;
+        buffer_init(&c->slots[i].request);
+        buffer_init(&c->slots[i].response);
+    }
+
+    if(pthread_create(&writer, NULL, writer_main, c) != 0){
+        pthread_cond_destroy(&c->space);
+        pthread_cond_destroy(&c->ready);
+        pthread_mutex_destroy(&c->lock);
+        free(c);
+        return -1;
+    }
+
+    while(1){
+        char header[5];
+        int r = read_exact(&c->reader, header, sizeof(header));
+
+        if(r != 0){
+            rc = r < 0 ? -1 : 0;
+            break;
+        }
+
+        uint32_t n = get_u32(header);
+
+        if(n == 0 || n > SERVER_MAX_FRAME){
+            rc = -1;
+            break;
+        }
+
+        //Waits for a free slot
+        pthread_mutex_lock(&c->lock);
+
+        while(c->admitted - c->written >= SERVER_WINDOW && !c->broken){
+            pthread_cond_wait(&c->space, &c->lock);
+        }
+
+        int broken = c->broken;
+
+        pthread_mutex_unlock(&c->lock);
+
+        Slot *s = &c->slots[c->admitted % SERVER_WINDOW];
+
+        buffer_clear(&s->request);
+
+        if(broken || buffer_reserve(&s->request, n - 1) != 0 || read_exact(&c->reader, s->request.data, n - 1) != 0){
+            rc = -1;
+            break;
+        }
+
+        s->request.len = n - 1;
+        s->flags = (unsigned char)header[4];
+        s->next = NULL;
+
+        pthread_mutex_lock(&c->lock);
+        c->admitted++;
+        pthread_mutex_unlock(&c->lock);
+
+        pthread_mutex_lock(&sv->lock);
+
+        if(sv->tail){
+            sv->tail->next = s;
+        }
+        else{
+            sv->head = s;
+        }
+
+        sv->tail = s;
+        pthread_cond_signal(&sv->ready);
+        pthread_mutex_unlock(&sv->lock);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->eof = 1;
+    pthread_cond_signal(&c->ready);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(writer, NULL);
+
+    rc = c->broken ? -1 : rc;
+
+    for(int i = 0; i < SERVER_WINDOW; i++){
+        buffer_free(&c->slots[i].request);
+        buffer_free(&c->slots[i].response);
+    }
+
+    pthread_cond_destroy(&c->space);
+    pthread_cond_destroy(&c->ready);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+
+    return rc;
+}
+
+
+/**
+ * Starts the worker pool
+ * @return the workers, or null if a context or a thread cannot be created
+ */
+static Worker *pool_start(Server *sv, const ServerOptions *opts){
+    Worker *workers = calloc((size_t)opts->jobs, sizeof(Worker));
+
+    if(!workers){
+        return NULL;
+    }
+
+    pthread_mutex_init(&sv->lock, NULL);
+    pthread_cond_init(&sv->ready, NULL);
+    sv->head = sv->tail = NULL;
+    sv->stop = 0;
+    sv->flags = opts->flags;
+
+    for(int i = 0; i < opts->jobs; i++){
+        workers[i].server = sv;
+
+        if(!(workers[i].ctx = expr_context_create())
+           || pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0){
+            expr_context_destroy(workers[i].ctx);
+            workers[i].ctx = NULL;
+            sv->stop = 1;
+            break;
+        }
+    }
+
+    return workers;
+}
+
+
+/**
+ * Stops the workers once the queue is empty and releases them
+ */
+static void pool_stop(Server *sv, Worker *workers, int jobs){
+    pthread_mutex_lock(&sv->lock);
+    sv->stop = 1;
+    pthread_cond_broadcast(&sv->ready);
+    pthread_mutex_unlock(&sv->lock);
+
+    for(int i = 0; i < jobs && workers[i].ctx; i++){
+        pthread_join(workers[i].thread, NULL);
+        expr_context_destroy(workers[i].ctx);
+    }
+
+    pthread_cond_destroy(&sv->ready);
+    pthread_mutex_destroy(&sv->lock);
+    free(workers);
+}
+
+
+/**
+ * Serves a single stream of frames, e.g. a pair of pipes, until its input ends
+ *
+ * @param in: descriptor the requests are read from
+ * @param out: descriptor the responses are written to
+ * @param opts: settings of the server
+ * @return 0 if the input ended cleanly, -1 on a fatal error
+ */
+int server_run_pipe(int in, int out, const ServerOptions *opts){
+    Server sv;
+    Worker *workers;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if(!(workers = pool_start(&sv, opts))){
+        return -1;
+    }
+
+    int rc = sv.stop ? -1 : serve_conn(&sv, in, out);
+
+    pool_stop(&sv, workers, opts->jobs);
+
+    return rc;
+}
+
+
+/**
+ * Connection thread of the socket server
+ */
+typedef struct{
+    Server *server;
+    int fd;
+} Client;
+
+static void *client_main(void *arg){
+    Client *cl = arg;
+
+    serve_conn(cl->server, cl->fd, cl->fd);
+    close(cl->fd);
+    free(cl);
+
+    return NULL;
+}
+
+
+/**
+ * Listens on a Unix domain socket and serves every client that connects, each one with
+ * its own reader and writer threads and all of them with the same worker pool
+ * A stale socket file at `path` is replaced
+ *
+ * @param path: path of the socket
+ * @param opts: settings of the server
+ * @return -1 if the socket cannot be created or the pool cannot start (it does not
+ *         return otherwise)
+ */
+int server_run_socket(const char *path, const ServerOptions *opts){
+    struct sockaddr_un addr;
+    Server sv;
+    Worker *workers;
+
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(fd < 0){
+        return -1;
+    }
+
+    //Only a stale socket is replaced: any other file at `path` is left alone
+    struct stat st;
+
+    if(lstat(path, &st) == 0){
+        if(!S_ISSOCK(st.st_mode)){
+            close(fd);
+            errno = EADDRINUSE;
+            return -1;
+        }
+
+        unlink(path);
+    }
+
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0){
+        close(fd);
+        return -1;
+    }
+
+    if(!(workers = pool_start(&sv, opts)) || sv.stop){
+        if(workers){
+            pool_stop(&sv, workers, opts->jobs);
+        }
+
+        close(fd);
+        return -1;
+    }
+
+    while(1){
+        int client = accept(fd, NULL, NULL);
+        Client *cl;
+        pthread_t thread;
+
+        if(client < 0){
+            if(errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+
+            break;
+        }
+
+        if(!(cl = malloc(sizeof(Client)))){
+            close(client);
+            continue;
+        }
+
+        cl->server = &sv;
+        cl->fd = client;
+
+        if(pthread_create(&thread, NULL, client_main, cl) != 0){
+            close(client);
+            free(cl);
+            continue;
+        }
+
+        pthread_detach(thread);
+    }
+
+    close(fd);
+
+    return -1;
+}
+
+
+/**
+ * Sender of the client: one request per line of the input, written in large chunks
+ * without waiting for the responses
+ */
+typedef struct{
+    int fd;
+    const char *data;
+    size_t len;
+    unsigned flags;
+    int rc;
+} Sender;
+
+static void *sender_main(void *arg){
+    Sender *snd = arg;
+    const char *p = snd->data;
+    const char *end = snd->data + snd->len;
+    Buffer b;
+
+    buffer_init(&b);
+    snd->rc = 0;
+
+    while(p < end && snd->rc == 0){
+        const char *nl = memchr(p, '\n', end - p);
+        const char *eol = nl ? nl : end;
+        size_t n = (size_t)(eol - p);
+        char header[5];
+
+        put_u32(header, (uint32_t)(n + 1));
+        header[4] = (char)snd->flags;
+
+        if(n + 1 > SERVER_MAX_FRAME || buffer_append(&b, header, sizeof(header)) != 0
+           || buffer_append(&b, p, n) != 0){
+            snd->rc = -1;
+            break;
+        }
+
+        p = nl ? nl + 1 : end;
+
+        if(b.len >= SERVER_READ_CHUNK || p >= end){
+            struct iovec iov = {b.data, b.len};
+
+            snd->rc = write_all(snd->fd, &iov, 1);
+            buffer_clear(&b);
+        }
+    }
+
+    buffer_free(&b);
+    shutdown(snd->fd, SHUT_WR);
+
+    return NULL;
+}
+
+
+/**
+ * Client: sends every line of the input to the server at `path` as a request and writes
+ * one line per response, in input order: the result, or "Error: " and the description of
+ * the error, so the output is the same as batch mode's. The requests are pipelined: they are all sent before, and while, the
+ * responses are read
+ *
+ * @param path: socket of the server
+ * @param data: the input, one expression per line
+ * @param len: its length in bytes
+ * @param flags: EXPR_* flags of every request
+ * @param out: destination of the results
+ * @return 0 if every record was transformed, 1 if at least one failed, -1 on a
+ *         connection or protocol error
+ */
+int client_run(const char *path, const char *data, size_t len, unsigned flags, FILE *out){
+    struct sockaddr_un addr;
+
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0){
+        if(fd >= 0){
+            close(fd);
+        }
+
+        return -1;
+    }
+
+    Sender snd = {fd, data, len, flags, 0};
+    Reader *r = malloc(sizeof(Reader));
+    Buffer text, sink;
+    pthread_t thread;
+    int failed = 0;
+
+    //Both buffers are valid before anything can fail, so that the error path may free them
+    buffer_init(&text);
+    buffer_init(&sink);
+
+    if(!r || buffer_init_sink(&sink, out, SERVER_READ_CHUNK) != 0 || pthread_create(&thread, NULL, sender_main, &snd) != 0){
+        free(r);
+        buffer_free(&sink);
+        close(fd);
+        return -1;
+    }
+
+    r->fd = fd;
+    r->start = r->end = 0;
+
+    //Reads responses until the server closes the stream, which it does after the last one
+    while(1){
+        char header[4 + RESPONSE_HEADER];
+        int rc = read_exact(r, header, 4);
+
+        if(rc != 0){
+            failed = rc < 0 ? -1 : failed;
+            break;
+        }
+
+        uint32_t n = get_u32(header);
+
+        buffer_clear(&text);
+
+        if(n < RESPONSE_HEADER || read_exact(r, header + 4, RESPONSE_HEADER) != 0
+           || buffer_reserve(&text, n - RESPONSE_HEADER) != 0
+           || read_exact(r, text.data, n - RESPONSE_HEADER) != 0){
+            failed = -1;
+            break;
+        }
+
+        ExprStatus status = (ExprStatus)(unsigned char)header[4];
+
+        if(status == EXPR_OK){
+            buffer_append(&sink, text.data, n - RESPONSE_HEADER);
+        }
+        else{
+            buffer_puts(&sink, "Error: ");
+
+            //The out-of-memory frame carries no description
+            if(n == RESPONSE_HEADER){
+                buffer_puts(&sink, expr_strerror(status));
+            }
+            else{
+                buffer_append(&sink, text.data, n - RESPONSE_HEADER);
+            }
+
+            failed |= failed >= 0;
+        }
+
+        buffer_putc(&sink, '\n');
+    }
+
+    pthread_join(thread, NULL);
+
+    if(buffer_flush(&sink, out) != 0 || snd.rc != 0){
+        failed = -1;
+    }
+
+    buffer_free(&sink);
+    buffer_free(&text);
+    free(r);
+    close(fd);
+
+    return failed;
+}
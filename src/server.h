@@ -0,0 +1,39 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+
+/**
+ * @file server.h
+ * @brief Long-running server: transforms expressions sent as length-prefixed frames, and
+ *        the matching client
+ *
+ * Protocol, on a Unix domain socket or on a pair of pipes (integers are little-endian):
+ * - request:  u32 n, then n bytes: u8 flags (EXPR_* of expr.h), then the expression
+ * - response: u32 n, then n bytes: u8 status (ExprStatus), u32 byte offset of a syntax
+ *             error (0 otherwise), then the result, or the description of the error
+ *             (`expr_describe`: the message batch mode writes)
+ *
+ * A client may send any number of requests before reading the responses; they are
+ * transformed concurrently by the worker pool and the responses of a connection always
+ * come back in the order of its requests. Every worker keeps its parser, tree and output
+ * buffer between requests
+ */
+
+
+/**
+ * @struct ServerOptions
+ * @brief Settings of a server
+ */
+typedef struct{
+    int jobs;           //Worker threads
+    unsigned flags;     //EXPR_* flags added to those of every request
+} ServerOptions;
+
+int server_run_socket(const char *path, const ServerOptions *opts);    //Serves until killed; -1 if it cannot listen
+int server_run_pipe(int in, int out, const ServerOptions *opts);        //Serves one stream until EOF; 0 on success, -1 on a fatal error
+int client_run(const char *path, const char *data, size_t len, unsigned flags, FILE *out); //Like batch mode, through a server: 0, 1 if a record failed, -1 on a fatal error
+
+#endif
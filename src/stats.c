@@ -0,0 +1,197 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "stats.h"
+#include <string.h>
+#include <time.h>
+
+
+_Thread_local StatsCounters stats_counters;
+
+static const char *phase_names[STATS_NPHASES] = {"lex", "parse", "passes", "output", "free"};
+
+
+/**
+ * Initializes empty totals
+ */
+void stats_init(Stats *s){
+    memset(s, 0, sizeof(*s));
+}
+
+
+/**
+ * Runs the lexer over its whole input and adds the sizes of the expression to `s`
+ * Every number and every name becomes one node of the tree, and the depth is the deepest
+ * nesting of parentheses. The scan stops at the first invalid token
+ *
+ * @param s: the totals
+ * @param l: a lexer positioned at the start of the input
+ */
+void stats_scan(Stats *s, Lexer *l){
+    size_t depth = 0;
+    Token t;
+
+    while((t = lexer_next(l)).type != TOK_EOF && t.type != TOK_ERROR){
+        s->tokens++;
+
+        if(t.type == TOK_NUMBER || t.type == TOK_IDENT || t.type == TOK_OP){
+            s->nodes++;
+        }
+        else if(t.type == TOK_LPAREN && ++depth > s->max_depth){
+            s->max_depth = depth;
+        }
+        else if(t.type == TOK_RPAREN && depth > 0){
+            depth--;
+        }
+    }
+}
+
+
+/**
+ * Records the clock and the allocation counters of the calling thread
+ */
+void stats_mark(StatsMark *m){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    m->t = ts.tv_sec + ts.tv_nsec / 1e9;
+    m->counters = stats_counters;
+}
+
+
+/**
+ * Adds the time elapsed and the allocations made since `m` to a phase
+ * @return the elapsed time in seconds
+ */
+double stats_phase(Stats *s, StatsPhase phase, const StatsMark *m){
+    StatsMark now;
+    stats_mark(&now);
+
+    double t = now.t - m->t;
+
+    s->phases[phase].seconds += t;
+    s->phases[phase].allocs += now.counters.allocs - m->counters.allocs;
+    s->phases[phase].alloc_bytes += now.counters.bytes - m->counters.bytes;
+
+    return t;
+}
+
+
+/**
+ * Adds the latency of one record to the histogram
+ */
+void stats_latency(Stats *s, double seconds){
+    double us = seconds * 1e6;
+    int i = 0;
+
+    while(i < STATS_BUCKETS - 1 && (double)(1ull << i) <= us){
+        i++;
+    }
+
+    s->histogram[i]++;
+
+    if(seconds > s->max_latency){
+        s->max_latency = seconds;
+    }
+}
+
+
+/**
+ * Adds the totals of `src` (e.g. those of a worker thread) to `dst`
+ */
+void stats_merge(Stats *dst, const Stats *src){
+    for(int i = 0; i < STATS_NPHASES; i++){
+        dst->phases[i].seconds += src->phases[i].seconds;
+        dst->phases[i].allocs += src->phases[i].allocs;
+        dst->phases[i].alloc_bytes += src->phases[i].alloc_bytes;
+    }
+
+    for(int i = 0; i < STATS_BUCKETS; i++){
+        dst->histogram[i] += src->histogram[i];
+    }
+
+    dst->records += src->records;
+    dst->failed += src->failed;
+    dst->input_bytes += src->input_bytes;
+    dst->output_bytes += src->output_bytes;
+    dst->tokens += src->tokens;
+    dst->nodes += src->nodes;
+    dst->max_depth = src->max_depth > dst->max_depth ? src->max_depth : dst->max_depth;
+    dst->max_latency = src->max_latency > dst->max_latency ? src->max_latency : dst->max_latency;
+}
+
+
+/**
+ * Latency (microseconds) under which a fraction `q` of the records fall, estimated by the
+ * upper bound of the histogram bucket where it is reached
+ */
+static double percentile(const Stats *s, size_t total, double q){
+    size_t seen = 0;
+
+    for(int i = 0; i < STATS_BUCKETS; i++){
+        seen += s->histogram[i];
+
+        if(seen > 0 && (double)seen >= q * (double)total){
+            double bound = (double)(1ull << i);
+            return bound < s->max_latency * 1e6 ? bound : s->max_latency * 1e6;
+        }
+    }
+
+    return s->max_latency * 1e6;
+}
+
+
+/**
+ * Writes the totals as one JSON object followed by a newline
+ *
+ * The phases give their time and the heap allocations made by the library during them.
+ * When latencies were recorded, "latency_us" gives the 50th, 90th and 99th percentiles (as
+ * the bound of their bucket), the maximum, and the non-empty buckets of the histogram as
+ * [upper bound in microseconds, records] pairs
+ *
+ * @param s: the totals
+ * @param mode: name of the mode of the run, e.g. "single" or "batch"
+ * @param wall: duration of the whole run in seconds
+ * @param f: destination
+ * @return 0 on success, -1 on a write error
+ */
+int stats_write(const Stats *s, const char *mode, double wall, FILE *f){
+    size_t total = 0;
+
+    for(int i = 0; i < STATS_BUCKETS; i++){
+        total += s->histogram[i];
+    }
+
+    fprintf(f, "{\"mode\": \"%s\", \"wall_seconds\": %.6f, \"records\": %zu, \"failed\": %zu, "
+               "\"input_bytes\": %zu, \"output_bytes\": %zu, \"tokens\": %zu, \"nodes\": %zu, "
+               "\"max_depth\": %zu, \"phases\": {",
+            mode, wall, s->records, s->failed, s->input_bytes, s->output_bytes, s->tokens,
+            s->nodes, s->max_depth);
+
+    for(int i = 0; i < STATS_NPHASES; i++){
+        fprintf(f, "%s\"%s\": {\"seconds\": %.6f, \"allocs\": %zu, \"alloc_bytes\": %zu}",
+                i ? ", " : "", phase_names[i], s->phases[i].seconds, s->phases[i].allocs,
+                s->phases[i].alloc_bytes);
+    }
+
+    fputc('}', f);
+
+    if(total > 0){
+        fprintf(f, ", \"latency_us\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f, \"histogram\": [",
+                percentile(s, total, 0.5), percentile(s, total, 0.9), percentile(s, total, 0.99),
+                s->max_latency * 1e6);
+
+        for(int i = 0, first = 1; i < STATS_BUCKETS; i++){
+            if(s->histogram[i] > 0){
+                fprintf(f, "%s[%llu, %zu]", first ? "" : ", ", 1ull << i, s->histogram[i]);
+                first = 0;
+            }
+        }
+
+        fputc(']', f);
+        fputc('}', f);
+    }
+
+    fputs("}\n", f);
+
+    return ferror(f) || fflush(f) != 0 ? -1 : 0;
+}
@@ -0,0 +1,108 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "lexer.h"
+#include <stddef.h>
+#include <stdio.h>
+
+
+/**
+ * @file stats.h
+ * @brief Optional instrumentation: time and allocations per phase, sizes, and a latency
+ *        histogram of the records of a batch, written as JSON
+ *
+ * The library counts its own heap allocations (`stats_note_alloc`, where its structures
+ * grow) in thread-local counters, which costs one increment per allocation whether or not
+ * stats are requested; everything else (clocks, the separate lexing pass) only runs when
+ * the caller measures. The phases are:
+ * - lex: a separate pass of the lexer over the input (`stats_scan`), which also gives the
+ *   sizes: tokens, nodes (every number and name is one) and nesting depth
+ * - parse: the analysis into a tree, including the lexing it drives
+ * - passes: the simplification passes, when there are any
+ * - output: printing, evaluating or the column evaluation
+ * - free: releasing the tree
+ */
+
+
+/**
+ * @enum StatsPhase
+ */
+typedef enum{
+    STATS_LEX,
+    STATS_PARSE,
+    STATS_PASSES,
+    STATS_OUTPUT,
+    STATS_FREE,
+    STATS_NPHASES
+} StatsPhase;
+
+
+/**
+ * Buckets of the latency histogram: bucket i counts the records that took less than
+ * 2^i microseconds (and at least 2^(i-1)); the last one also takes the slower ones
+ */
+#define STATS_BUCKETS 32
+
+
+/**
+ * @struct StatsCounters
+ * @brief Heap allocations made by the library on the current thread
+ */
+typedef struct{
+    size_t allocs;
+    size_t bytes;
+} StatsCounters;
+
+extern _Thread_local StatsCounters stats_counters;
+
+/**
+ * Counts one allocation (or reallocation) of `bytes` bytes
+ */
+static inline void stats_note_alloc(size_t bytes){
+    stats_counters.allocs++;
+    stats_counters.bytes += bytes;
+}
+
+
+/**
+ * @struct StatsMark
+ * @brief The clock and the allocation counters at the start of a phase
+ */
+typedef struct{
+    double t;
+    StatsCounters counters;
+} StatsMark;
+
+
+/**
+ * @struct Stats
+ * @brief Totals of one run (or of one thread of a batch, see `stats_merge`)
+ */
+typedef struct{
+    struct{
+        double seconds;
+        size_t allocs;
+        size_t alloc_bytes;
+    } phases[STATS_NPHASES];
+
+    size_t records;
+    size_t failed;
+    size_t input_bytes;
+    size_t output_bytes;
+    size_t tokens;
+    size_t nodes;
+    size_t max_depth;
+
+    size_t histogram[STATS_BUCKETS];    //Batch mode: latency of the records
+    double max_latency;
+} Stats;
+
+void stats_init(Stats *s);
+void stats_scan(Stats *s, Lexer *l);    //Lexes the whole input of `l`, counting its tokens, nodes and depth
+void stats_mark(StatsMark *m);
+double stats_phase(Stats *s, StatsPhase phase, const StatsMark *m);  //Adds the time and allocations since `m`, returns the seconds
+void stats_latency(Stats *s, double seconds);   //Adds a record to the histogram
+void stats_merge(Stats *dst, const Stats *src);
+int stats_write(const Stats *s, const char *mode, double wall, FILE *f);   //One JSON object and a newline, 0 on success
+
+#endif
@@ -0,0 +1,321 @@
+#include "stream.h"
+#include "lexer.h"
+#include "ast.h"
+#include "printer.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * Size of the window over an input read from a descriptor
+ */
+#define STREAM_WINDOW (64 * 1024)
+
+
+/**
+ * A function call whose arguments are being streamed
+ * Nothing about the arguments is stored: they have already been written to the output
+ */
+typedef struct{
+    OpType op;
+    int arg_count;
+    int parens;     //Whether the call was opened with '(' in the output
+} StreamFrame;
+
+
+/**
+ * Internal structure of the streaming transformer
+ */
+struct Streamer{
+    Lexer *lexer;
+    Token current;
+    char *error_msg;
+
+    //Stack of open calls
+    StreamFrame *frames;
+    size_t depth;
+    size_t frame_cap;
+};
+
+static Streamer *wrap(Lexer *lexer);
+
+
+/**
+ * Creates a streaming transformer for the first `len` bytes of `input`
+ * As with the parser, the input is not copied and must remain valid while it is used
+ *
+ * @return a pointer to the new transformer or null if memory allocation fails
+ */
+Streamer *streamer_create(const char *input, size_t len){
+    return wrap(lexer_create(input, len));
+}
+
+
+/**
+ * Creates a streaming transformer that reads the descriptor `fd` (a pipe, a socket...)
+ * as it goes, through a window of STREAM_WINDOW bytes (see `lexer_create_reader`); with
+ * a streaming output buffer, memory stays bounded whatever the length of the input
+ * The descriptor is not closed
+ *
+ * @return a pointer to the new transformer or null if memory allocation fails
+ */
+Streamer *streamer_create_fd(int fd){
+    return wrap(lexer_create_fd(fd, STREAM_WINDOW));
+}
+
+
+/**
+ * Builds a transformer around its lexer, which it then owns
+ * @return the transformer, or null if `lexer` is null or memory allocation fails
+ */
+static Streamer *wrap(Lexer *lexer){
+    Streamer *s = lexer ? malloc(sizeof(Streamer)) : NULL;
+
+    if(!s && lexer){
+        lexer_destroy(lexer);
+    }
+
+    if(s){
+        s->lexer = lexer;
+        s->error_msg = NULL;
+        s->frames = NULL;
+        s->depth = 0;
+        s->frame_cap = 0;
+    }
+
+    return s;
+}
+
+
+/**
+ * Returns the error message of the last run
+ */
+const char *streamer_error(Streamer *s){
+    return s->error_msg;
+}
+
+
+/**
+ * Frees all the resources associated to the transformer
+ */
+void streamer_destroy(Streamer *s){
+    lexer_destroy(s->lexer);
+    free(s->frames);
+    free(s->error_msg);
+    free(s);
+}
+
+
+/**
+ * Records the first error found; the messages are the same ones the parser uses
+ * @return always -1
+ */
+static int fail(Streamer *s, const char *msg){
+    if(!s->error_msg){
+        s->error_msg = strdup(msg);
+    }
+
+    return -1;
+}
+
+
+/**
+ * Advances to the next token in the input stream
+ */
+static void advance(Streamer *s){
+    s->current = lexer_next(s->lexer);
+
+    //A lexical error is reported as such, with its location, before any syntax error
+    if(s->current.type == TOK_ERROR && !s->error_msg){
+        char msg[128];
+        lexer_describe_error(s->lexer, &s->current, msg, sizeof(msg));
+        s->error_msg = strdup(msg);
+    }
+}
+
+
+/**
+ * Pushes a frame for a function call whose '(' has just been consumed
+ * @return the new frame, or null if memory allocation fails
+ */
+static StreamFrame *push_frame(Streamer *s){
+    if(s->depth == s->frame_cap){
+        size_t cap = s->frame_cap ? s->frame_cap * 2 : 64;
+        StreamFrame *frames = realloc(s->frames, cap * sizeof(StreamFrame));
+
+        if(!frames){
+            return NULL;
+        }
+
+        s->frames = frames;
+        s->frame_cap = cap;
+    }
+
+    return &s->frames[s->depth++];
+}
+
+
+/**
+ * Transforms the whole input and writes the infix expression to `out`
+ *
+ * Before each argument the separator that precedes it (operator, '?' or ':') is written,
+ * and when the argument is a call its parentheses are decided from its operator, its
+ * parent's operator and its position, exactly as `ast_print` does with the tree
+ *
+ * On error the output is incomplete: with a streaming buffer, what was already flushed
+ * cannot be taken back
+ *
+ * @param s: the transformer
+ * @param out: the buffer that receives the text, usually a streaming one
+ * @return 0 on success, -1 on error
+ */
+int streamer_run(Streamer *s, Buffer *out){
+    s->depth = 0;
+    advance(s); //Loads the first token
+
+    while(1){
+        int parent_prec = 0;
+        int is_right_child = 0;
+
+        //Separator between the previous argument and this one
+        if(s->depth > 0){
+            StreamFrame *f = &s->frames[s->depth - 1];
+            int rc = 0;
+
+            if(f->op == OP_TERN){
+                if(f->arg_count == 1){
+                    rc = buffer_putc(out, '?');
+                }
+                else if(f->arg_count == 2){
+                    rc = buffer_putc(out, ':');
+                }
+
+                is_right_child = f->arg_count == 2;
+            }
+            else{
+                if(f->arg_count == 1){
+                    rc = buffer_puts(out, ast_op_symbol(f->op));
+                }
+                else if(f->arg_count == 2){
+                    return fail(s, "Binary opertor requres 2 arguments");
+                }
+
+                is_right_child = f->arg_count == 1;
+            }
+
+            if(rc != 0){
+                return fail(s, "Output error");
+            }
+
+            parent_prec = ast_op_prec(f->op);
+        }
+
+        int closed;   //Whether an argument was just completed
+
+        //A "primary" element: a literal number, a variable or a function call
+        if(s->current.type == TOK_NUMBER){
+            if(buffer_append(out, lexer_text(s->lexer, &s->current), s->current.len) != 0){
+                return fail(s, "Output error");
+            }
+
+            advance(s);
+            closed = 1;
+        }
+        else if(s->current.type == TOK_OP || s->current.type == TOK_IDENT){  //Function call or variable
+            Token name = s->current;
+            OpType op = name.op;    //(OpType)-1 for an unknown name
+            advance(s);
+
+            if(s->current.type != TOK_LPAREN && name.type == TOK_IDENT){
+                if(buffer_append(out, lexer_text(s->lexer, &name), name.len) != 0){
+                    return fail(s, "Output error");
+                }
+
+                closed = 1;
+            }
+            else if(s->current.type != TOK_LPAREN){
+                return fail(s, "Expected '(' after identifier");
+            }
+            else if(op == (OpType)-1){
+                return fail(s, "Unknown function");
+            }
+            else{
+                advance(s); //Consume '('
+
+                StreamFrame *f = push_frame(s);
+
+                if(!f){
+                    return fail(s, "Out of memory");
+                }
+
+                f->op = op;
+                f->arg_count = 0;
+                f->parens = ast_op_needs_parens(op, parent_prec, is_right_child);
+
+                if(f->parens && buffer_putc(out, '(') != 0){
+                    return fail(s, "Output error");
+                }
+
+                //A call without arguments is closed right away
+                if(s->current.type != TOK_RPAREN){
+                    continue;
+                }
+
+                closed = 0;
+            }
+        }
+        else{   //Neither a number nor identifier
+            return fail(s, "Expected number or function call");
+        }
+
+        //Closes the calls that end here
+        while(1){
+            if(closed && s->depth == 0){
+                if(s->current.type != TOK_EOF){
+                    return fail(s, "Unexpected token after expression");
+                }
+
+                return 0;
+            }
+
+            StreamFrame *f = &s->frames[s->depth - 1];
+
+            if(closed){
+                f->arg_count++;
+
+                if(s->current.type == TOK_COMMA){
+                    advance(s);
+                }
+                else if(s->current.type != TOK_RPAREN){
+                    return fail(s, "Expected ',' or ')'");
+                }
+            }
+
+            //Up to three arguments are read before the call must be closed
+            if(s->current.type != TOK_RPAREN && f->arg_count < 3){
+                break;
+            }
+
+            if(s->current.type != TOK_RPAREN){
+                return fail(s, "Expected ')'");
+            }
+
+            advance(s); //Consume ')'
+
+            if(f->op == OP_TERN && f->arg_count != 3){
+                return fail(s, "Ternaty operator requires 3 arguments");
+            }
+
+            if(f->op != OP_TERN && f->arg_count != 2){
+                return fail(s, "Binary opertor requres 2 arguments");
+            }
+
+            if(f->parens && buffer_putc(out, ')') != 0){
+                return fail(s, "Output error");
+            }
+
+            s->depth--;
+            closed = 1;
+        }
+    }
+}
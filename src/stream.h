@@ -0,0 +1,29 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "buffer.h"
+
+
+/**
+ * @file stream.h
+ * @brief Streaming transformer: converts the prefix expression to infix while it reads the
+ *        tokens, without building an AST
+ *
+ * The operator of a call is known before its arguments, which is enough to decide its
+ * parentheses, so the only state is a stack of open calls: memory is bounded by the
+ * nesting depth, not by the size of the input
+ */
+
+
+/**
+ * Opaque structure that represents the state of the streaming transformer
+ */
+typedef struct Streamer Streamer;
+
+Streamer *streamer_create(const char *input, size_t len);
+Streamer *streamer_create_fd(int fd);  //Reads the input from `fd` as it goes, in constant memory
+int streamer_run(Streamer *s, Buffer *out);    //0 on success, -1 on error (see `streamer_error`)
+const char *streamer_error(Streamer *s);
+void streamer_destroy(Streamer *s);
+
+#endif
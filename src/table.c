@@ -0,0 +1,261 @@
+#include "table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * Initial number of rows allocated per column when the total is not known in advance
+ */
+#define TABLE_INITIAL_ROWS 4096
+
+
+static void table_init(Table *t){
+    t->names = NULL;
+    t->cols = NULL;
+    t->ncols = 0;
+    t->nrows = 0;
+}
+
+
+/**
+ * Splits a comma-separated list of names, ignoring the spaces around each of them, and
+ * allocates one column of `rows` values per name
+ * @return 0 on success, -1 with a message in `err`
+ */
+static int set_columns(Table *t, const char *s, size_t len, size_t rows, char *err, size_t size){
+    size_t n = 1;
+
+    for(size_t i = 0; i < len; i++){
+        n += s[i] == ',';
+    }
+
+    t->names = calloc(n, sizeof(char *));
+    t->cols = calloc(n, sizeof(double *));
+
+    if(!t->names || !t->cols){
+        snprintf(err, size, "Out of memory");
+        return -1;
+    }
+
+    t->ncols = n;
+
+    const char *p = s;
+    const char *end = s + len;
+
+    for(size_t c = 0; c < n; c++){
+        const char *comma = memchr(p, ',', end - p);
+        const char *stop = comma ? comma : end;
+
+        while(p < stop && (*p == ' ' || *p == '\t')){
+            p++;
+        }
+
+        const char *q = stop;
+
+        while(q > p && (q[-1] == ' ' || q[-1] == '\t' || q[-1] == '\r')){
+            q--;
+        }
+
+        if(q == p){
+            snprintf(err, size, "Empty column name (column %zu)", c + 1);
+            return -1;
+        }
+
+        t->names[c] = malloc(q - p + 1);
+        t->cols[c] = malloc((rows ? rows : 1) * sizeof(double));
+
+        if(!t->names[c] || !t->cols[c]){
+            snprintf(err, size, "Out of memory");
+            return -1;
+        }
+
+        memcpy(t->names[c], p, q - p);
+        t->names[c][q - p] = '\0';
+        p = stop + 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Converts one field; the text is not NUL-terminated, so it is copied first
+ * @return 0 on success, -1 if the field is not a number
+ */
+static int parse_field(const char *s, size_t len, double *value){
+    char tmp[64];
+    char *end;
+
+    while(len > 0 && (*s == ' ' || *s == '\t')){
+        s++;
+        len--;
+    }
+
+    while(len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t' || s[len - 1] == '\r')){
+        len--;
+    }
+
+    if(len == 0 || len >= sizeof(tmp)){
+        return -1;
+    }
+
+    memcpy(tmp, s, len);
+    tmp[len] = '\0';
+    *value = strtod(tmp, &end);
+
+    return *end == '\0' ? 0 : -1;
+}
+
+
+/**
+ * Loads a CSV file: a header line with the column names, then one line of numbers per
+ * row. Empty lines are ignored
+ *
+ * @param t: the table to fill
+ * @param data: the text, not necessarily NUL-terminated
+ * @param len: its length in bytes
+ * @param err: receives the error message
+ * @param size: size of `err`
+ * @return 0 on success, -1 on error (the table is then empty)
+ */
+int table_load_csv(Table *t, const char *data, size_t len, char *err, size_t size){
+    const char *p = data;
+    const char *end = data + len;
+    const char *nl = memchr(p, '\n', len);
+    const char *eol = nl ? nl : end;
+    size_t cap = TABLE_INITIAL_ROWS;
+    size_t line = 1;
+
+    table_init(t);
+
+    if(set_columns(t, p, eol - p, cap, err, size) != 0){
+        table_free(t);
+        return -1;
+    }
+
+    for(p = nl ? nl + 1 : end; p < end; p = nl ? nl + 1 : end){
+        nl = memchr(p, '\n', end - p);
+        eol = nl ? nl : end;
+        line++;
+
+        if(eol == p || (eol - p == 1 && *p == '\r')){
+            continue;
+        }
+
+        if(t->nrows == cap){
+            cap *= 2;
+
+            for(size_t c = 0; c < t->ncols; c++){
+                double *col = realloc(t->cols[c], cap * sizeof(double));
+
+                if(!col){
+                    snprintf(err, size, "Out of memory");
+                    table_free(t);
+                    return -1;
+                }
+
+                t->cols[c] = col;
+            }
+        }
+
+        const char *f = p;
+
+        for(size_t c = 0; c < t->ncols; c++){
+            const char *comma = memchr(f, ',', eol - f);
+            const char *stop = comma ? comma : eol;
+
+            if((comma != NULL) != (c + 1 < t->ncols)
+               || parse_field(f, stop - f, &t->cols[c][t->nrows]) != 0){
+                snprintf(err, size, "Invalid field at line %zu, column %zu", line, c + 1);
+                table_free(t);
+                return -1;
+            }
+
+            f = stop + 1;
+        }
+
+        t->nrows++;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Loads raw native-endian doubles stored row after row, `ncols` values per row
+ *
+ * @param t: the table to fill
+ * @param data: the bytes of the file
+ * @param len: their number, a multiple of the size of a row
+ * @param names: comma-separated names of the columns, in the order of each row
+ * @param err: receives the error message
+ * @param size: size of `err`
+ * @return 0 on success, -1 on error (the table is then empty)
+ */
+int table_load_doubles(Table *t, const char *data, size_t len, const char *names, char *err, size_t size){
+    size_t n = 1;
+
+    for(const char *s = names; *s; s++){
+        n += *s == ',';
+    }
+
+    size_t row = n * sizeof(double);
+
+    table_init(t);
+
+    if(len % row != 0){
+        snprintf(err, size, "Size of the data (%zu bytes) is not a multiple of %zu columns of doubles", len, n);
+        return -1;
+    }
+
+    size_t rows = len / row;
+
+    if(set_columns(t, names, strlen(names), rows, err, size) != 0){
+        table_free(t);
+        return -1;
+    }
+
+    //Transposes the rows into columns; memcpy because `data` has no alignment guarantee
+    for(size_t r = 0; r < rows; r++){
+        for(size_t c = 0; c < n; c++){
+            memcpy(&t->cols[c][r], data + r * row + c * sizeof(double), sizeof(double));
+        }
+    }
+
+    t->nrows = rows;
+
+    return 0;
+}
+
+
+/**
+ * Finds a column by name
+ * @param name: the name, not necessarily NUL-terminated
+ * @param len: its length
+ * @return the index of the column, or -1
+ */
+int table_find(const Table *t, const char *name, size_t len){
+    for(size_t c = 0; c < t->ncols; c++){
+        if(strlen(t->names[c]) == len && memcmp(t->names[c], name, len) == 0){
+            return (int)c;
+        }
+    }
+
+    return -1;
+}
+
+
+/**
+ * Releases the memory of the table
+ */
+void table_free(Table *t){
+    for(size_t c = 0; c < t->ncols; c++){
+        free(t->names[c]);
+        free(t->cols[c]);
+    }
+
+    free(t->names);
+    free(t->cols);
+    table_init(t);
+}
@@ -0,0 +1,32 @@
+#ifndef TABLE_H
+#define TABLE_H
+
+#include <stddef.h>
+
+
+/**
+ * @file table.h
+ * @brief Named columns of doubles, loaded from CSV text or from raw binary doubles
+ *
+ * The data is stored by column (one contiguous array per name), the layout that column
+ * evaluation (see column.h) reads
+ */
+
+
+/**
+ * @struct Table
+ * @brief `ncols` columns of `nrows` values each
+ */
+typedef struct{
+    char **names;       //NUL-terminated copies
+    double **cols;
+    size_t ncols;
+    size_t nrows;
+} Table;
+
+int table_load_csv(Table *t, const char *data, size_t len, char *err, size_t size);    //0 on success, -1 with a message in `err`
+int table_load_doubles(Table *t, const char *data, size_t len, const char *names, char *err, size_t size);
+int table_find(const Table *t, const char *name, size_t len);  //Column index, -1 if there is none with that name
+void table_free(Table *t);
+
+#endif
@@ -0,0 +1,154 @@
+#include "tokring.h"
+#include "stats.h"
+#include <sched.h>
+#include <stdlib.h>
+
+
+/**
+ * Checks of the other side's counter before a waiting side yields its CPU
+ */
+#define TOKRING_SPINS 64
+
+
+/**
+ * Prepares an idle ring
+ * @return 0 on success, -1 if memory allocation fails
+ */
+int tokring_init(TokenRing *r){
+    stats_note_alloc(TOKRING_SLOTS * sizeof(TokenBatch));
+    r->slots = malloc(TOKRING_SLOTS * sizeof(TokenBatch));
+    r->running = 0;
+
+    return r->slots ? 0 : -1;
+}
+
+
+/**
+ * Waits until the producer may fill the batch `tail`
+ * @return 0 when it may, -1 if the consumer stopped the ring
+ */
+static int wait_free(TokenRing *r, size_t tail){
+    for(unsigned spins = 0; tail - r->head_seen >= TOKRING_SLOTS; spins++){
+        if(atomic_load_explicit(&r->stop, memory_order_relaxed)){
+            return -1;
+        }
+
+        if(spins >= TOKRING_SPINS){
+            sched_yield();
+        }
+
+        r->head_seen = atomic_load_explicit(&r->head, memory_order_acquire);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Producer thread: lexes batches until the last token
+ */
+static void *lex_main(void *arg){
+    TokenRing *r = arg;
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    int end = 0;
+
+    while(!end && wait_free(r, tail) == 0){
+        TokenBatch *b = &r->slots[tail % TOKRING_SLOTS];
+        size_t n = 0;
+
+        while(n < TOKRING_BATCH && !end){
+            Token t = lexer_next(r->lexer);
+
+            b->tokens[n++] = t;
+            end = t.type == TOK_EOF || t.type == TOK_ERROR;
+        }
+
+        b->count = n;
+        atomic_store_explicit(&r->tail, ++tail, memory_order_release);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Starts the lexer thread, which continues from the current position of `lexer`
+ * @return 0 on success, -1 if the thread cannot be created
+ */
+int tokring_start(TokenRing *r, Lexer *lexer){
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->head, 0);
+    atomic_init(&r->stop, 0);
+    r->head_seen = 0;
+    r->tail_seen = 0;
+    r->lexer = lexer;
+    r->cur = NULL;
+    r->pos = 0;
+    r->done = 0;
+
+    r->running = pthread_create(&r->thread, NULL, lex_main, r) == 0;
+
+    return r->running ? 0 : -1;
+}
+
+
+/**
+ * Moves to the next batch when the current one is exhausted
+ * @return its first token, or the last token again once the input is over
+ */
+Token tokring_refill(TokenRing *r){
+    if(r->done){
+        return r->last;
+    }
+
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    //Gives the batch just read back to the producer
+    if(r->cur){
+        atomic_store_explicit(&r->head, ++head, memory_order_release);
+    }
+
+    for(unsigned spins = 0; r->tail_seen == head; spins++){
+        if(spins >= TOKRING_SPINS){
+            sched_yield();
+        }
+
+        r->tail_seen = atomic_load_explicit(&r->tail, memory_order_acquire);
+    }
+
+    const TokenBatch *b = &r->slots[head % TOKRING_SLOTS];
+    TokenType type = b->tokens[b->count - 1].type;
+
+    if(type == TOK_EOF || type == TOK_ERROR){
+        r->done = 1;
+        r->last = b->tokens[b->count - 1];
+    }
+
+    r->cur = b;
+    r->pos = 1;
+
+    return b->tokens[0];
+}
+
+
+/**
+ * Stops the lexer thread, wherever it is, and waits for it
+ * The lexer is then left after the last token it produced
+ */
+void tokring_stop(TokenRing *r){
+    if(r->running){
+        atomic_store_explicit(&r->stop, 1, memory_order_relaxed);
+        pthread_join(r->thread, NULL);
+        r->running = 0;
+    }
+}
+
+
+/**
+ * Releases the ring, stopping its thread first
+ */
+void tokring_free(TokenRing *r){
+    tokring_stop(r);
+    free(r->slots);
+    r->slots = NULL;
+}
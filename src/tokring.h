@@ -0,0 +1,93 @@
+#ifndef TOKRING_H
+#define TOKRING_H
+
+#include "lexer.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+
+/**
+ * @file tokring.h
+ * @brief Lexer on its own thread, feeding the parser through a lock-free ring of token
+ *        batches
+ *
+ * The ring has one producer (the lexer thread) and one consumer (the parser), so it
+ * needs no lock: the producer fills the batch at `tail` and publishes it by advancing
+ * `tail`, the consumer reads the batch at `head` and gives it back by advancing `head`.
+ * The two counters live on separate cache lines, and each side reads the other's only
+ * when its cached copy says the ring is full (producer) or empty (consumer). A side that
+ * has to wait spins briefly, then yields the CPU
+ *
+ * The lexer stops after the end of the input or the first invalid token; the consumer
+ * then keeps receiving that last token, as it would from `lexer_next`. The lexer must
+ * not be used by anyone else until `tokring_stop`, except for `lexer_text`; the error of
+ * the last token may be read once the consumer has received it
+ */
+
+
+/**
+ * Tokens per batch, which is the unit of synchronization
+ */
+#define TOKRING_BATCH 512
+
+/**
+ * Batches in the ring (a power of two): how far the lexer may run ahead
+ */
+#define TOKRING_SLOTS 16
+
+
+/**
+ * @struct TokenBatch
+ * @brief Tokens published together
+ */
+typedef struct{
+    Token tokens[TOKRING_BATCH];
+    size_t count;
+} TokenBatch;
+
+
+/**
+ * @struct TokenRing
+ * @brief The ring and the state of both sides
+ */
+typedef struct{
+    TokenBatch *slots;
+
+    //Producer side
+    _Alignas(64) atomic_size_t tail;    //Batches published
+    size_t head_seen;                   //Last value of `head` read by the producer
+    Lexer *lexer;
+    pthread_t thread;
+    int running;
+
+    //Consumer side
+    _Alignas(64) atomic_size_t head;    //Batches given back
+    size_t tail_seen;                   //Last value of `tail` read by the consumer
+    const TokenBatch *cur;              //Batch being read, null before the first one
+    size_t pos;                         //Next token of `cur`
+    int done;                           //`cur` ends with the last token
+    Token last;
+
+    _Alignas(64) atomic_int stop;       //The consumer gave up: the producer must exit
+} TokenRing;
+
+int tokring_init(TokenRing *r);     //0 on success, -1 if memory allocation fails
+int tokring_start(TokenRing *r, Lexer *lexer);  //Lexes the rest of the input on a new thread: 0, -1 if it cannot start
+Token tokring_refill(TokenRing *r); //Slow path of `tokring_next`
+void tokring_stop(TokenRing *r);    //Stops and joins the lexer thread
+void tokring_free(TokenRing *r);
+
+
+/**
+ * Returns the next token, in the order `lexer_next` would have returned them
+ */
+static inline Token tokring_next(TokenRing *r){
+    if(r->cur && r->pos < r->cur->count){
+        return r->cur->tokens[r->pos++];
+    }
+
+    return tokring_refill(r);
+}
+
+#endif
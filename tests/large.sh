@@ -0,0 +1,60 @@
+#!/bin/sh
+# Checks the paths that only large or piped inputs take, which no tests/NAME.in reaches
+# (make test maps them): each option set is run on generated corpora and must give the
+# same output, errors and exit status as its reference run
+#
+# Usage: tests/large.sh EXPR EXPRGEN
+
+expr=$1
+gen=$2
+dir=`mktemp -d /tmp/expr-large.XXXXXX` || exit 1
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+# Above the 1 MB thresholds of --parse-jobs and --print-jobs (of input and of output: the
+# output of deep-left stays above it once folded)
+for s in balanced comments literals deep-left; do
+  "$gen" $s 2500000 > "$dir/$s.txt" || exit 1
+done
+
+# An invalid copy: an invalid character two thirds of the way in
+{ head -c 1600000 "$dir/balanced.txt"; printf '#'; tail -c +1600002 "$dir/balanced.txt"; } > "$dir/invalid.txt"
+
+# A comment that opens just before the end of the first 64 KB window of a streamed input
+# and is never closed
+{ printf 'add(1, '; head -c 65520 /dev/zero | tr '\0' ' '; printf '/* '; head -c 200000 /dev/zero | tr '\0' 'x'; } > "$dir/unclosed.txt"
+
+# same OPTIONS REFERENCE: compares `EXPR OPTIONS FILE` with `EXPR REFERENCE FILE` on every corpus
+same(){
+  for f in "$dir"/*.txt; do
+    "$expr" $1 "$f" > "$dir/a.out" 2>&1; echo "status $?" >> "$dir/a.out"
+    "$expr" $2 "$f" > "$dir/b.out" 2>&1; echo "status $?" >> "$dir/b.out"
+
+    if ! cmp -s "$dir/a.out" "$dir/b.out"; then
+      echo "TEST FAILED: `basename "$f"` with $1"; fail=1
+    fi
+  done
+}
+
+same "--parse-jobs 4" ""
+same "--print-jobs 4" ""
+same "--print-jobs 4 -p fold" "-p fold"
+same "--pipeline" ""
+same "--pipeline -p fold" "-p fold"
+
+# piped FILE...: `cat FILE | EXPR --stream` lexes the pipe through a refillable window, with
+# tokens and comments across its ends, and must give what the mapped FILE gives
+piped(){
+  for f in "$@"; do
+    cat "$dir/$f.txt" | "$expr" --stream > "$dir/a.out" 2>&1; echo "status $?" >> "$dir/a.out"
+    "$expr" --stream "$dir/$f.txt" > "$dir/b.out" 2>&1; echo "status $?" >> "$dir/b.out"
+
+    if ! cmp -s "$dir/a.out" "$dir/b.out"; then
+      echo "TEST FAILED: $f.txt piped to --stream"; fail=1
+    fi
+  done
+}
+
+piped comments literals invalid unclosed
+
+exit $fail